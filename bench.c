@@ -0,0 +1,799 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "set.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define BENCH_THREADS
+#endif
+
+// build with e.g. `cc -O2 -pthread bench.c set.c -o bench` and run `./bench [n]`.
+// to also count allocations with GNU ld, add
+// `-DBENCH_COUNT_ALLOCS -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free`
+
+#ifdef BENCH_COUNT_ALLOCS
+static size_t alloc_calls, free_calls;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+void __real_free(void* p);
+
+void* __wrap_malloc(size_t size) { ++alloc_calls; return __real_malloc(size); }
+void* __wrap_calloc(size_t count, size_t size) { ++alloc_calls; return __real_calloc(count, size); }
+void* __wrap_realloc(void* p, size_t size) { ++alloc_calls; return __real_realloc(p, size); }
+void __wrap_free(void* p) { ++free_calls; __real_free(p); }
+#endif
+
+static double seconds(clock_t start) {
+	return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// buffered only applies to sorted sets
+static void bench_insert(const char* name, set_engine engine, bool buffered, int n) {
+	clock_t start = clock();
+	int* st = set_create_engine(engine);
+
+	set_use_buffer(st, buffered);
+	for (int i = 0; i < n; i++) {
+		set_add(&st, i);
+	}
+	double elapsed = seconds(start);
+
+	printf("insert  %-8s n=%-9d size=%-9zu %8.3fs %8.1f ns/op\n",
+	       name, n, set_size(st), elapsed, elapsed * 1e9 / n);
+	set_free(st);
+}
+
+static void bench_add_many(const char* name, set_engine engine, int n) {
+	int* src = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		src[i] = i;
+	}
+
+	clock_t start = clock();
+	int* st = set_create_engine(engine);
+	set_add_many(&st, src, n);
+	double elapsed = seconds(start);
+
+	printf("bulk    %-8s n=%-9d size=%-9zu %8.3fs %8.1f ns/op\n",
+	       name, n, set_size(st), elapsed, elapsed * 1e9 / n);
+	set_free(st);
+	free(src);
+}
+
+// intersects a 100 element set with an n element one
+static void bench_intersection(int n) {
+	int* src = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		src[i] = i;
+	}
+	int* large = set_create();
+	int* small = set_create();
+	set_add_many(&large, src, n);
+	for (int i = 0; i < 100; i++) {
+		set_add(&small, i * 7);
+	}
+
+	clock_t start = clock();
+	int* both = set_intersection(small, large);
+	double elapsed = seconds(start);
+
+	printf("inter   %-8s n=%-9d size=%-9zu %8.3fs\n", "sorted", n, set_size(both), elapsed);
+	set_free(both);
+	set_free(small);
+	set_free(large);
+	free(src);
+}
+
+// looks up a million keys, about half of them present, one by one and then
+// in a single batch
+static void bench_lookup(const char* name, set_engine engine, int n) {
+	const int queries = 1000000;
+	int* src = malloc(n * sizeof(int));
+	int* keys = malloc(queries * sizeof(int));
+	uint64_t* bitmap = malloc((queries + 63) / 64 * sizeof(uint64_t));
+	for (int i = 0; i < n; i++) {
+		src[i] = i * 2;
+	}
+	srand(1);
+	for (int i = 0; i < queries; i++) {
+		keys[i] = (int)(((unsigned)rand() * 2654435761u) % (2u * n));
+	}
+	int* st = set_create_engine(engine);
+	set_add_many(&st, src, n);
+
+	size_t hits = 0;
+	clock_t start = clock();
+	for (int i = 0; i < queries; i++) {
+		hits += set_contains(&st, keys[i]).code;
+	}
+	double one_by_one = seconds(start);
+
+	start = clock();
+	size_t batch_hits = set_contains_many(st, keys, queries, bitmap);
+	double batched = seconds(start);
+
+	printf("lookup  %-8s n=%-9d hits=%-9zu %8.1f ns/op single %8.1f ns/op batched%s\n",
+	       name, n, hits, one_by_one * 1e9 / queries, batched * 1e9 / queries,
+	       hits == batch_hits ? "" : " MISMATCH");
+	set_free(st);
+	free(bitmap);
+	free(keys);
+	free(src);
+}
+
+// many short lived sets: each "request" builds 100 sets of 16 elements and
+// drops them all at the end
+static void bench_churn(const char* name, const set_allocator* allocator, set_arena* arena) {
+	const int requests = 10000, sets = 100;
+	int* live[100];
+
+	clock_t start = clock();
+	for (int r = 0; r < requests; r++) {
+		for (int s = 0; s < sets; s++) {
+			live[s] = set_create_with_allocator(allocator);
+			for (int i = 0; i < 16; i++) {
+				set_add(&live[s], r + s * 16 + i);
+			}
+		}
+		if (arena != NULL) {
+			set_arena_reset(arena);
+			continue;
+		}
+		for (int s = 0; s < sets; s++) {
+			set_free(live[s]);
+		}
+	}
+	double elapsed = seconds(start);
+
+	printf("churn   %-8s %d sets %8.3fs %8.1f ns/set\n",
+	       name, requests * sets, elapsed, elapsed * 1e9 / (requests * sets));
+}
+
+// fills a swiss set one element at a time, so it grows through every
+// capacity, with malloc and with the mapped allocator
+static void bench_mapped(int n) {
+	set_mmap mapped;
+	set_mmap_init(&mapped, 0, true);
+	const set_allocator* allocators[] = { NULL, &mapped.allocator };
+	const char* names[] = { "malloc", "mmap" };
+
+	for (int a = 0; a < 2; a++) {
+		clock_t start = clock();
+		int* st = set_create_engine_with_allocator(SET_ENGINE_SWISS, allocators[a]);
+		for (int i = 0; i < n; i++) {
+			set_add(&st, i);
+		}
+		double elapsed = seconds(start);
+		printf("grow    %-8s n=%-9d %8.1f ns/insert\n", names[a], n, elapsed * 1e9 / n);
+		set_free(st);
+	}
+}
+
+// membership checks against 4096 possible ids, a quarter of them present,
+// and a full intersection of two such sets
+static void bench_bitmap(void) {
+	const int universe = 4096, queries = 10000000;
+	set_bitmap bm = set_create_bitmap(universe);
+	set_bitmap other = set_create_bitmap(universe);
+	uint16_t* st = set_create_engine(SET_ENGINE_SWISS);
+	for (int i = 0; i < universe; i += 4) {
+		set_bitmap_add(bm, i);
+		set_bitmap_add(other, i / 2);
+		set_add(&st, (uint16_t)i);
+	}
+
+	size_t hits = 0;
+	clock_t start = clock();
+	for (int i = 0; i < queries; i++) {
+		hits += set_bitmap_contains(bm, (i * 2654435761u) % universe);
+	}
+	double bitmap_time = seconds(start);
+
+	start = clock();
+	for (int i = 0; i < queries; i++) {
+		hits -= set_contains(&st, (uint16_t)((i * 2654435761u) % universe)).code;
+	}
+	double set_time = seconds(start);
+
+	start = clock();
+	for (int i = 0; i < 100000; i++) {
+		set_bitmap_intersection_update(&other, bm);
+	}
+	double inter = seconds(start);
+
+	printf("bitmap  u=%-9d %8.1f ns/op contains, swiss %8.1f ns/op%s, %6.1f ns/intersection\n",
+	       universe, bitmap_time * 1e9 / queries, set_time * 1e9 / queries,
+	       hits == 0 ? "" : " MISMATCH", inter * 1e9 / 100000);
+	set_free(st);
+	set_bitmap_free(other);
+	set_bitmap_free(bm);
+}
+
+// erases every other element of a set, one value at a time with set_discard
+// and then in a single set_discard_many call
+static void bench_discard(const char* name, set_engine engine, int n) {
+	int* values = malloc(n / 2 * sizeof(int));
+	for (int i = 0; i < n / 2; i++) {
+		values[i] = i * 2;
+	}
+
+	int* st = set_create_engine(engine);
+	for (int i = 0; i < n; i++) {
+		set_add(&st, i);
+	}
+	clock_t start = clock();
+	for (int i = 0; i < n / 2; i++) {
+		set_discard(&st, values[i]);
+	}
+	double single = seconds(start);
+	set_free(st);
+
+	st = set_create_engine(engine);
+	for (int i = 0; i < n; i++) {
+		set_add(&st, i);
+	}
+	start = clock();
+	size_t removed = set_discard_many(&st, values, n / 2);
+	double batched = seconds(start);
+
+	printf("discard %-8s n=%-9d left=%-9zu %8.1f ns/op single %8.1f ns/op batched%s\n", name, n,
+	       (size_t)set_size(st), single * 1e9 / (n / 2), batched * 1e9 / (n / 2),
+	       removed == (size_t)(n / 2) ? "" : " MISMATCH");
+	set_free(st);
+	free(values);
+}
+
+static bool is_below(const void* element, void* ctx) {
+	return *(const int*)element < *(const int*)ctx;
+}
+
+// drops the lower half of a sorted set with a set_remove loop, set_remove_if
+// and set_remove_range
+static void bench_remove_if(int n) {
+	int half = n / 2;
+	int* st = set_create();
+	for (int i = 0; i < n; i++) {
+		set_add(&st, i);
+	}
+	int* copy = set_copy(st);
+	clock_t start = clock();
+	for (int i = (int)set_size(copy) - 1; i >= 0; i--) {
+		if (copy[i] < half) {
+			set_remove(copy, i);
+		}
+	}
+	double loop = seconds(start);
+	set_free(copy);
+
+	copy = set_copy(st);
+	start = clock();
+	size_t removed = set_remove_if(copy, is_below, &half);
+	double pred = seconds(start);
+	set_free(copy);
+
+	copy = set_copy(st);
+	start = clock();
+	removed += set_remove_range(copy, INT32_MIN, half - 1);
+	double range = seconds(start);
+	set_free(copy);
+
+	printf("rm_if   %-8s n=%-9d %8.1f ns/elem loop %8.1f ns/elem pred %8.1f ns/elem range%s\n", "sorted", n,
+	       loop * 1e9 / n, pred * 1e9 / n, range * 1e9 / n, removed == (size_t)half * 2 ? "" : " MISMATCH");
+	set_free(st);
+}
+
+// builds a sorted set with set_add_many, saves it, and maps it back in with
+// set_open_mmap, looking up every element of the mapped copy
+static void bench_file(int n) {
+	const char* path = "bench.set";
+	int* src = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		src[i] = i * 3;
+	}
+
+	clock_t start = clock();
+	int* st = set_create();
+	set_add_many(&st, src, n);
+	double build = seconds(start);
+
+	start = clock();
+	bool saved = set_save(st, path);
+	double save = seconds(start);
+	set_free(st);
+
+	start = clock();
+	int* mapped = saved ? set_open_mmap(path, int) : NULL;
+	double open = seconds(start);
+
+	size_t hits = 0;
+	start = clock();
+	for (int i = 0; mapped != NULL && i < n; i++) {
+		hits += set_contains(&mapped, src[i]).code;
+	}
+	double lookup = seconds(start);
+
+	printf("file    %-8s n=%-9d %8.3fs build %8.3fs save %8.6fs open %8.1f ns/lookup%s\n", "sorted", n,
+	       build, save, open, lookup * 1e9 / n, hits == (size_t)n ? "" : " MISMATCH");
+	if (mapped != NULL) {
+		set_free(mapped);
+	}
+	remove(path);
+	free(src);
+}
+
+// one by one inserts and a million lookups in a sorted set with a directory
+static void bench_directory(int n) {
+	const int queries = 1000000;
+	int* keys = malloc(queries * sizeof(int));
+	uint64_t* bitmap = malloc((queries + 63) / 64 * sizeof(uint64_t));
+	srand(1);
+	for (int i = 0; i < queries; i++) {
+		keys[i] = (int)(((unsigned)rand() * 2654435761u) % (2u * n));
+	}
+
+	clock_t start = clock();
+	int* st = set_create();
+	set_use_directory(st, true);
+	for (int i = 0; i < n; i++) {
+		set_add(&st, i * 2);
+	}
+	double insert_time = seconds(start);
+
+	size_t hits = 0;
+	start = clock();
+	for (int i = 0; i < queries; i++) {
+		hits += set_contains(&st, keys[i]).code;
+	}
+	double lookup_time = seconds(start);
+
+	start = clock();
+	size_t batch_hits = set_contains_many(st, keys, queries, bitmap);
+	double batched = seconds(start);
+
+	printf("lookup  %-8s n=%-9d hits=%-9zu %8.1f ns/op single %8.1f ns/op batched, %8.1f ns/insert%s\n",
+	       "dir", n, hits, lookup_time * 1e9 / queries, batched * 1e9 / queries, insert_time * 1e9 / n,
+	       hits == batch_hits ? "" : " MISMATCH");
+	set_free(st);
+	free(bitmap);
+	free(keys);
+}
+
+// a million lookups, about half of them present, in a sorted set before
+// and after set_freeze
+static void bench_frozen(int n) {
+	const int queries = 1000000;
+	int* src = malloc(n * sizeof(int));
+	int* keys = malloc(queries * sizeof(int));
+	uint64_t* bitmap = malloc((queries + 63) / 64 * sizeof(uint64_t));
+	for (int i = 0; i < n; i++) {
+		src[i] = i * 2;
+	}
+	srand(1);
+	for (int i = 0; i < queries; i++) {
+		keys[i] = (int)(((unsigned)rand() * 2654435761u) % (2u * n));
+	}
+	int* st = set_create();
+	set_add_many(&st, src, n);
+
+	size_t hits = 0;
+	clock_t start = clock();
+	for (int i = 0; i < queries; i++) {
+		hits += set_contains(&st, keys[i]).code;
+	}
+	double sorted_time = seconds(start);
+
+	start = clock();
+	set_freeze(st);
+	double freeze_time = seconds(start);
+
+	start = clock();
+	for (int i = 0; i < queries; i++) {
+		hits -= set_contains(&st, keys[i]).code;
+	}
+	double frozen_time = seconds(start);
+
+	start = clock();
+	size_t batch_hits = set_contains_many(st, keys, queries, bitmap);
+	double batched = seconds(start);
+
+	printf("frozen  n=%-9d %8.1f ns/op sorted %8.1f ns/op frozen %8.1f ns/op batched, freeze %8.3fs%s\n",
+	       n, sorted_time * 1e9 / queries, frozen_time * 1e9 / queries, batched * 1e9 / queries,
+	       freeze_time, hits == 0 && batch_hits > 0 ? "" : " MISMATCH");
+	set_free(st);
+	free(bitmap);
+	free(keys);
+	free(src);
+}
+
+// n document ids, one in three present, held as a sorted set (4 bytes of data
+// and an 8 byte hash each) and as a roaring set, and the intersection of each
+// with a set of every fifth id
+static void bench_roaring(int n) {
+	uint32_t* src = malloc(n * sizeof(uint32_t));
+	uint32_t* fifths = malloc(n * sizeof(uint32_t));
+	int m = 0;
+	for (int i = 0; i < n; i++) {
+		src[i] = (uint32_t)i * 3;
+		if (i % 5 == 0) {
+			fifths[m++] = (uint32_t)i * 3 + i % 3;
+		}
+	}
+	uint32_t* st = set_create();
+	uint32_t* other = set_create();
+	set_add_many(&st, src, n);
+	set_add_many(&other, fifths, m);
+	set_roaring* r = set_create_roaring();
+	set_roaring* ro = set_create_roaring();
+	for (int i = 0; i < n; i++) {
+		set_roaring_add(r, src[i]);
+	}
+	for (int i = 0; i < m; i++) {
+		set_roaring_add(ro, fifths[i]);
+	}
+	set_roaring_optimize(r);
+	set_roaring_optimize(ro);
+
+	size_t sorted_bytes = set_capacity(st) * (sizeof(uint32_t) + sizeof(uint64_t));
+	size_t roaring_bytes = set_roaring_memory(r);
+
+	clock_t start = clock();
+	uint32_t* both = set_intersection(st, other);
+	double sorted_time = seconds(start);
+
+	start = clock();
+	set_roaring* rboth = set_roaring_intersection(r, ro);
+	double roaring_time = seconds(start);
+
+	printf("roaring n=%-9d %5.2f bytes/id, sorted %5.2f bytes/id; intersection %8.3fms, sorted %8.3fms%s\n",
+	       n, (double)roaring_bytes / n, (double)sorted_bytes / n, roaring_time * 1e3, sorted_time * 1e3,
+	       set_size(both) == set_roaring_size(rboth) ? "" : " MISMATCH");
+	set_roaring_free(rboth);
+	set_roaring_free(ro);
+	set_roaring_free(r);
+	set_free(both);
+	set_free(other);
+	set_free(st);
+	free(fifths);
+	free(src);
+}
+
+static void count_diff(const void* element, bool in_a, void* ctx) {
+	(void)element;
+	(void)in_a;
+	++*(int*)ctx;
+}
+
+// keeps every version while adding n elements one by one, then diffs the
+// newest version against one ten changes older
+static void bench_hamt(int n) {
+	set_hamt** versions = malloc((n + 1) * sizeof(set_hamt*));
+	versions[0] = set_create_hamt(sizeof(int));
+
+	clock_t start = clock();
+	for (int i = 0; i < n; i++) {
+		versions[i + 1] = set_hamt_add(versions[i], &i);
+	}
+	double add_time = seconds(start);
+
+	int found = 0;
+	start = clock();
+	for (int i = 0; i < n; i++) {
+		found += set_hamt_contains(versions[n], &i);
+	}
+	double lookup_time = seconds(start);
+
+	int changes = 0;
+	start = clock();
+	set_hamt_diff(versions[n], versions[n - 10], count_diff, &changes);
+	double diff_time = seconds(start);
+
+	printf("hamt n=%-9d add keeping all versions %8.3fms, lookup %8.3fms, diff of 10 changes %8.3fms%s\n",
+	       n, add_time * 1e3, lookup_time * 1e3, diff_time * 1e3, found == n && changes == 10 ? "" : " MISMATCH");
+	for (int i = 0; i <= n; i++) {
+		set_hamt_free(versions[i]);
+	}
+	free(versions);
+}
+
+#ifdef BENCH_THREADS
+static double wall_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+	set_concurrent* cs;
+	set_sharded* sh;
+	uint64_t** st;	// the shared regular set, for the mutex rows
+	pthread_mutex_t* lock;
+	int first, n;
+} bench_worker;
+
+// adds the thread's share of the elements, then looks each of them up
+static void* concurrent_worker(void* arg) {
+	bench_worker* w = arg;
+	for (int i = w->first; i < w->first + w->n; i++) {
+		uint64_t v = (uint64_t)i * 7919;
+		set_concurrent_add(w->cs, &v);
+	}
+	for (int i = w->first; i < w->first + w->n; i++) {
+		uint64_t v = (uint64_t)i * 7919;
+		set_concurrent_contains(w->cs, &v);
+	}
+	return NULL;
+}
+
+static void* sharded_worker(void* arg) {
+	bench_worker* w = arg;
+	for (int i = w->first; i < w->first + w->n; i++) {
+		uint64_t v = (uint64_t)i * 7919;
+		set_sharded_add(w->sh, &v);
+	}
+	for (int i = w->first; i < w->first + w->n; i++) {
+		uint64_t v = (uint64_t)i * 7919;
+		set_sharded_contains(w->sh, &v);
+	}
+	return NULL;
+}
+
+static void* mutex_worker(void* arg) {
+	bench_worker* w = arg;
+	for (int i = w->first; i < w->first + w->n; i++) {
+		uint64_t v = (uint64_t)i * 7919;
+		pthread_mutex_lock(w->lock);
+		set_add(w->st, v);
+		pthread_mutex_unlock(w->lock);
+	}
+	for (int i = w->first; i < w->first + w->n; i++) {
+		uint64_t v = (uint64_t)i * 7919;
+		pthread_mutex_lock(w->lock);
+		set_contains(w->st, v);
+		pthread_mutex_unlock(w->lock);
+	}
+	return NULL;
+}
+
+// n elements added and looked up by 1 to 64 threads, into a concurrent set,
+// a sharded set of 64 swiss sets and a regular swiss set behind one mutex
+static void bench_concurrent(int n) {
+	void* (*run[3])(void*) = {concurrent_worker, sharded_worker, mutex_worker};
+	pthread_t threads[64];
+	bench_worker workers[64];
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	for (int count = 1; count <= 64; count *= 2) {
+		double times[3];
+		size_t sizes[3];
+		for (int kind = 0; kind < 3; kind++) {
+			set_concurrent* cs = set_create_concurrent(sizeof(uint64_t), 0);
+			set_sharded* sh = set_create_sharded(sizeof(uint64_t), 6, SET_ENGINE_SWISS);
+			uint64_t* st = set_create_engine(SET_ENGINE_SWISS);
+			double start = wall_seconds();
+			for (int i = 0; i < count; i++) {
+				workers[i].cs = cs;
+				workers[i].sh = sh;
+				workers[i].st = &st;
+				workers[i].lock = &lock;
+				workers[i].first = (int)((long long)n * i / count);
+				workers[i].n = (int)((long long)n * (i + 1) / count) - workers[i].first;
+				pthread_create(&threads[i], NULL, run[kind], &workers[i]);
+			}
+			for (int i = 0; i < count; i++) {
+				pthread_join(threads[i], NULL);
+			}
+			times[kind] = wall_seconds() - start;
+			sizes[kind] = kind == 0 ? set_concurrent_size(cs) : kind == 1 ? set_sharded_size(sh) : set_size(st);
+			set_free(st);
+			set_sharded_free(sh);
+			set_concurrent_free(cs);
+		}
+		printf("concurrent n=%-9d threads=%-2d %8.3fms, sharded %8.3fms, mutex %8.3fms%s\n", n, count,
+		       times[0] * 1e3, times[1] * 1e3, times[2] * 1e3,
+		       sizes[0] == (size_t)n && sizes[1] == (size_t)n && sizes[2] == (size_t)n ? "" : " MISMATCH");
+	}
+}
+
+typedef struct {
+	set_rcu* rcu;
+	uint64_t** st;	// the shared set, for the rwlock rows
+	pthread_rwlock_t* lock;
+	int n, found;
+} bench_reader;
+
+static void* rcu_reader(void* arg) {
+	bench_reader* r = arg;
+	set_rcu_reader* handle = set_rcu_register(r->rcu);
+	for (int i = 0; i < r->n; i++) {
+		uint64_t* st = set_rcu_read_begin(r->rcu, handle);
+		r->found += set_contains(&st, (uint64_t)i * 7919).code;
+		set_rcu_read_end(handle);
+	}
+	set_rcu_unregister(handle);
+	return NULL;
+}
+
+static void* rwlock_reader(void* arg) {
+	bench_reader* r = arg;
+	for (int i = 0; i < r->n; i++) {
+		pthread_rwlock_rdlock(r->lock);
+		r->found += set_contains(r->st, (uint64_t)i * 7919).code;
+		pthread_rwlock_unlock(r->lock);
+	}
+	return NULL;
+}
+
+// 8 threads look up n elements each while the main thread publishes 100
+// copies of the set, through a set_rcu and through a set behind a rwlock
+static void bench_rcu(int n) {
+	pthread_t threads[8];
+	bench_reader readers[8];
+	pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+	uint64_t* base = set_create_engine(SET_ENGINE_SWISS);
+	for (int i = 0; i < n; i++) {
+		set_add(&base, (uint64_t)i * 7919);
+	}
+
+	double times[2];
+	int found[2] = {0, 0};
+	for (int rw = 0; rw < 2; rw++) {
+		uint64_t* st = set_copy(base);
+		set_rcu* rcu = rw ? NULL : set_create_rcu(set_copy(base));
+		double start = wall_seconds();
+		for (int i = 0; i < 8; i++) {
+			readers[i].rcu = rcu;
+			readers[i].st = &st;
+			readers[i].lock = &lock;
+			readers[i].n = n;
+			readers[i].found = 0;
+			pthread_create(&threads[i], NULL, rw ? rwlock_reader : rcu_reader, &readers[i]);
+		}
+		for (int i = 0; i < 100; i++) {
+			if (rw) {
+				uint64_t* next = set_copy(base);
+				pthread_rwlock_wrlock(&lock);
+				uint64_t* old = st;
+				st = next;
+				pthread_rwlock_unlock(&lock);
+				set_free(old);
+			} else {
+				set_rcu_publish(rcu, set_copy(base));
+			}
+		}
+		for (int i = 0; i < 8; i++) {
+			pthread_join(threads[i], NULL);
+			found[rw] += readers[i].found;
+		}
+		times[rw] = wall_seconds() - start;
+		set_free(st);
+		if (rcu != NULL) {
+			set_rcu_free(rcu);
+		}
+	}
+	printf("rcu n=%-9d 8 readers %8.3fms, rwlock %8.3fms%s\n", n, times[0] * 1e3, times[1] * 1e3,
+	       found[0] == 8 * n && found[1] == 8 * n ? "" : " MISMATCH");
+	set_free(base);
+}
+#endif
+
+#ifdef BENCH_COUNT_ALLOCS
+// counts the allocator calls made while growing, copying and freeing a set
+static void bench_allocs(int n) {
+	int* src = malloc(n * sizeof(int));
+	for (int i = 0; i < n; i++) {
+		src[i] = i;
+	}
+
+	size_t allocs = alloc_calls, frees = free_calls;
+	int* st = set_create();
+	for (int i = 0; i < n; i++) {
+		set_add(&st, src[i]);
+	}
+	printf("allocs  grow     n=%-9d %6zu allocs %6zu frees\n", n, alloc_calls - allocs, free_calls - frees);
+
+	// a 1.5x policy that starts at 1024 elements and grows by at most 64k
+	set_growth growth = { 1.5, 1024, 65536, 0.0 };
+	allocs = alloc_calls;
+	frees = free_calls;
+	int* grown = set_create();
+	set_use_growth(grown, &growth);
+	for (int i = 0; i < n; i++) {
+		set_add(&grown, src[i]);
+	}
+	printf("allocs  policy   n=%-9d %6zu allocs %6zu frees\n", n, alloc_calls - allocs, free_calls - frees);
+	set_free(grown);
+
+	allocs = alloc_calls;
+	frees = free_calls;
+	int* reserved = set_create();
+	set_reserve(&reserved, n);
+	for (int i = 0; i < n; i++) {
+		set_add(&reserved, src[i]);
+	}
+	printf("allocs  reserve  n=%-9d %6zu allocs %6zu frees\n", n, alloc_calls - allocs, free_calls - frees);
+	set_free(reserved);
+
+	allocs = alloc_calls;
+	frees = free_calls;
+	int* copy = set_copy(st);
+	set_free(copy);
+	printf("allocs  copy     n=%-9d %6zu allocs %6zu frees\n", n, alloc_calls - allocs, free_calls - frees);
+
+	// the first change to a copy is what duplicates the block
+	allocs = alloc_calls;
+	frees = free_calls;
+	copy = set_copy(st);
+	set_add(&copy, -1);
+	set_free(copy);
+	printf("allocs  cow      n=%-9d %6zu allocs %6zu frees\n", n, alloc_calls - allocs, free_calls - frees);
+
+	set_free(st);
+	free(src);
+}
+#endif
+
+int main(int argc, char** argv) {
+	int max_n = argc > 1 ? atoi(argv[1]) : 100000;
+
+#ifdef BENCH_COUNT_ALLOCS
+	bench_allocs(max_n < 100000 ? max_n : 100000);
+#endif
+
+	set_arena arena;
+	set_pool pool;
+	set_arena_init(&arena, 64 * 1024);
+	set_pool_init(&pool);
+	bench_churn("malloc", NULL, NULL);
+	bench_churn("arena", &arena.allocator, &arena);
+	bench_churn("pool", &pool.allocator, NULL);
+	set_arena_release(&arena);
+	set_pool_release(&pool);
+	bench_bitmap();
+	bench_mapped(max_n);
+	bench_file(max_n);
+#ifdef BENCH_THREADS
+	bench_concurrent(max_n);
+	bench_rcu(max_n);
+#endif
+
+	for (int n = 1000; n <= max_n; n *= 10) {
+		// one by one inserts into a sorted set are quadratic
+		if (n <= 100000) {
+			bench_insert("sorted", SET_ENGINE_SORTED, false, n);
+		}
+		bench_insert("swiss", SET_ENGINE_SWISS, false, n);
+		bench_insert("adaptive", SET_ENGINE_ADAPTIVE, false, n);
+		bench_insert("pma", SET_ENGINE_PMA, false, n);
+		if (n <= 100000) {
+			bench_insert("buffered", SET_ENGINE_SORTED, true, n);
+		}
+		bench_add_many("sorted", SET_ENGINE_SORTED, n);
+		bench_add_many("swiss", SET_ENGINE_SWISS, n);
+		bench_intersection(n);
+		bench_lookup("sorted", SET_ENGINE_SORTED, n);
+		bench_lookup("swiss", SET_ENGINE_SWISS, n);
+		bench_lookup("adaptive", SET_ENGINE_ADAPTIVE, n);
+		bench_lookup("pma", SET_ENGINE_PMA, n);
+		// discarding one by one from a sorted set shifts the rest each time
+		if (n <= 100000) {
+			bench_discard("sorted", SET_ENGINE_SORTED, n);
+		}
+		bench_discard("swiss", SET_ENGINE_SWISS, n);
+		bench_discard("pma", SET_ENGINE_PMA, n);
+		if (n <= 100000) {
+			bench_remove_if(n);
+		}
+		// the directory doesn't make one by one inserts any cheaper
+		if (n <= 100000) {
+			bench_directory(n);
+		}
+		bench_frozen(n);
+		bench_roaring(n);
+		bench_hamt(n);
+	}
+
+	return 0;
+}
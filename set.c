@@ -31,99 +31,621 @@ OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	// for mremap
+#endif
+
 #include "set.h"
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 
+#ifdef __linux__
+#define SET_MMAP
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define SET_MAP_FILES
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SET_SSE2
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef __LP64__
+typedef uint64_t set_hash_t;
+#else
+typedef uint32_t set_hash_t;
+#endif
+
+// the swiss engine's control bytes: a full slot stores the low 7 bits of its
+// element's hash, and a free slot has the top bit set
+#define SWISS_EMPTY ((int8_t)-128)
+#define SWISS_DELETED ((int8_t)-2)
+#define SWISS_GROUP 16
+
+typedef struct {
+	set_size_t mask;	// number of slots - 1
+	set_size_t used;	// full + deleted slots
+	int8_t* ctrl;		// one byte per slot, followed by a copy of the first group
+	set_size_t* slots;	// index of the slot's element in the set data
+} set_swiss;
+
+// the pma engine's index: the hashes of the set in sorted order, spread over
+// a packed memory array with gaps, so that an insert only shifts cells up to
+// the nearest gap and runs out of room in a segment only now and then. when
+// it does, the smallest enclosing window that is sparse enough is spread out
+// evenly again. a gap keeps the hash of a neighbour, so the hashes stay in
+// order and can be binary searched
+#define SET_PMA_GAP ((set_size_t)-1)
+#define SET_PMA_MIN 16
+
+typedef struct {
+	set_size_t capacity;	// cells, a power of two
+	set_size_t segment;	// cells per segment, a power of two around log2(capacity)
+	set_hash_t* hashes;
+	set_size_t* slots;	// position of the cell's element in the set data, or SET_PMA_GAP
+	set_size_t* counts;	// elements in each segment
+} set_pma;
+
+// a set is a single allocation: the header, then capacity elements, then
+// (aligned for set_hash_t) the hash of each element
+//
+//     +--------+-------------------+-----------------+
+//     | header | data[capacity]    | _hash[capacity] |
+//     +--------+-------------------+-----------------+
+//
+// small sets leave the hashes out and are searched by comparing the elements
+// directly, until they grow past SET_SMALL_MAX elements and get promoted to
+// their engine's hashed layout. adaptive sets whose elements are integers in
+// a narrow range leave them out too, and index the elements with a bitmap
+
+#define SET_SMALL_MAX 16
+
+// a dense index may cover up to this many keys per element
+#define SET_DENSE_FACTOR 4
+
+// header flags
+#define SET_FLAG_SMALL 1	// no hashes (or swiss table) yet
+#define SET_FLAG_DENSE 2	// indexed by a set_dense instead of hashes
+#define SET_FLAG_DIRECTORY 4	// keeps a set_directory while it's sorted and hashed
+#define SET_FLAG_BUFFER 8	// sorted set that appends new elements and merges them later
+
+// copies share their block until one of them changes, counting the sharers in
+// the block's header. the count is atomic where the compiler offers it, so
+// that copies handed to other threads can be freed there
+#if defined(__GNUC__) || defined(__clang__)
+#define SET_REFS_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SET_REFS_INC(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define SET_REFS_DEC(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#else
+#define SET_REFS_LOAD(p) (*(p))
+#define SET_REFS_INC(p) (++*(p))
+#define SET_REFS_DEC(p) (--*(p))
+#endif
+
+// sorted sets with a buffer merge their unsorted tail once it has this many
+// elements
+#define SET_BUFFER_MAX 64
+
+// the dense index of an adaptive set: a bit for every key in [base, base + range)
+// and, for the keys that are present, the position of their element
+typedef struct {
+	uint64_t base;
+	set_size_t range;
+	set_type_t type_size;
+	uint64_t* bits;
+	uint32_t* pos;
+} set_dense;
+
+// a static search tree over the hashes of a frozen sorted set. the hashes
+// themselves are its leaves, in blocks of SET_FROZEN_KEYS, and every node of
+// the levels above holds the largest hash under each of its first
+// SET_FROZEN_KEYS children (it has one more). a node fills one cache line, so
+// a lookup takes a miss per level of a tree with fanout 9 instead of a miss
+// per halving
+#define SET_FROZEN_KEYS 8
+#define SET_FROZEN_FANOUT (SET_FROZEN_KEYS + 1)
+#define SET_FROZEN_MAX_LEVELS 24
+
+typedef struct {
+	set_size_t levels;	// internal levels, not counting the hashes
+	set_size_t offset[SET_FROZEN_MAX_LEVELS + 1];	// where each level starts in keys
+	set_hash_t* keys;	// the nodes, aligned to 64 bytes
+	void* block;		// the allocation keys points into
+	size_t block_size;
+} set_frozen;
+
+// an optional directory over the hashes of a sorted set: start[b] is the
+// position of the first hash whose top bits are at least b. the hashes are
+// close to uniform, so a bucket holds about SET_DIRECTORY_LOAD of them and
+// an interpolation search inside it usually lands on the right one at once
+#define SET_DIRECTORY_LOAD 4
+#define SET_DIRECTORY_MAX_BITS 26
+// buckets smaller than this are scanned instead of interpolated
+#define SET_DIRECTORY_SCAN 8
+
+typedef struct {
+	set_size_t bits;
+	set_size_t start[];	// (1 << bits) + 1 positions
+} set_directory;
+
 typedef struct {
 	set_size_t size;
 	set_size_t capacity;
-	#ifdef __LP64__
-	uint64_t* _hash;
-	#else
-	uint32_t* _hash;
-	#endif
+	set_hash_t* _hash;	// points into the same allocation, after data
+	set_swiss* _swiss;
+	set_pma* _pma;
+	set_dense* _dense;
+	set_frozen* _frozen;	// only sorted sets are frozen, until they change
+	set_directory* _directory;
+	set_size_t buffered;	// unsorted elements at the end of a buffered set
+	set_size_t refs;	// sets sharing this block, see _set_copy
+	const set_allocator* allocator;	// used for every allocation the set makes
+	const set_growth* growth;
+	uint32_t engine;	// a set_engine. engine and flags share a word so data stays aligned
+	uint32_t flags;
 	unsigned char data[];
 } set_header;
 
-#ifdef __LP64__
-uint64_t _default_hash(unsigned char *value);
-pack binsearch_array(set_header* h, uint64_t value);
-#else
-uint32_t _default_hash(unsigned char *value);
-pack binsearch_array(set_header* h, uint32_t value);
-#endif
+set_hash_t _default_hash(const void* value, set_type_t len);
+pack binsearch_array(set_header* h, set_hash_t value);
+
+static pack swiss_find(set_header* h, const void* value, set_type_t type_size, set_hash_t value_hash);
+static void swiss_add(set_header* h, set_size_t pos);
+static void swiss_unlink(set_header* h, set_size_t pos);
+static void swiss_renumber(set_header* h, set_size_t from, set_size_t to);
+static void swiss_rebuild(set_header* h, set_size_t slot_count);
+static void swiss_free(set_header* h);
+static pack pma_find(set_header* h, const void* value, set_type_t type_size, set_hash_t value_hash);
+static pack pma_match(set_header* h, const void* value, set_type_t type_size, set_hash_t value_hash, set_size_t cell);
+static void pma_add(set_header* h, set_size_t pos);
+static void pma_unlink(set_header* h, set_size_t pos);
+static void pma_renumber(set_header* h, set_size_t from, set_size_t to);
+static void pma_erase(set_header* h, set_size_t pos, set_size_t len);
+static void pma_rebuild(set_header* h);
+static set_pma* pma_copy(set_header* h);
+static void pma_free(set_header* h);
+static pack dense_find(set_header* h, const void* value, set_type_t type_size);
+static bool dense_insert(set_header* h, set_type_t type_size, set_size_t pos);
+static void dense_erase(set_header* h, set_type_t type_size, set_size_t pos, set_size_t len);
+static void dense_build(set_header* h, set_type_t type_size, uint64_t base, set_size_t range);
+static set_dense* dense_copy(set_header* h);
+static void dense_free(set_header* h);
+static bool set_key_range(set_header* h, set_type_t type_size, uint64_t* lo, uint64_t* hi);
+static bool set_key(const void* value, set_type_t type_size, uint64_t* key);
+static unsigned set_ctz(uint32_t m);
+static unsigned set_popcount64(uint64_t x);
+static pack frozen_find(set_header* h, set_hash_t value);
+static void frozen_lower_bound_group(set_header* h, const set_hash_t* hashes, set_size_t* pos, set_size_t count);
+static void set_thaw(set_header* h);
+static void set_flush_header(set_header* h, set_type_t type_size);
+static const set_allocator* set_copy_allocator(set_header* h);
+static set_header* set_duplicate(set_header* h, set_type_t type_size, set_size_t capacity);
+static set_header* set_unshare(set_header* h, set_type_t type_size);
+static pack directory_find(set_header* h, set_hash_t value);
+static void directory_lower_bound_group(set_header* h, const set_hash_t* hashes, set_size_t* pos, set_size_t count);
+static void directory_build(set_header* h);
+static void directory_insert(set_header* h, set_hash_t value);
+static void directory_erase(set_header* h, set_size_t pos, set_size_t len);
+static set_directory* directory_copy(set_header* h);
+static void directory_free(set_header* h);
 
 set_header* set_get_header(set st) { return &((set_header*)st)[-1]; }
 
-set set_create(void) {
-	set_header* h = (set_header*)malloc(sizeof(set_header));
+// offset of the hash array from the start of the header
+static size_t set_hash_offset(set_size_t capacity, set_type_t type_size) {
+	size_t data_size = capacity * type_size;
+	return sizeof(set_header) + (data_size + sizeof(set_hash_t) - 1) / sizeof(set_hash_t) * sizeof(set_hash_t);
+}
+
+static size_t set_alloc_size(set_size_t capacity, set_type_t type_size, bool hashed) {
+	return set_hash_offset(capacity, type_size) + (hashed ? capacity * sizeof(set_hash_t) : 0);
+}
+
+static bool set_is_small(set_header* h) {
+	return (h->flags & SET_FLAG_SMALL) != 0;
+}
+
+static bool set_is_hashed(set_header* h) {
+	return (h->flags & (SET_FLAG_SMALL | SET_FLAG_DENSE)) == 0;
+}
+
+static void* set_default_alloc(void* ctx, size_t size) {
+	(void)ctx;
+	return malloc(size);
+}
+
+static void* set_default_realloc(void* ctx, void* p, size_t old_size, size_t new_size) {
+	(void)ctx;
+	(void)old_size;
+	return realloc(p, new_size);
+}
+
+static void set_default_free(void* ctx, void* p, size_t size) {
+	(void)ctx;
+	(void)size;
+	free(p);
+}
+
+static const set_allocator set_default_allocator = {
+	set_default_alloc, set_default_realloc, set_default_free, NULL
+};
+
+// doubles from a capacity of 8 and never shrinks on its own
+static const set_growth set_default_growth = { 2.0, 8, 0, 0.0 };
+
+static void* set_alloc(const set_allocator* a, size_t size) {
+	return a->alloc_fn(a->ctx, size);
+}
+
+static void* set_resize(const set_allocator* a, void* p, size_t old_size, size_t new_size) {
+	return a->realloc_fn(a->ctx, p, old_size, new_size);
+}
+
+static void set_dealloc(const set_allocator* a, void* p, size_t size) {
+	if (p != NULL) {
+		a->free_fn(a->ctx, p, size);
+	}
+}
+
+set set_create(void) { return set_create_engine_with_allocator(SET_ENGINE_SORTED, NULL); }
+
+set set_create_engine(set_engine engine) { return set_create_engine_with_allocator(engine, NULL); }
+
+set set_create_with_allocator(const set_allocator* allocator) {
+	return set_create_engine_with_allocator(SET_ENGINE_SORTED, allocator);
+}
+
+set set_create_engine_with_allocator(set_engine engine, const set_allocator* allocator) {
+	if (allocator == NULL) {
+		allocator = &set_default_allocator;
+	}
+
+	set_header* h = (set_header*)set_alloc(allocator, sizeof(set_header));
 	h->capacity = 0;
 	h->size = 0;
-        h->_hash = malloc(0 * sizeof(uint64_t));
-        
+	h->_hash = (set_hash_t*)h->data;
+	h->_swiss = NULL;
+	h->_pma = NULL;
+	h->_dense = NULL;
+	h->_frozen = NULL;
+	h->_directory = NULL;
+	h->buffered = 0;
+	h->refs = 1;
+	h->allocator = allocator;
+	h->growth = &set_default_growth;
+	h->engine = engine;
+	h->flags = SET_FLAG_SMALL;
+
 	return &h->data;
 }
 
-void set_free(set st) { free(set_get_header(st)); }
+// the type size isn't known here, but the hashes are the last thing in the
+// block, so the block's size can be worked out from where they end
+static size_t set_block_size(set_header* h) {
+	set_size_t hashes = set_is_hashed(h) ? h->capacity : 0;
+	return (size_t)((unsigned char*)(h->_hash + hashes) - (unsigned char*)h);
+}
+
+static void set_destroy(set_header* h) {
+	swiss_free(h);
+	pma_free(h);
+	dense_free(h);
+	set_thaw(h);
+	directory_free(h);
+	set_dealloc(h->allocator, h, set_block_size(h));
+}
+
+void set_free(set st) {
+	set_header* h = set_get_header(st);
+
+	if (SET_REFS_DEC(&h->refs) == 0) {
+		set_destroy(h);
+	}
+}
 
 set_size_t set_size(set st) { return set_get_header(st)->size; }
 
 set_size_t set_capacity(set st) { return set_get_header(st)->capacity; }
 
-set_header* set_realloc(set_header* h, set_type_t type_size) {
-        set_size_t old_capacity = h->capacity;
-        #ifdef __LP64__
-        uint64_t *old_hash = malloc(old_capacity * sizeof(uint64_t));
-        memcpy(old_hash, h->_hash, old_capacity * sizeof(uint64_t));
-        #else
-        uint32_t *old_hash = malloc(old_capacity * sizeof(uint32_t));
-        memcpy(old_hash, h->_hash, old_capacity * sizeof(uint32_t));
-        #endif
-        set_size_t old_size = h->size;
-	set_size_t new_capacity = (h->capacity == 0) ? 1 : h->capacity * 2;
-	set_header* new_h = (set_header*)realloc(h, sizeof(set_header) + new_capacity * type_size);
+// resizes a set to hold new_capacity elements with one realloc, sliding the
+// hashes to their new place behind the element data
+static set_header* set_grow(set_header* h, set_type_t type_size, set_size_t new_capacity) {
+	size_t old_offset = set_hash_offset(h->capacity, type_size);
+	size_t new_offset = set_hash_offset(new_capacity, type_size);
+	bool hashed = set_is_hashed(h);
+	set_size_t size = hashed ? h->size : 0;
+
+	if (new_offset < old_offset) {
+		memmove((unsigned char*)h + new_offset, h->_hash, size * sizeof(set_hash_t));
+	}
+	set_header* new_h = (set_header*)set_resize(h->allocator, h,
+		set_alloc_size(h->capacity, type_size, hashed), set_alloc_size(new_capacity, type_size, hashed));
 	new_h->capacity = new_capacity;
-	new_h->size = old_size;
-	#ifdef __LP64__
-	uint64_t* new_hash = malloc(new_capacity * sizeof(uint64_t));
-	memcpy(new_hash, old_hash, old_capacity * sizeof(uint64_t));
-	#else
-	uint32_t* new_hash = malloc(new_capacity * sizeof(uint32_t));
-	memcpy(new_hash, old_hash, old_capacity * sizeof(uint32_t));
-	#endif
-	
-	free(old_hash);
-	free(h->_hash);
-	
-	new_h->_hash = new_hash;
+	new_h->_hash = (set_hash_t*)((unsigned char*)new_h + new_offset);
+	if (new_offset > old_offset) {
+		memmove(new_h->_hash, (unsigned char*)new_h + old_offset, size * sizeof(set_hash_t));
+	}
 	
 	return new_h;
 }
 
+// the capacity a set that needs room for needed elements grows to under its
+// growth policy
+static set_size_t set_next_capacity(set_header* h, set_size_t needed) {
+	const set_growth* g = h->growth;
+	set_size_t step = (set_size_t)((double)h->capacity * (g->factor - 1.0));
+	set_size_t capacity;
+
+	if (g->max_step != 0 && step > g->max_step) {
+		step = g->max_step;
+	}
+	capacity = h->capacity + (step > 0 ? step : 1);
+	if (capacity < g->min_capacity) {
+		capacity = g->min_capacity;
+	}
+	return capacity > needed ? capacity : needed;
+}
+
+set_header* set_realloc(set_header* h, set_type_t type_size) {
+	return set_grow(h, type_size, set_next_capacity(h, h->size + 1));
+}
+
+// shrinks a set's block (and its swiss table) down to capacity elements
+static set_header* set_shrink(set_header* h, set_type_t type_size, set_size_t capacity) {
+	if (h->_swiss != NULL && (h->_swiss->mask + 1) / 2 / 8 * 7 >= h->size * 2) {
+		// rebuilding from the smallest table grows it back to just what's needed
+		swiss_rebuild(h, SWISS_GROUP);
+	}
+	if (h->_pma != NULL && h->_pma->capacity > SET_PMA_MIN && h->_pma->capacity / 4 >= h->size * 2) {
+		pma_rebuild(h);
+	}
+	return capacity < h->capacity ? set_grow(h, type_size, capacity) : h;
+}
+
+// applies the auto-shrink threshold of a set's growth policy after elements
+// were removed
+static set_header* set_maybe_shrink(set_header* h, set_type_t type_size) {
+	const set_growth* g = h->growth;
+
+	if (g->shrink_below <= 0.0 || h->capacity <= g->min_capacity ||
+	    (double)h->size >= (double)h->capacity * g->shrink_below) {
+		return h;
+	}
+	return set_shrink(h, type_size, h->size > g->min_capacity ? h->size : g->min_capacity);
+}
+
+void set_use_growth(set st, const set_growth* growth) {
+	set_get_header(st)->growth = growth != NULL ? growth : &set_default_growth;
+}
+
 bool set_has_space(set_header* h) {
 	return h->capacity - h->size > 0;
 }
 
-pack set_contains(set* set_addr, unsigned char value) {
+#ifdef SET_SSE2
+// bits of a 16 byte compare mask where each element of a given size starts
+static uint32_t set_small_starts(set_type_t type_size) {
+	switch (type_size) {
+	case 1: return 0xffff;
+	case 2: return 0x5555;
+	case 4: return 0x1111;
+	case 8: return 0x0101;
+	case 16: return 0x0001;
+	default: return 0;
+	}
+}
+#endif
+
+// linear search of a small set. elements whose size divides 16 are compared
+// a vector at a time against the value repeated across a register
+static pack set_small_find(set_header* h, const void* value, set_type_t type_size) {
+	set_size_t i = 0;
+	pack result;
+
+#ifdef SET_SSE2
+	uint32_t starts = set_small_starts(type_size);
+	if (starts != 0) {
+		unsigned char pattern[16];
+		for (size_t k = 0; k < sizeof(pattern); k += type_size) {
+			memcpy(&pattern[k], value, type_size);
+		}
+		__m128i needle = _mm_loadu_si128((const __m128i*)pattern);
+		set_size_t per_vector = 16 / type_size;
+
+		for (; i + per_vector <= h->size; i += per_vector) {
+			__m128i v = _mm_loadu_si128((const __m128i*)&h->data[i * type_size]);
+			uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+			// an element matches when all of its bytes do
+			for (set_type_t k = 1; k < type_size; k <<= 1) {
+				m &= m >> k;
+			}
+			m &= starts;
+			if (m) {
+				result.code = true;
+				result.index = i + set_ctz(m) / type_size;
+				return result;
+			}
+		}
+	}
+#endif
+	for (; i < h->size; i++) {
+		if (memcmp(&h->data[i * type_size], value, type_size) == 0) {
+			result.code = true;
+			result.index = i;
+			return result;
+		}
+	}
+
+	result.code = false;
+	result.index = h->size;
+	return result;
+}
+
+static void set_sort_by_hash(set_header* h, set_type_t type_size);
+
+// gives a small or dense set its hashes, and its swiss table if it uses one
+static set_header* set_to_hashed(set_header* h, set_type_t type_size) {
+	size_t offset = set_hash_offset(h->capacity, type_size);
+
+	dense_free(h);
+	h = (set_header*)set_resize(h->allocator, h,
+		set_alloc_size(h->capacity, type_size, false), set_alloc_size(h->capacity, type_size, true));
+	h->_hash = (set_hash_t*)((unsigned char*)h + offset);
+	h->flags &= ~(uint32_t)(SET_FLAG_SMALL | SET_FLAG_DENSE);
+
+	for (set_size_t i = 0; i < h->size; i++) {
+		h->_hash[i] = _default_hash(&h->data[i * type_size], type_size);
+	}
+	if (h->engine == SET_ENGINE_PMA) {
+		h->_pma = (set_pma*)set_alloc(h->allocator, sizeof(set_pma));
+		memset(h->_pma, 0, sizeof(set_pma));
+		pma_rebuild(h);
+	} else if (h->engine != SET_ENGINE_SORTED) {
+		h->_swiss = (set_swiss*)set_alloc(h->allocator, sizeof(set_swiss));
+		memset(h->_swiss, 0, sizeof(set_swiss));
+		swiss_rebuild(h, SWISS_GROUP);
+	} else {
+		set_sort_by_hash(h, type_size);
+		if (h->flags & SET_FLAG_DIRECTORY) {
+			directory_build(h);
+		}
+	}
+	return h;
+}
+
+// drops the hashes and swiss table of a set, shrinking its block to match
+static set_header* set_drop_hashes(set_header* h, set_type_t type_size) {
+	swiss_free(h);
+	if (set_is_hashed(h)) {
+		h = (set_header*)set_resize(h->allocator, h,
+			set_alloc_size(h->capacity, type_size, true), set_alloc_size(h->capacity, type_size, false));
+		h->_hash = (set_hash_t*)((unsigned char*)h + set_hash_offset(h->capacity, type_size));
+	}
+	return h;
+}
+
+static set_header* set_to_dense(set_header* h, set_type_t type_size, uint64_t lo, uint64_t hi) {
+	h = set_drop_hashes(h, type_size);
+	h->flags = (h->flags & ~(uint32_t)SET_FLAG_SMALL) | SET_FLAG_DENSE;
+	dense_build(h, type_size, lo, (set_size_t)(hi - lo) + 1);
+	return h;
+}
+
+static set_header* set_to_small(set_header* h, set_type_t type_size) {
+	h = set_drop_hashes(h, type_size);
+	dense_free(h);
+	h->flags = (h->flags & ~(uint32_t)SET_FLAG_DENSE) | SET_FLAG_SMALL;
+	return h;
+}
+
+// whether the integer elements of a set are close enough together for a
+// dense index
+static bool set_is_dense_enough(set_header* h, set_type_t type_size, uint64_t* lo, uint64_t* hi) {
+	return h->size < UINT32_MAX && set_key_range(h, type_size, lo, hi) &&
+	       *hi - *lo < (uint64_t)h->size * SET_DENSE_FACTOR;
+}
+
+// called when a small set outgrows SET_SMALL_MAX
+static set_header* set_promote(set_header* h, set_type_t type_size) {
+	uint64_t lo, hi;
+
+	if (h->engine == SET_ENGINE_ADAPTIVE && set_is_dense_enough(h, type_size, &lo, &hi)) {
+		return set_to_dense(h, type_size, lo, hi);
+	}
+	return set_to_hashed(h, type_size);
+}
+
+// lets an adaptive set switch containers after an element was added. sets
+// that shrank a lot (erasing can't move a set) become small again, dense
+// sets that became too sparse get hashed, and hashed sets are checked for
+// density whenever their size reaches a power of two, so the O(n) checks
+// and conversions are amortised over the adds in between
+static set_header* set_adapt(set_header* h, set_type_t type_size) {
+	uint64_t lo, hi;
+
+	if (set_is_small(h)) {
+		return h->size > SET_SMALL_MAX ? set_promote(h, type_size) : h;
+	}
+	if (h->size <= SET_SMALL_MAX / 2) {
+		return set_to_small(h, type_size);
+	}
+	if (h->_dense != NULL) {
+		if (h->_dense->range / 4 > (set_size_t)h->size * SET_DENSE_FACTOR) {
+			return set_to_hashed(h, type_size);
+		}
+		return h;
+	}
+	if ((h->size & (h->size - 1)) == 0 && set_is_dense_enough(h, type_size, &lo, &hi)) {
+		return set_to_dense(h, type_size, lo, hi);
+	}
+	return h;
+}
+
+// looks for value among the unsorted elements at the end of a buffered set
+static pack set_buffer_find(set_header* h, const void* value, set_type_t type_size, set_hash_t value_hash) {
+	pack result;
+
+	for (set_size_t i = h->size - h->buffered; i < h->size; i++) {
+		if (h->_hash[i] == value_hash && memcmp(&h->data[i * type_size], value, type_size) == 0) {
+			result.code = true;
+			result.index = i;
+			return result;
+		}
+	}
+	result.code = false;
+	result.index = h->size;
+	return result;
+}
+
+pack _set_contains(set* set_addr, const void* value, set_type_t type_size) {
         set_header* h = set_get_header(*set_addr);
+
+        if (set_is_small(h)) {
+                return set_small_find(h, value, type_size);
+        }
+        if (h->_dense != NULL) {
+                return dense_find(h, value, type_size);
+        }
         
-        #ifdef __LP64__
-        uint64_t value_hash = _default_hash(&value);
-        #else
-        uint32_t value_hash = _default_hash(&value);
-        #endif
+        set_hash_t value_hash = _default_hash(value, type_size);
+
+        if (h->_swiss != NULL) {
+                return swiss_find(h, value, type_size, value_hash);
+        }
+        if (h->_pma != NULL) {
+                return pma_find(h, value, type_size, value_hash);
+        }
         
-        /*     DEPRECATED
-        for (int i = 0; i != set_size(&h->data); i++) {
-                if (h->data[i] == value) {
-                        return true;
+        pack result = h->_frozen != NULL ? frozen_find(h, value_hash) :
+                      h->_directory != NULL ? directory_find(h, value_hash) : binsearch_array(h, value_hash);
+        set_size_t sorted = h->size - h->buffered;
+
+        // different elements can share a hash, so check the whole run of them
+        for (set_size_t i = result.index; i < sorted && h->_hash[i] == value_hash; i++) {
+                if (memcmp(&h->data[i * type_size], value, type_size) == 0) {
+                        result.code = true;
+                        result.index = i;
+                        return result;
                 }
-                //printf("%hhu %hhu\n", h->data[i], value);
         }
-        */
-        
-        pack result = binsearch_array(h, value_hash);
+        result.code = false;
+
+        // buffered sets keep the newest elements unsorted at the end, and
+        // append the next one there too
+        if (h->flags & SET_FLAG_BUFFER) {
+                result = set_buffer_find(h, value, type_size, value_hash);
+        }
         
         return result;
 }
@@ -140,10 +662,12 @@ pack set_contains(set* set_addr, unsigned char value) {
 }*/
 
 void* _set_insert_dst(set* set_addr, set_type_t type_size, set_size_t pos) {
-	set_header* h = set_get_header(*set_addr);
+	set_header* h = set_unshare(set_get_header(*set_addr), type_size);
+	*set_addr = h->data;
 
 	set_size_t new_length = h->size + 1;
 
+	set_thaw(h);
 	// make sure there is enough room for the new element
 	if (!set_has_space(h)) {
 		h = set_realloc(h, type_size);
@@ -159,115 +683,4533 @@ void* _set_insert_dst(set* set_addr, set_type_t type_size, set_size_t pos) {
 	return &h->data[pos * type_size];
 }
 
-void _hash_add(set* set_addr, unsigned char value, set_size_t pos) {
+void _hash_add(set* set_addr, const void* value, set_type_t type_size, set_size_t pos) {
         set_header* h = set_get_header(*set_addr);
-        #ifdef __LP64__
-        uint64_t value_hash = _default_hash(&value);
-        #else
-        uint32_t value_hash = _default_hash(&value);
-        #endif
-        
-        memmove(&h->_hash[(pos + 1) * sizeof(value_hash)],
-	        &h->_hash[pos * sizeof(value_hash)],
-	        (h->size - pos) * sizeof(value_hash));
-	
-        h->_hash[pos * sizeof(value_hash)] = value_hash;
+
+        if (set_is_small(h)) {
+                if (h->size > SET_SMALL_MAX) {
+                        *set_addr = set_promote(h, type_size)->data;
+                }
+                return;
+        }
+
+        if (h->_dense != NULL) {
+                if (!dense_insert(h, type_size, pos)) {
+                        h = set_to_hashed(h, type_size);
+                }
+        } else if (h->flags & SET_FLAG_BUFFER && h->_swiss == NULL && h->_pma == NULL) {
+                // buffered sets always append, see _set_contains
+                h->_hash[pos] = _default_hash(value, type_size);
+                if (++h->buffered >= SET_BUFFER_MAX) {
+                        set_flush_header(h, type_size);
+                }
+        } else {
+                set_hash_t value_hash = _default_hash(value, type_size);
+
+                // the element at pos has already been counted in h->size
+                memmove(&h->_hash[pos + 1],
+                        &h->_hash[pos],
+                        (h->size - 1 - pos) * sizeof(value_hash));
+                
+                h->_hash[pos] = value_hash;
+
+                if (h->_swiss != NULL) {
+                        swiss_add(h, pos);
+                } else if (h->_pma != NULL) {
+                        pma_add(h, pos);
+                } else if (h->_directory != NULL) {
+                        directory_insert(h, value_hash);
+                }
+        }
+
+        if (h->engine == SET_ENGINE_ADAPTIVE) {
+                h = set_adapt(h, type_size);
+        }
+        *set_addr = h->data;
 }
 
-void _set_erase(set st, set_type_t type_size, set_size_t pos, set_size_t len) {
-	set_header* h = set_get_header(st);
-	memmove(&h->data[pos * type_size],
-		&h->data[(pos + len) * type_size],
-		(h->size - pos - len) * type_size);
+// an element of a batch passed to _set_add_many
+typedef struct {
+	set_hash_t hash;
+	set_size_t pos;	// index into the source array
+} set_batch_entry;
 
-	h->size -= len;
+// LSD radix sort on the hash, 8 bits per pass. passes where every key has
+// the same digit are skipped, and the sort is stable so equal hashes keep
+// their source order
+static set_batch_entry* set_radix_sort(set_batch_entry* a, set_batch_entry* tmp, set_size_t n) {
+	for (unsigned shift = 0; shift < sizeof(set_hash_t) * 8; shift += 8) {
+		set_size_t count[256] = {0};
+		for (set_size_t i = 0; i < n; i++) {
+			++count[(a[i].hash >> shift) & 0xff];
+		}
+		if (count[(a[0].hash >> shift) & 0xff] == n) {
+			continue;
+		}
+
+		set_size_t offset = 0;
+		for (unsigned d = 0; d < 256; d++) {
+			set_size_t c = count[d];
+			count[d] = offset;
+			offset += c;
+		}
+		for (set_size_t i = 0; i < n; i++) {
+			tmp[count[(a[i].hash >> shift) & 0xff]++] = a[i];
+		}
+
+		set_batch_entry* swap = a;
+		a = tmp;
+		tmp = swap;
+	}
+	return a;
+}
+
+// puts the elements of a set in hash order, along with their hashes
+static void set_sort_by_hash(set_header* h, set_type_t type_size) {
+	set_size_t n = h->size;
+	size_t entries_size = 2 * n * sizeof(set_batch_entry);
+
+	if (n < 2) {
+		return;
+	}
+	set_batch_entry* entries = (set_batch_entry*)set_alloc(h->allocator, entries_size);
+	unsigned char* values = (unsigned char*)set_alloc(h->allocator, n * type_size);
+
+	memcpy(values, h->data, n * type_size);
+	for (set_size_t i = 0; i < n; i++) {
+		entries[i].hash = h->_hash[i];
+		entries[i].pos = i;
+	}
+	set_batch_entry* sorted = set_radix_sort(entries, entries + n, n);
+	for (set_size_t i = 0; i < n; i++) {
+		memcpy(&h->data[i * type_size], &values[sorted[i].pos * type_size], type_size);
+		h->_hash[i] = sorted[i].hash;
+	}
+
+	set_dealloc(h->allocator, values, n * type_size);
+	set_dealloc(h->allocator, entries, entries_size);
 }
 
-void _set_remove(set st, set_type_t type_size, set_size_t pos) {
-	_set_erase(st, type_size, pos, 1);
+// merges n new elements, sorted by hash and taken from values, into a sorted
+// set that has room for them
+static void set_merge_entries(set_header* h, set_type_t type_size, const unsigned char* values, const set_batch_entry* sorted, set_size_t n) {
+	// merge from the back so every existing element moves at most once, in
+	// blocks that sit between two consecutive new elements
+	set_size_t end = h->size;
+	for (set_size_t j = n; j-- > 0;) {
+		set_size_t start = end;
+		while (start > 0 && h->_hash[start - 1] > sorted[j].hash) {
+			--start;
+		}
+		memmove(&h->data[(start + j + 1) * type_size],
+			&h->data[start * type_size],
+			(end - start) * type_size);
+		memmove(&h->_hash[start + j + 1],
+			&h->_hash[start],
+			(end - start) * sizeof(set_hash_t));
+
+		memcpy(&h->data[(start + j) * type_size], &values[sorted[j].pos * type_size], type_size);
+		h->_hash[start + j] = sorted[j].hash;
+		end = start;
+	}
+	h->size += n;
 }
 
-void set_pop(set st) { --set_get_header(st)->size; }
+// sorts the buffered elements at the end of a set and merges them into the
+// rest in one pass. they already have their room, so the set never moves
+static void set_flush_header(set_header* h, set_type_t type_size) {
+	set_size_t n = h->buffered;
 
-void _set_reserve(set* set_addr, set_type_t type_size, set_size_t capacity) {
-	set_header* h = set_get_header(*set_addr);
-	if (h->capacity >= capacity) {
+	if (n == 0) {
 		return;
 	}
 
-	h = (set_header*)realloc(h, sizeof(set_header) + capacity * type_size);
-	h->capacity = capacity;
-	*set_addr = &h->data;
+	size_t values_size = n * type_size;
+	size_t entries_size = 2 * n * sizeof(set_batch_entry);
+	unsigned char* values = (unsigned char*)set_alloc(h->allocator, values_size);
+	set_batch_entry* entries = (set_batch_entry*)set_alloc(h->allocator, entries_size);
+	h->size -= n;
+	h->buffered = 0;
+	memcpy(values, &h->data[h->size * type_size], values_size);
+	for (set_size_t i = 0; i < n; i++) {
+		entries[i].hash = h->_hash[h->size + i];
+		entries[i].pos = i;
+	}
+
+	set_merge_entries(h, type_size, values, set_radix_sort(entries, entries + n, n), n);
+	if (h->_directory != NULL) {
+		directory_build(h);
+	}
+
+	set_dealloc(h->allocator, values, values_size);
+	set_dealloc(h->allocator, entries, entries_size);
 }
 
-set _set_copy(set st, set_type_t type_size) {
-	set_header* h = set_get_header(st);
-	size_t alloc_size = sizeof(set_header) + h->size * type_size;
-	set_header* copy_h = (set_header*)malloc(alloc_size);
-	memcpy(copy_h, h, alloc_size);
-	copy_h->capacity = copy_h->size;
+void _set_flush(set* set_addr, set_type_t type_size) {
+	set_header* h = set_get_header(*set_addr);
 
-	return &copy_h->data;
+	if (h->buffered == 0) {
+		return;
+	}
+	h = set_unshare(h, type_size);
+	*set_addr = h->data;
+	set_flush_header(h, type_size);
 }
 
-// FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
-#ifdef __LP64__
-uint64_t _default_hash(unsigned char *value) {
-    size_t i, len = strlen(value);
-    uint64_t h = 14695981039346656037ULL; // FNV_OFFSET 64 bit
-    for (i = 0; i < len; ++i) {
-        h = h ^ value[i];
-        h = h * 1099511628211ULL; // FNV_PRIME 64 bit
-    }
-    return h;
+void _set_use_buffer(set* set_addr, set_type_t type_size, bool enabled) {
+	set_header* h = set_get_header(*set_addr);
+
+	if (h->engine != SET_ENGINE_SORTED) {
+		return;
+	}
+	// the flag lives in the block, so the set needs a block of its own
+	h = set_unshare(h, type_size);
+	*set_addr = h->data;
+	if (enabled) {
+		h->flags |= SET_FLAG_BUFFER;
+		return;
+	}
+	set_flush_header(h, type_size);
+	h->flags &= ~(uint32_t)SET_FLAG_BUFFER;
 }
-#else
-uint32_t _default_hash(unsigned char *value) {
-    size_t i, len = strlen(value);
-    uint32_t h = 2166136261; // FNV_OFFSET 32 bit
-    for (i = 0; i < len; ++i) {
-        h = h ^ value[i];
-        h = h * 16777619; // FNV_PRIME 32 bit
-    }
-    return h;
+
+// the header to read a set through in hash order. a set that shares its block
+// can't have its buffer merged in place, so it's read through a merged copy
+// instead, which set_release_flushed frees again
+static set_header* set_flushed(set_header* h, set_type_t type_size) {
+	if (h->buffered == 0) {
+		return h;
+	}
+	if (SET_REFS_LOAD(&h->refs) != 1) {
+		h = set_duplicate(h, type_size, h->capacity);
+	}
+	set_flush_header(h, type_size);
+	return h;
 }
-#endif
 
-#ifdef __LP64__
-pack binsearch_array(set_header* h, uint64_t value) {
-#else
-pack binsearch_array(set_header* h, uint32_t value) {
-#endif
-    #ifdef __LP64__
-    uint64_t *a = h->_hash;
-    uint64_t l = 0, r = (h->capacity != 0) ? h->capacity : 0; 
-    uint64_t m;
-    #else
-    uint32_t *a = h->_hash;
-    uint32_t l = 0, r = (h->capacity != 0) ? h->capacity : 0;
-    uint32_t m;
-    #endif
-    
-    pack result;
-    
-    while (r > l) {
-        m = (l + r) / 2;
+static void set_release_flushed(set_header* flushed, set_header* h) {
+	if (flushed != h) {
+		set_destroy(flushed);
+	}
+}
 
-        if (a[m] < value) {
-            l = m + 1;
-        } else if (a[m] > value) {
-            r = m - 1;
-        } else {
-            result.code = true;
-            result.index = m;
-            return result;
-        }
-    }
-    result.index = l;
-    if (a[l] == value) {
-        result.code = true;
-    } else {
-        result.code = false;
-    }
-    return result;
+void _set_add_many(set* set_addr, set_type_t type_size, const void* src, set_size_t n) {
+	set_header* h = set_get_header(*set_addr);
+	const unsigned char* values = (const unsigned char*)src;
+
+	if (n == 0) {
+		return;
+	}
+	h = set_unshare(h, type_size);
+	*set_addr = h->data;
+	set_thaw(h);
+	set_flush_header(h, type_size);
+
+	if (set_is_small(h)) {
+		if (h->size + n > SET_SMALL_MAX) {
+			h = set_promote(h, type_size);
+			*set_addr = h->data;
+		} else {
+			if (h->capacity < h->size + n) {
+				h = set_grow(h, type_size, set_next_capacity(h, h->size + n));
+				*set_addr = h->data;
+			}
+			for (set_size_t i = 0; i < n; i++) {
+				const void* value = &values[i * type_size];
+				if (!set_small_find(h, value, type_size).code) {
+					memcpy(&h->data[h->size++ * type_size], value, type_size);
+				}
+			}
+			return;
+		}
+	}
+
+	if (h->engine != SET_ENGINE_SORTED) {
+		// nothing to merge, but the set only has to grow once
+		if (h->capacity < h->size + n) {
+			h = set_grow(h, type_size, set_next_capacity(h, h->size + n));
+			*set_addr = h->data;
+		}
+		for (set_size_t i = 0; i < n; i++) {
+			const void* value = &values[i * type_size];
+			pack answer = _set_contains(set_addr, value, type_size);
+			if (!answer.code) {
+				h = set_get_header(*set_addr);
+				memcpy(&h->data[h->size++ * type_size], value, type_size);
+				// adaptive sets may switch containers here
+				_hash_add(set_addr, value, type_size, answer.index);
+			}
+		}
+		return;
+	}
+
+	size_t entries_size = 2 * n * sizeof(set_batch_entry);
+	set_batch_entry* entries = (set_batch_entry*)set_alloc(h->allocator, entries_size);
+	for (set_size_t i = 0; i < n; i++) {
+		entries[i].hash = _default_hash(&values[i * type_size], type_size);
+		entries[i].pos = i;
+	}
+	set_batch_entry* sorted = set_radix_sort(entries, entries + n, n);
+
+	// drop the elements that are repeated in the batch or already in the set.
+	// both sides are sorted by hash, so one forward walk over _hash is enough
+	set_size_t kept = 0, run = 0, i = 0;
+	for (set_size_t j = 0; j < n; j++) {
+		set_batch_entry e = sorted[j];
+		const void* value = &values[e.pos * type_size];
+		bool duplicate = false;
+
+		if (kept == 0 || sorted[kept - 1].hash != e.hash) {
+			run = kept;
+		}
+		for (set_size_t k = run; k < kept && !duplicate; k++) {
+			duplicate = memcmp(&values[sorted[k].pos * type_size], value, type_size) == 0;
+		}
+
+		while (i < h->size && h->_hash[i] < e.hash) {
+			++i;
+		}
+		for (set_size_t k = i; k < h->size && h->_hash[k] == e.hash && !duplicate; k++) {
+			duplicate = memcmp(&h->data[k * type_size], value, type_size) == 0;
+		}
+
+		if (!duplicate) {
+			sorted[kept++] = e;
+		}
+	}
+
+	if (kept == 0) {
+		set_dealloc(h->allocator, entries, entries_size);
+		return;
+	}
+	if (h->capacity < h->size + kept) {
+		h = set_grow(h, type_size, set_next_capacity(h, h->size + kept));
+		*set_addr = h->data;
+	}
+
+	set_merge_entries(h, type_size, values, sorted, kept);
+	if (h->_directory != NULL) {
+		directory_build(h);
+	}
+
+	set_dealloc(h->allocator, entries, entries_size);
+}
+
+void _set_erase(set* set_addr, set_type_t type_size, set_size_t pos, set_size_t len) {
+	set_header* h = set_unshare(set_get_header(*set_addr), type_size);
+
+	*set_addr = h->data;
+	set_thaw(h);
+	if (h->_dense != NULL) {
+		dense_erase(h, type_size, pos, len);
+		return;
+	}
+
+	if (h->_swiss != NULL) {
+		// the erased slots become tombstones and the slots of the elements
+		// that slide down are pointed at their new positions, which has to
+		// happen while their hashes are still at the old ones
+		for (set_size_t i = pos; i < pos + len; i++) {
+			swiss_unlink(h, i);
+		}
+		for (set_size_t i = pos + len; i < h->size; i++) {
+			swiss_renumber(h, i, i - len);
+		}
+	}
+
+	memmove(&h->data[pos * type_size],
+		&h->data[(pos + len) * type_size],
+		(h->size - pos - len) * type_size);
+	if (set_is_hashed(h)) {
+		memmove(&h->_hash[pos],
+			&h->_hash[pos + len],
+			(h->size - pos - len) * sizeof(set_hash_t));
+	}
+
+	if (h->_swiss != NULL) {
+		h->size -= len;
+		return;
+	}
+	if (h->_pma != NULL) {
+		pma_erase(h, pos, len);
+		h->size -= len;
+		return;
+	}
+	if (h->_directory != NULL) {
+		directory_erase(h, pos, len);
+	}
+	if (h->buffered > 0) {
+		// the part of [pos, pos + len) that was in the buffer
+		set_size_t first = h->size - h->buffered > pos ? h->size - h->buffered : pos;
+		h->buffered -= pos + len > first ? pos + len - first : 0;
+	}
+
+	h->size -= len;
+}
+
+void _set_remove(set* set_addr, set_type_t type_size, set_size_t pos) {
+	_set_erase(set_addr, type_size, pos, 1);
+}
+
+void _set_pop(set* set_addr, set_type_t type_size) {
+	set_header* h = set_unshare(set_get_header(*set_addr), type_size);
+
+	*set_addr = h->data;
+	set_thaw(h);
+	if (h->_swiss != NULL) {
+		swiss_unlink(h, h->size - 1);
+	} else if (h->_pma != NULL) {
+		pma_unlink(h, h->size - 1);
+	} else if (h->_dense != NULL) {
+		dense_erase(h, h->_dense->type_size, h->size - 1, 1);
+		return;
+	} else if (h->buffered > 0) {
+		--h->buffered;
+	} else if (h->_directory != NULL) {
+		directory_erase(h, h->size - 1, 1);
+	}
+	--h->size;
+}
+
+// removes the element at pos from a set whose order doesn't matter by moving
+// the last element into its place, so only that one element is renumbered
+static void set_swap_remove(set_header* h, set_type_t type_size, set_size_t pos) {
+	set_size_t last = h->size - 1;
+	uint64_t key;
+
+	if (h->_swiss != NULL) {
+		swiss_unlink(h, pos);
+		if (pos != last) {
+			swiss_renumber(h, last, pos);
+		}
+	} else if (h->_pma != NULL) {
+		pma_unlink(h, pos);
+		if (pos != last) {
+			pma_renumber(h, last, pos);
+		}
+	} else {
+		set_dense* d = h->_dense;
+		set_key(&h->data[pos * type_size], type_size, &key);
+		key -= d->base;
+		d->bits[key / 64] &= ~((uint64_t)1 << (key % 64));
+		if (pos != last) {
+			set_key(&h->data[last * type_size], type_size, &key);
+			d->pos[key - d->base] = (uint32_t)pos;
+		}
+	}
+
+	memcpy(&h->data[pos * type_size], &h->data[last * type_size], type_size);
+	if (set_is_hashed(h)) {
+		h->_hash[pos] = h->_hash[last];
+	}
+	--h->size;
+}
+
+bool _set_discard(set* set_addr, const void* value, set_type_t type_size) {
+	pack answer = _set_contains(set_addr, value, type_size);
+	set_header* h = set_get_header(*set_addr);
+
+	if (!answer.code) {
+		return false;
+	}
+	h = set_unshare(h, type_size);
+	*set_addr = h->data;
+	// sorted and small sets keep their order, the others just fill the hole
+	if (h->_swiss != NULL || h->_pma != NULL || h->_dense != NULL) {
+		set_swap_remove(h, type_size, answer.index);
+	} else {
+		_set_erase(set_addr, type_size, answer.index, 1);
+	}
+	*set_addr = set_maybe_shrink(h, type_size)->data;
+	return true;
+}
+
+// removes the elements whose bits are set in marks, sliding each run of kept
+// elements down to the end of the previous one so data and hashes are
+// compacted in a single stable pass, then rebuilds the set's index once
+static void set_compact(set_header* h, set_type_t type_size, const uint64_t* marks) {
+	set_thaw(h);
+	if (h->_dense != NULL) {
+		// cleared here, the positions of the rest are rebuilt below
+		for (set_size_t i = 0; i < h->size; i++) {
+			if (marks[i / 64] >> (i % 64) & 1) {
+				uint64_t key;
+				set_key(&h->data[i * type_size], type_size, &key);
+				key -= h->_dense->base;
+				h->_dense->bits[key / 64] &= ~((uint64_t)1 << (key % 64));
+			}
+		}
+	}
+
+	bool hashed = set_is_hashed(h);
+	set_size_t w = 0, i = 0, sorted = h->size - h->buffered, removed_buffered = 0;
+	while (i < h->size) {
+		if (marks[i / 64] >> (i % 64) & 1) {
+			removed_buffered += i >= sorted;
+			++i;
+			continue;
+		}
+		set_size_t run = i;
+		while (i < h->size && !(marks[i / 64] >> (i % 64) & 1)) {
+			++i;
+		}
+		if (w != run) {
+			memmove(&h->data[w * type_size], &h->data[run * type_size], (i - run) * type_size);
+			if (hashed) {
+				memmove(&h->_hash[w], &h->_hash[run], (i - run) * sizeof(set_hash_t));
+			}
+		}
+		w += i - run;
+	}
+	h->size = w;
+	h->buffered -= removed_buffered;
+
+	if (h->_swiss != NULL) {
+		swiss_rebuild(h, h->_swiss->mask + 1);
+	} else if (h->_pma != NULL) {
+		pma_rebuild(h);
+	} else if (h->_dense != NULL) {
+		for (set_size_t k = 0; k < h->size; k++) {
+			uint64_t key;
+			set_key(&h->data[k * type_size], type_size, &key);
+			h->_dense->pos[key - h->_dense->base] = (uint32_t)k;
+		}
+	} else if (h->_directory != NULL) {
+		directory_build(h);
+	}
+}
+
+set_size_t _set_discard_many(set* set_addr, const void* values, set_size_t n, set_type_t type_size) {
+	set_header* h = set_get_header(*set_addr);
+	const unsigned char* src = (const unsigned char*)values;
+	const set_allocator* allocator = h->allocator;
+	size_t marks_size = (h->size + 63) / 64 * sizeof(uint64_t);
+	set_size_t removed = 0;
+
+	if (n == 0 || h->size == 0) {
+		return 0;
+	}
+
+	// mark the positions to remove first, so that the set only has to be
+	// compacted once however many values there are
+	uint64_t* marks = (uint64_t*)set_alloc(allocator, marks_size);
+	memset(marks, 0, marks_size);
+	for (set_size_t i = 0; i < n; i++) {
+		pack answer = _set_contains(set_addr, &src[i * type_size], type_size);
+		uint64_t bit = (uint64_t)1 << (answer.index % 64);
+		if (answer.code && !(marks[answer.index / 64] & bit)) {
+			marks[answer.index / 64] |= bit;
+			++removed;
+		}
+	}
+	// a set that nothing was removed from is left as it is, even if it
+	// shares its block or could shrink
+	if (removed != 0) {
+		h = set_unshare(h, type_size);
+		set_compact(h, type_size, marks);
+		*set_addr = set_maybe_shrink(h, type_size)->data;
+	}
+	set_dealloc(allocator, marks, marks_size);
+	return removed;
+}
+
+set_size_t _set_remove_if(set* set_addr, set_type_t type_size, set_predicate pred, void* ctx, bool keep) {
+	set_header* h = set_get_header(*set_addr);
+	const set_allocator* allocator = h->allocator;
+	size_t marks_size = (h->size + 63) / 64 * sizeof(uint64_t);
+	set_size_t removed = 0;
+
+	if (h->size == 0) {
+		return 0;
+	}
+
+	uint64_t* marks = (uint64_t*)set_alloc(allocator, marks_size);
+	memset(marks, 0, marks_size);
+	for (set_size_t i = 0; i < h->size; i++) {
+		if (pred(&h->data[i * type_size], ctx) != keep) {
+			marks[i / 64] |= (uint64_t)1 << (i % 64);
+			++removed;
+		}
+	}
+	if (removed != 0) {
+		h = set_unshare(h, type_size);
+		set_compact(h, type_size, marks);
+		*set_addr = set_maybe_shrink(h, type_size)->data;
+	}
+	set_dealloc(allocator, marks, marks_size);
+	return removed;
+}
+
+// reads an element of 1, 2, 4 or 8 bytes as a signed integer
+static int64_t set_signed_key(const void* value, set_type_t type_size) {
+	switch (type_size) {
+	case 1: { int8_t v; memcpy(&v, value, 1); return v; }
+	case 2: { int16_t v; memcpy(&v, value, 2); return v; }
+	case 4: { int32_t v; memcpy(&v, value, 4); return v; }
+	default: { int64_t v; memcpy(&v, value, 8); return v; }
+	}
+}
+
+// sets the bit of every element in [lo, hi]. lo and hi are already clamped
+// to the element size
+static void set_mark_range(const set_header* h, set_type_t type_size, int64_t lo, int64_t hi, uint64_t* marks) {
+	set_size_t i = 0;
+
+	// the vector loops mark the elements that are neither below lo nor above hi
+#if defined(__AVX2__)
+	if (type_size == 4) {
+		__m256i l = _mm256_set1_epi32((int32_t)lo), u = _mm256_set1_epi32((int32_t)hi);
+		for (; i < h->size / 8 * 8; i += 8) {
+			__m256i x = _mm256_loadu_si256((const __m256i*)&h->data[i * 4]);
+			__m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(l, x), _mm256_cmpgt_epi32(x, u));
+			unsigned in = ~(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xffu;
+			marks[i / 64] |= (uint64_t)in << (i % 64);
+		}
+	} else if (type_size == 8) {
+		__m256i l = _mm256_set1_epi64x(lo), u = _mm256_set1_epi64x(hi);
+		for (; i < h->size / 4 * 4; i += 4) {
+			__m256i x = _mm256_loadu_si256((const __m256i*)&h->data[i * 8]);
+			__m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(l, x), _mm256_cmpgt_epi64(x, u));
+			unsigned in = ~(unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(out)) & 0xfu;
+			marks[i / 64] |= (uint64_t)in << (i % 64);
+		}
+	}
+#elif defined(SET_SSE2)
+	if (type_size == 4) {
+		__m128i l = _mm_set1_epi32((int32_t)lo), u = _mm_set1_epi32((int32_t)hi);
+		for (; i < h->size / 4 * 4; i += 4) {
+			__m128i x = _mm_loadu_si128((const __m128i*)&h->data[i * 4]);
+			__m128i out = _mm_or_si128(_mm_cmplt_epi32(x, l), _mm_cmpgt_epi32(x, u));
+			unsigned in = ~(unsigned)_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xfu;
+			marks[i / 64] |= (uint64_t)in << (i % 64);
+		}
+	}
+#endif
+	for (; i < h->size; i++) {
+		int64_t v = set_signed_key(&h->data[i * type_size], type_size);
+		if (v >= lo && v <= hi) {
+			marks[i / 64] |= (uint64_t)1 << (i % 64);
+		}
+	}
+}
+
+set_size_t _set_remove_range(set* set_addr, set_type_t type_size, int64_t lo, int64_t hi, bool keep) {
+	set_header* h = set_get_header(*set_addr);
+	const set_allocator* allocator = h->allocator;
+	size_t marks_size = (h->size + 63) / 64 * sizeof(uint64_t);
+	set_size_t removed = 0;
+	uint64_t dummy;
+
+	if (h->size == 0 || !set_key(h->data, type_size, &dummy)) {
+		return 0;
+	}
+
+	// clamp the bounds to the element size so they fit in its vector lanes.
+	// an empty range marks nothing
+	int64_t min = type_size == 8 ? INT64_MIN : -((int64_t)1 << (type_size * 8 - 1));
+	int64_t max = type_size == 8 ? INT64_MAX : ((int64_t)1 << (type_size * 8 - 1)) - 1;
+	uint64_t* marks = (uint64_t*)set_alloc(allocator, marks_size);
+	memset(marks, 0, marks_size);
+	if (lo <= hi && lo <= max && hi >= min) {
+		set_mark_range(h, type_size, lo < min ? min : lo, hi > max ? max : hi, marks);
+	}
+
+	for (size_t w = 0; w < marks_size / sizeof(uint64_t); w++) {
+		if (keep) {
+			marks[w] = ~marks[w];
+		}
+		if (w == (h->size - 1) / 64 && h->size % 64 != 0) {
+			marks[w] &= ((uint64_t)1 << (h->size % 64)) - 1;
+		}
+		removed += set_popcount64(marks[w]);
+	}
+	if (removed != 0) {
+		h = set_unshare(h, type_size);
+		set_compact(h, type_size, marks);
+		*set_addr = set_maybe_shrink(h, type_size)->data;
+	}
+	set_dealloc(allocator, marks, marks_size);
+	return removed;
+}
+
+void _set_reserve(set* set_addr, set_type_t type_size, set_size_t capacity) {
+	set_header* h = set_get_header(*set_addr);
+	if (h->capacity >= capacity) {
+		return;
+	}
+
+	// the block holds the hashes too, so this makes room for both. a small
+	// set that is going to outgrow its inline elements is promoted first, as
+	// it would otherwise move again when it gets its hashes. adaptive sets
+	// are left to pick their container as they fill up. a swiss table is
+	// sized up front as well, so filling the set won't rehash it
+	h = set_unshare(h, type_size);
+	if (set_is_small(h) && capacity > SET_SMALL_MAX && h->engine != SET_ENGINE_ADAPTIVE) {
+		h = set_to_hashed(h, type_size);
+	}
+	h = set_grow(h, type_size, capacity);
+	if (h->_swiss != NULL) {
+		set_size_t slot_count = h->_swiss->mask + 1;
+		while (slot_count / 8 * 7 < capacity) {
+			slot_count *= 2;
+		}
+		if (slot_count != h->_swiss->mask + 1) {
+			swiss_rebuild(h, slot_count);
+		}
+	}
+	*set_addr = &h->data;
+}
+
+void _set_shrink_to_fit(set* set_addr, set_type_t type_size) {
+	set_header* h = set_unshare(set_get_header(*set_addr), type_size);
+
+	h = set_shrink(h, type_size, h->size);
+	*set_addr = &h->data;
+}
+
+// a private copy of the set at h with room for capacity elements, including
+// copies of its indexes. it starts out unfrozen
+static set_header* set_duplicate(set_header* h, set_type_t type_size, set_size_t capacity) {
+	bool hashed = set_is_hashed(h);
+	set_header* copy_h = (set_header*)set_alloc(h->allocator, set_alloc_size(capacity, type_size, hashed));
+
+	// refs is left out of the copy, as other owners may be changing it
+	memcpy(copy_h, h, offsetof(set_header, refs));
+	memcpy((unsigned char*)copy_h + offsetof(set_header, refs) + sizeof(h->refs),
+	       (const unsigned char*)h + offsetof(set_header, refs) + sizeof(h->refs),
+	       sizeof(set_header) - offsetof(set_header, refs) - sizeof(h->refs));
+	memcpy(copy_h->data, h->data, h->size * type_size);
+	copy_h->capacity = capacity;
+	copy_h->refs = 1;
+	copy_h->allocator = set_copy_allocator(h);
+	copy_h->_frozen = NULL;
+	copy_h->_hash = (set_hash_t*)((unsigned char*)copy_h + set_hash_offset(capacity, type_size));
+	if (hashed) {
+		memcpy(copy_h->_hash, h->_hash, h->size * sizeof(set_hash_t));
+	}
+
+	if (h->_swiss != NULL) {
+		// the table indexes this copy's own elements, so it can't be shared
+		set_swiss* t = (set_swiss*)set_alloc(h->allocator, sizeof(set_swiss));
+		set_size_t slot_count = h->_swiss->mask + 1;
+		*t = *h->_swiss;
+		t->ctrl = (int8_t*)set_alloc(h->allocator, slot_count + SWISS_GROUP);
+		t->slots = (set_size_t*)set_alloc(h->allocator, slot_count * sizeof(set_size_t));
+		memcpy(t->ctrl, h->_swiss->ctrl, slot_count + SWISS_GROUP);
+		memcpy(t->slots, h->_swiss->slots, slot_count * sizeof(set_size_t));
+		copy_h->_swiss = t;
+	}
+	if (h->_pma != NULL) {
+		copy_h->_pma = pma_copy(h);
+	}
+	if (h->_dense != NULL) {
+		copy_h->_dense = dense_copy(h);
+	}
+	if (h->_directory != NULL) {
+		copy_h->_directory = directory_copy(h);
+	}
+
+	return copy_h;
+}
+
+// gives a set that is about to change a block of its own. called by every
+// call that changes a set's elements, which all take the set's address
+static set_header* set_unshare(set_header* h, set_type_t type_size) {
+	if (SET_REFS_LOAD(&h->refs) == 1) {
+		return h;
+	}
+
+	set_header* copy_h = set_duplicate(h, type_size, h->capacity);
+	// the other sharers may have let go in the meantime
+	if (SET_REFS_DEC(&h->refs) == 0) {
+		set_destroy(h);
+	}
+	return copy_h;
+}
+
+// copies share the original's block, and whichever of them changes first
+// gets its own block then
+set _set_copy(set st, set_type_t type_size) {
+	(void)type_size;
+	SET_REFS_INC(&set_get_header(st)->refs);
+	return st;
+}
+
+// set algebra. both sets are assumed to hold the same element type. sorted
+// sets are combined with a single merge over their _hash arrays, and swiss
+// sets fall back to looking each element up in the other set
+
+// which elements a combination keeps
+#define SET_KEEP_A 1	// elements only in the first set
+#define SET_KEEP_B 2	// elements only in the second set
+#define SET_KEEP_BOTH 4	// elements in both sets
+
+// switch from a linear walk to galloping once one set is this many times
+// bigger than the other
+#define SET_GALLOP_RATIO 16
+
+// first position in [lo, n) whose hash is not less than value, found with an
+// exponential search followed by a binary search
+static set_size_t set_gallop(const set_hash_t* a, set_size_t lo, set_size_t n, set_hash_t value) {
+	set_size_t hi = lo, step = 1;
+
+	while (hi < n && a[hi] < value) {
+		lo = hi + 1;
+		hi += step;
+		step *= 2;
+	}
+	if (hi > n) {
+		hi = n;
+	}
+	while (lo < hi) {
+		set_size_t m = lo + (hi - lo) / 2;
+		if (a[m] < value) {
+			lo = m + 1;
+		} else {
+			hi = m;
+		}
+	}
+	return lo;
+}
+
+static set_size_t set_advance(const set_hash_t* a, set_size_t i, set_size_t n, set_hash_t value, bool gallop) {
+	if (gallop) {
+		return set_gallop(a, i, n, value);
+	}
+	while (i < n && a[i] < value) {
+		++i;
+	}
+	return i;
+}
+
+// copies the elements [from, to) of src to position w of out, which may be
+// src itself as long as w <= from. a hashed out needs a hashed src
+static set_size_t set_emit(set_header* out, set_size_t w, set_header* src, set_size_t from, set_size_t to, set_type_t type_size) {
+	memmove(&out->data[w * type_size],
+		&src->data[from * type_size],
+		(to - from) * type_size);
+	if (set_is_hashed(out)) {
+		memmove(&out->_hash[w],
+			&src->_hash[from],
+			(to - from) * sizeof(set_hash_t));
+	}
+	return w + (to - from);
+}
+
+static bool set_run_contains(set_header* h, set_size_t from, set_size_t to, const void* value, set_type_t type_size) {
+	for (set_size_t k = from; k < to; k++) {
+		if (memcmp(&h->data[k * type_size], value, type_size) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// merges two sorted sets into out and returns its new size. out may be a
+// unless elements only in b are kept
+static set_size_t set_merge(set_header* out, set_header* a, set_header* b, set_type_t type_size, int keep) {
+	set_size_t na = a->size, nb = b->size, i = 0, j = 0, w = 0;
+	bool gallop_a = na / SET_GALLOP_RATIO > nb, gallop_b = nb / SET_GALLOP_RATIO > na;
+
+	while (i < na && j < nb) {
+		set_size_t next = set_advance(a->_hash, i, na, b->_hash[j], gallop_a);
+		if (keep & SET_KEEP_A) {
+			w = set_emit(out, w, a, i, next, type_size);
+		}
+		if ((i = next) == na) {
+			break;
+		}
+
+		next = set_advance(b->_hash, j, nb, a->_hash[i], gallop_b);
+		if (keep & SET_KEEP_B) {
+			w = set_emit(out, w, b, j, next, type_size);
+		}
+		if ((j = next) == nb || a->_hash[i] != b->_hash[j]) {
+			continue;
+		}
+
+		// both sides have this hash, so compare the elements of both runs
+		set_hash_t value = a->_hash[i];
+		set_size_t end_a = i, end_b = j;
+		while (end_a < na && a->_hash[end_a] == value) {
+			++end_a;
+		}
+		while (end_b < nb && b->_hash[end_b] == value) {
+			++end_b;
+		}
+		for (set_size_t k = i; k < end_a; k++) {
+			bool found = set_run_contains(b, j, end_b, &a->data[k * type_size], type_size);
+			if (keep & (found ? SET_KEEP_BOTH : SET_KEEP_A)) {
+				w = set_emit(out, w, a, k, k + 1, type_size);
+			}
+		}
+		if (keep & SET_KEEP_B) {
+			for (set_size_t k = j; k < end_b; k++) {
+				if (!set_run_contains(a, i, end_a, &b->data[k * type_size], type_size)) {
+					w = set_emit(out, w, b, k, k + 1, type_size);
+				}
+			}
+		}
+		i = end_a;
+		j = end_b;
+	}
+
+	if (keep & SET_KEEP_A) {
+		w = set_emit(out, w, a, i, na, type_size);
+	}
+	if (keep & SET_KEEP_B) {
+		w = set_emit(out, w, b, j, nb, type_size);
+	}
+	return w;
+}
+
+// combines a and b into out by looking elements up instead of merging, for
+// when either set is not sorted. out may be a
+static set set_combine_lookup(set_header* out, set_header* a, set_header* b, set_type_t type_size, int keep) {
+	const set_allocator* allocator = out->allocator;
+	set a_st = a->data, b_st = b->data, out_st;
+	unsigned char* b_only = NULL;
+	set_size_t nb_only = 0, w = 0;
+
+	// collect these first, since out may be a
+	if (keep & SET_KEEP_B) {
+		b_only = (unsigned char*)set_alloc(allocator, b->size * type_size);
+		for (set_size_t k = 0; k < b->size; k++) {
+			if (!_set_contains(&a_st, &b->data[k * type_size], type_size).code) {
+				memcpy(&b_only[nb_only++ * type_size], &b->data[k * type_size], type_size);
+			}
+		}
+	}
+
+	for (set_size_t k = 0; k < a->size; k++) {
+		bool found = _set_contains(&b_st, &a->data[k * type_size], type_size).code;
+		if (keep & (found ? SET_KEEP_BOTH : SET_KEEP_A)) {
+			w = set_emit(out, w, a, k, k + 1, type_size);
+		}
+	}
+	out->size = w;
+	if (set_is_small(out) && w > SET_SMALL_MAX) {
+		out = set_promote(out, type_size);
+	} else if (out->_swiss != NULL) {
+		swiss_rebuild(out, out->_swiss->mask + 1);
+	} else if (out->_pma != NULL) {
+		pma_rebuild(out);
+	} else if (out->_dense != NULL) {
+		dense_build(out, type_size, out->_dense->base, out->_dense->range);
+	}
+
+	out_st = out->data;
+	if (nb_only > 0) {
+		_set_add_many(&out_st, type_size, b_only, nb_only);
+	}
+	set_dealloc(allocator, b_only, b->size * type_size);
+	return out_st;
+}
+
+// whether the set's elements are in hash order
+static bool set_is_mergeable(set_header* h) {
+	return h->engine == SET_ENGINE_SORTED && set_is_hashed(h);
+}
+
+static set set_combine(set a, set b, set_type_t type_size, int keep) {
+	set_header* ha = set_flushed(set_get_header(a), type_size);
+	set_header* hb = set_flushed(set_get_header(b), type_size);
+	set_header* out = set_get_header(set_create_engine_with_allocator((set_engine)ha->engine, set_copy_allocator(ha)));
+	set_size_t capacity = ha->size;
+
+	out->growth = ha->growth;
+	if (keep & SET_KEEP_B) {
+		capacity += hb->size;
+	} else if (!(keep & SET_KEEP_A) && hb->size < capacity) {
+		capacity = hb->size;
+	}
+	if (capacity > 0) {
+		out = set_grow(out, type_size, capacity);
+	}
+
+	set result;
+	if (!set_is_mergeable(ha) || !set_is_mergeable(hb)) {
+		result = set_combine_lookup(out, ha, hb, type_size, keep);
+	} else {
+		out = set_promote(out, type_size);
+		out->size = set_merge(out, ha, hb, type_size, keep);
+		result = out->data;
+	}
+	set_release_flushed(ha, set_get_header(a));
+	set_release_flushed(hb, set_get_header(b));
+	return result;
+}
+
+static void set_combine_update(set* set_addr, set other, set_type_t type_size, int keep) {
+	set_header* h = set_unshare(set_get_header(*set_addr), type_size);
+
+	*set_addr = h->data;
+	set_thaw(h);
+	set_flush_header(h, type_size);
+	set_header* hb = set_flushed(set_get_header(other), type_size);
+	if (!set_is_mergeable(h) || !set_is_mergeable(hb)) {
+		*set_addr = set_combine_lookup(h, h, hb, type_size, keep);
+		h = set_get_header(*set_addr);
+		if (h->_directory != NULL) {
+			directory_build(h);
+		}
+		*set_addr = set_maybe_shrink(h, type_size)->data;
+	} else if (keep & SET_KEEP_B) {
+		// the result can outgrow the set, so merge into a new one and swap
+		set combined = set_combine(*set_addr, hb->data, type_size, keep);
+		if (h->flags & SET_FLAG_DIRECTORY) {
+			_set_use_directory(&combined, type_size, true);
+		}
+		if (h->flags & SET_FLAG_BUFFER) {
+			_set_use_buffer(&combined, type_size, true);
+		}
+		set_free(*set_addr);
+		*set_addr = combined;
+	} else {
+		h->size = set_merge(h, h, hb, type_size, keep);
+		if (h->_directory != NULL) {
+			directory_build(h);
+		}
+		*set_addr = set_maybe_shrink(h, type_size)->data;
+	}
+	set_release_flushed(hb, set_get_header(other));
+}
+
+set _set_union(set a, set b, set_type_t type_size) {
+	return set_combine(a, b, type_size, SET_KEEP_A | SET_KEEP_B | SET_KEEP_BOTH);
+}
+
+set _set_intersection(set a, set b, set_type_t type_size) {
+	return set_combine(a, b, type_size, SET_KEEP_BOTH);
+}
+
+set _set_difference(set a, set b, set_type_t type_size) {
+	return set_combine(a, b, type_size, SET_KEEP_A);
+}
+
+set _set_symmetric_difference(set a, set b, set_type_t type_size) {
+	return set_combine(a, b, type_size, SET_KEEP_A | SET_KEEP_B);
+}
+
+void _set_union_update(set* set_addr, set other, set_type_t type_size) {
+	set_combine_update(set_addr, other, type_size, SET_KEEP_A | SET_KEEP_B | SET_KEEP_BOTH);
+}
+
+void _set_intersection_update(set* set_addr, set other, set_type_t type_size) {
+	set_combine_update(set_addr, other, type_size, SET_KEEP_BOTH);
+}
+
+void _set_difference_update(set* set_addr, set other, set_type_t type_size) {
+	set_combine_update(set_addr, other, type_size, SET_KEEP_A);
+}
+
+void _set_symmetric_difference_update(set* set_addr, set other, set_type_t type_size) {
+	set_combine_update(set_addr, other, type_size, SET_KEEP_A | SET_KEEP_B);
+}
+
+// batched lookups. keys are hashed a group at a time and the searches for
+// the whole group advance in lockstep, prefetching each lane's next probe, so
+// the cache misses of a group overlap instead of being taken one by one
+
+#define SET_LOOKUP_GROUP 16
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SET_PREFETCH(p) __builtin_prefetch(p)
+#elif defined(SET_SSE2)
+#define SET_PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#else
+#define SET_PREFETCH(p) ((void)(p))
+#endif
+
+// finds the lower bound in the len sorted hashes at a of every hash in the
+// group with a branchless binary search, leaving the positions in pos
+static void set_lower_bound_group(const set_hash_t* a, set_size_t len, const set_hash_t* hashes, set_size_t* pos, set_size_t count) {
+	for (set_size_t g = 0; g < count; g++) {
+		pos[g] = 0;
+		SET_PREFETCH(&a[len / 2]);
+	}
+	while (len > 1) {
+		set_size_t half = len / 2;
+		set_size_t next = (len - half) / 2;
+		for (set_size_t g = 0; g < count; g++) {
+			pos[g] += (a[pos[g] + half] < hashes[g]) ? half : 0;
+			SET_PREFETCH(&a[pos[g] + next]);
+		}
+		len -= half;
+	}
+	for (set_size_t g = 0; g < count; g++) {
+		pos[g] += (len == 1 && a[pos[g]] < hashes[g]);
+	}
+}
+
+set_size_t _set_contains_many(set st, set_type_t type_size, const void* keys, set_size_t n, uint64_t* bitmap, set_size_t* hits) {
+	set_header* h = set_get_header(st);
+	const unsigned char* values = (const unsigned char*)keys;
+	set_hash_t hashes[SET_LOOKUP_GROUP];
+	set_size_t pos[SET_LOOKUP_GROUP];
+	set_size_t found = 0;
+
+	if (bitmap != NULL) {
+		memset(bitmap, 0, (n + 63) / 64 * sizeof(uint64_t));
+	}
+
+	for (set_size_t base = 0; base < n; base += SET_LOOKUP_GROUP) {
+		set_size_t count = n - base < SET_LOOKUP_GROUP ? n - base : SET_LOOKUP_GROUP;
+
+		// small and dense sets are searched directly, so there is nothing to hash
+		if (set_is_hashed(h)) {
+			for (set_size_t g = 0; g < count; g++) {
+				hashes[g] = _default_hash(&values[(base + g) * type_size], type_size);
+			}
+			if (h->_swiss != NULL) {
+				for (set_size_t g = 0; g < count; g++) {
+					SET_PREFETCH(&h->_swiss->ctrl[(hashes[g] >> 7) & h->_swiss->mask]);
+				}
+			} else if (h->_pma != NULL) {
+				set_lower_bound_group(h->_pma->hashes, h->_pma->capacity, hashes, pos, count);
+			} else if (h->_frozen != NULL) {
+				frozen_lower_bound_group(h, hashes, pos, count);
+			} else if (h->_directory != NULL) {
+				directory_lower_bound_group(h, hashes, pos, count);
+			} else {
+				set_lower_bound_group(h->_hash, h->size - h->buffered, hashes, pos, count);
+			}
+		}
+
+		for (set_size_t g = 0; g < count; g++) {
+			const void* value = &values[(base + g) * type_size];
+			bool hit = false;
+
+			if (set_is_small(h)) {
+				hit = set_small_find(h, value, type_size).code;
+			} else if (h->_dense != NULL) {
+				hit = dense_find(h, value, type_size).code;
+			} else if (h->_swiss != NULL) {
+				hit = swiss_find(h, value, type_size, hashes[g]).code;
+			} else if (h->_pma != NULL) {
+				hit = pma_match(h, value, type_size, hashes[g], pos[g]).code;
+			} else {
+				for (set_size_t i = pos[g]; i < h->size - h->buffered && h->_hash[i] == hashes[g] && !hit; i++) {
+					hit = memcmp(&h->data[i * type_size], value, type_size) == 0;
+				}
+				if (!hit && h->buffered > 0) {
+					hit = set_buffer_find(h, value, type_size, hashes[g]).code;
+				}
+			}
+
+			if (hit) {
+				if (bitmap != NULL) {
+					bitmap[(base + g) / 64] |= (uint64_t)1 << ((base + g) % 64);
+				}
+				if (hits != NULL) {
+					hits[found] = base + g;
+				}
+				++found;
+			}
+		}
+	}
+
+	return found;
+}
+
+// hash kernels for each element width. elements are hashed as raw bytes, and
+// the common widths are loaded as whole words and run through the murmur3
+// finalizer instead of being walked one byte at a time
+
+#define SET_HASH_SEED 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t set_mix64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static inline uint64_t set_hash_1(const void* value) {
+	return set_mix64(*(const uint8_t*)value ^ SET_HASH_SEED);
+}
+
+static inline uint64_t set_hash_2(const void* value) {
+	uint16_t v;
+	memcpy(&v, value, sizeof(v));
+	return set_mix64(v ^ SET_HASH_SEED);
+}
+
+static inline uint64_t set_hash_4(const void* value) {
+	uint32_t v;
+	memcpy(&v, value, sizeof(v));
+	return set_mix64(v ^ SET_HASH_SEED);
+}
+
+static inline uint64_t set_hash_8(const void* value) {
+	uint64_t v;
+	memcpy(&v, value, sizeof(v));
+	return set_mix64(v ^ SET_HASH_SEED);
+}
+
+static inline uint64_t set_hash_16(const void* value) {
+	uint64_t v[2];
+	memcpy(v, value, sizeof(v));
+	return set_mix64(v[0] ^ set_mix64(v[1] ^ SET_HASH_SEED));
+}
+
+static uint64_t set_hash_bytes(const void* value, set_type_t len) {
+	const unsigned char* p = (const unsigned char*)value;
+	uint64_t h = SET_HASH_SEED ^ (len * 0xff51afd7ed558ccdULL);
+	uint64_t v;
+
+	for (; len >= sizeof(v); len -= sizeof(v), p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		h = set_mix64(h ^ v);
+	}
+	if (len > 0) {
+		v = 0;
+		memcpy(&v, p, len);
+		h = set_mix64(h ^ v);
+	}
+	return h;
+}
+
+set_hash_t _default_hash(const void* value, set_type_t len) {
+	uint64_t h;
+
+	switch (len) {
+	case 1: h = set_hash_1(value); break;
+	case 2: h = set_hash_2(value); break;
+	case 4: h = set_hash_4(value); break;
+	case 8: h = set_hash_8(value); break;
+	case 16: h = set_hash_16(value); break;
+	default: h = set_hash_bytes(value, len); break;
+	}
+
+	#ifdef __LP64__
+	return h;
+	#else
+	return (uint32_t)(h ^ (h >> 32));
+	#endif
+}
+
+// returns the first position whose hash is not less than value
+pack binsearch_array(set_header* h, set_hash_t value) {
+    set_hash_t *a = h->_hash;
+    set_size_t sorted = h->size - h->buffered;
+    set_size_t l = 0, r = sorted;
+    set_size_t m;
+    
+    pack result;
+    
+    while (r > l) {
+        m = l + (r - l) / 2;
+
+        if (a[m] < value) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+    result.index = l;
+    result.code = l < sorted && a[l] == value;
+    return result;
+}
+
+// number of the SET_FROZEN_KEYS hashes at node that are less than value
+static set_size_t frozen_rank(const set_hash_t* node, set_hash_t value) {
+#if defined(__AVX2__) && defined(__LP64__)
+	// there is no unsigned 64 bit compare, so flip the sign bits first
+	__m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	__m256i v = _mm256_xor_si256(_mm256_set1_epi64x((long long)value), sign);
+	__m256i lo = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)node), sign);
+	__m256i hi = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)&node[4]), sign);
+	unsigned mask = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, lo))) |
+	                (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, hi))) << 4;
+	return set_popcount64(mask);
+#else
+	set_size_t rank = 0;
+	for (int i = 0; i < SET_FROZEN_KEYS; i++) {
+		rank += node[i] < value;
+	}
+	return rank;
+#endif
+}
+
+// position of the first hash not less than value, given the leaf block it's in
+static set_size_t frozen_leaf_rank(set_header* h, set_size_t block, set_hash_t value) {
+	set_size_t start = block * SET_FROZEN_KEYS;
+
+	if (h->size - start >= SET_FROZEN_KEYS) {
+		return start + frozen_rank(&h->_hash[start], value);
+	}
+	set_size_t i = start;
+	while (i < h->size && h->_hash[i] < value) {
+		++i;
+	}
+	return i;
+}
+
+// same result as binsearch_array, walking the tree of a frozen set
+static pack frozen_find(set_header* h, set_hash_t value) {
+	set_frozen* f = h->_frozen;
+	pack result;
+
+	// past the last hash the walk would head into padding, so stop here
+	if (h->size == 0 || h->_hash[h->size - 1] < value) {
+		result.index = h->size;
+		result.code = false;
+		return result;
+	}
+
+	set_size_t k = 0;
+	for (set_size_t level = f->levels; level > 0; level--) {
+		k = k * SET_FROZEN_FANOUT + frozen_rank(&f->keys[f->offset[level] + k * SET_FROZEN_KEYS], value);
+	}
+	result.index = frozen_leaf_rank(h, k, value);
+	result.code = h->_hash[result.index] == value;
+	return result;
+}
+
+// frozen_find for a group of hashes at once, prefetching each lane's next
+// node while the others are compared
+static void frozen_lower_bound_group(set_header* h, const set_hash_t* hashes, set_size_t* pos, set_size_t count) {
+	set_frozen* f = h->_frozen;
+	set_hash_t last = h->size > 0 ? h->_hash[h->size - 1] : 0;
+
+	for (set_size_t g = 0; g < count; g++) {
+		pos[g] = 0;
+	}
+	for (set_size_t level = f->levels; level > 0; level--) {
+		const set_hash_t* nodes = &f->keys[f->offset[level]];
+		for (set_size_t g = 0; g < count; g++) {
+			pos[g] = pos[g] * SET_FROZEN_FANOUT + frozen_rank(&nodes[pos[g] * SET_FROZEN_KEYS], hashes[g]);
+			// lanes past the last hash may point at padding, keep them in range
+			if (hashes[g] > last) {
+				pos[g] = 0;
+			}
+			SET_PREFETCH(level > 1 ? &f->keys[f->offset[level - 1] + pos[g] * SET_FROZEN_KEYS] :
+			             &h->_hash[pos[g] * SET_FROZEN_KEYS]);
+		}
+	}
+	for (set_size_t g = 0; g < count; g++) {
+		pos[g] = h->size == 0 || hashes[g] > last ? h->size : frozen_leaf_rank(h, pos[g], hashes[g]);
+	}
+}
+
+void _set_freeze(set* set_addr, set_type_t type_size) {
+	set_header* h = set_get_header(*set_addr);
+	set_size_t nodes[SET_FROZEN_MAX_LEVELS + 1];
+	set_size_t levels = 0, total = 0;
+
+	if (h->_frozen != NULL || h->engine != SET_ENGINE_SORTED || !set_is_hashed(h)) {
+		return;
+	}
+	// the layout belongs to the block, and copies don't take it along
+	h = set_unshare(h, type_size);
+	*set_addr = h->data;
+	set_flush_header(h, type_size);
+
+	// nodes[0] counts the leaf blocks
+	nodes[0] = (h->size + SET_FROZEN_KEYS - 1) / SET_FROZEN_KEYS;
+	while (nodes[levels] > 1 && levels < SET_FROZEN_MAX_LEVELS) {
+		nodes[levels + 1] = (nodes[levels] + SET_FROZEN_FANOUT - 1) / SET_FROZEN_FANOUT;
+		total += nodes[++levels];
+	}
+
+	set_frozen* f = (set_frozen*)set_alloc(h->allocator, sizeof(set_frozen));
+	f->levels = levels;
+	f->block_size = total * SET_FROZEN_KEYS * sizeof(set_hash_t) + 64;
+	f->block = set_alloc(h->allocator, f->block_size);
+	f->keys = (set_hash_t*)(((uintptr_t)f->block + 63) & ~(uintptr_t)63);
+
+	// the root comes first, so a lookup reads the levels front to back
+	set_size_t offset = 0;
+	for (set_size_t level = levels; level > 0; level--) {
+		f->offset[level] = offset;
+		offset += nodes[level] * SET_FROZEN_KEYS;
+	}
+
+	// a child at level - 1 covers span leaf blocks
+	set_size_t span = 1;
+	for (set_size_t level = 1; level <= levels; level++) {
+		set_hash_t* keys = &f->keys[f->offset[level]];
+		for (set_size_t k = 0; k < nodes[level]; k++) {
+			for (set_size_t j = 0; j < SET_FROZEN_KEYS; j++) {
+				set_size_t first = (k * SET_FROZEN_FANOUT + j) * span;
+				set_size_t end = (first + span) * SET_FROZEN_KEYS;
+				// children that don't exist are never descended into
+				keys[k * SET_FROZEN_KEYS + j] = first < nodes[0] ?
+					h->_hash[(end < h->size ? end : h->size) - 1] : (set_hash_t)-1;
+			}
+		}
+		span *= SET_FROZEN_FANOUT;
+	}
+
+	h->_frozen = f;
+}
+
+// drops the tree of a frozen set, before anything changes its hashes
+static void set_thaw(set_header* h) {
+	if (h->_frozen != NULL) {
+		set_dealloc(h->allocator, h->_frozen->block, h->_frozen->block_size);
+		set_dealloc(h->allocator, h->_frozen, sizeof(set_frozen));
+		h->_frozen = NULL;
+	}
+}
+
+static set_size_t directory_bucket(set_directory* d, set_hash_t value) {
+	return (set_size_t)(value >> (sizeof(set_hash_t) * 8 - d->bits));
+}
+
+static size_t directory_size(set_size_t bits) {
+	return sizeof(set_directory) + (((size_t)1 << bits) + 1) * sizeof(set_size_t);
+}
+
+// same result as binsearch_array, searching only the value's bucket
+static pack directory_find(set_header* h, set_hash_t value) {
+	set_directory* d = h->_directory;
+	const set_hash_t* a = h->_hash;
+	set_size_t b = directory_bucket(d, value);
+	// the lower bound is somewhere in [lo, hi]
+	set_size_t lo = d->start[b], hi = d->start[b + 1];
+	pack result;
+
+	while (hi - lo > SET_DIRECTORY_SCAN) {
+		set_hash_t first = a[lo], last = a[hi - 1];
+		if (value <= first) {
+			hi = lo;
+		} else if (value > last) {
+			lo = hi;
+		} else {
+			// guess where value sits between first and last
+			set_size_t m = lo + (set_size_t)((double)(value - first) / (double)(last - first) * (double)(hi - 1 - lo));
+			if (a[m] < value) {
+				lo = m + 1;
+			} else {
+				hi = m;
+			}
+		}
+	}
+	while (lo < hi && a[lo] < value) {
+		++lo;
+	}
+	result.index = lo;
+	result.code = lo < h->size && a[lo] == value;
+	return result;
+}
+
+// directory_find for a group of hashes, prefetching all of the group's
+// buckets before searching any of them
+static void directory_lower_bound_group(set_header* h, const set_hash_t* hashes, set_size_t* pos, set_size_t count) {
+	set_directory* d = h->_directory;
+
+	for (set_size_t g = 0; g < count; g++) {
+		SET_PREFETCH(&d->start[directory_bucket(d, hashes[g])]);
+	}
+	for (set_size_t g = 0; g < count; g++) {
+		SET_PREFETCH(&h->_hash[d->start[directory_bucket(d, hashes[g])]]);
+	}
+	for (set_size_t g = 0; g < count; g++) {
+		pos[g] = directory_find(h, hashes[g]).index;
+	}
+}
+
+// (re)builds the directory from the sorted hashes, sized for the set's current size
+static void directory_build(set_header* h) {
+	set_size_t bits = 1;
+
+	while (bits < SET_DIRECTORY_MAX_BITS && ((set_size_t)1 << bits) * SET_DIRECTORY_LOAD < h->size) {
+		++bits;
+	}
+	if (h->_directory != NULL && h->_directory->bits != bits) {
+		directory_free(h);
+	}
+	if (h->_directory == NULL) {
+		h->_directory = (set_directory*)set_alloc(h->allocator, directory_size(bits));
+		h->_directory->bits = bits;
+	}
+
+	set_directory* d = h->_directory;
+	set_size_t buckets = (set_size_t)1 << bits;
+	set_size_t sorted = h->size - h->buffered;
+	set_size_t i = 0;
+	for (set_size_t b = 0; b < buckets; b++) {
+		while (i < sorted && directory_bucket(d, h->_hash[i]) < b) {
+			++i;
+		}
+		d->start[b] = i;
+	}
+	d->start[buckets] = sorted;
+}
+
+// called once value's hash has been inserted. the directory is rebuilt with
+// more buckets whenever the set doubles past its load
+static void directory_insert(set_header* h, set_hash_t value) {
+	set_directory* d = h->_directory;
+	set_size_t buckets = (set_size_t)1 << d->bits;
+
+	if (d->bits < SET_DIRECTORY_MAX_BITS && h->size > buckets * SET_DIRECTORY_LOAD * 2) {
+		directory_build(h);
+		return;
+	}
+	for (set_size_t b = directory_bucket(d, value) + 1; b <= buckets; b++) {
+		++d->start[b];
+	}
+}
+
+// called before the hashes at [pos, pos + len) are removed
+static void directory_erase(set_header* h, set_size_t pos, set_size_t len) {
+	set_directory* d = h->_directory;
+	set_size_t buckets = (set_size_t)1 << d->bits;
+
+	for (set_size_t b = 0; b <= buckets; b++) {
+		if (d->start[b] > pos) {
+			d->start[b] -= d->start[b] - pos < len ? d->start[b] - pos : len;
+		}
+	}
+}
+
+static set_directory* directory_copy(set_header* h) {
+	size_t size = directory_size(h->_directory->bits);
+	set_directory* d = (set_directory*)set_alloc(h->allocator, size);
+
+	memcpy(d, h->_directory, size);
+	return d;
+}
+
+static void directory_free(set_header* h) {
+	if (h->_directory != NULL) {
+		set_dealloc(h->allocator, h->_directory, directory_size(h->_directory->bits));
+		h->_directory = NULL;
+	}
+}
+
+void _set_use_directory(set* set_addr, set_type_t type_size, bool enabled) {
+	set_header* h = set_get_header(*set_addr);
+
+	if (h->engine != SET_ENGINE_SORTED) {
+		return;
+	}
+	h = set_unshare(h, type_size);
+	*set_addr = h->data;
+	if (!enabled) {
+		h->flags &= ~(uint32_t)SET_FLAG_DIRECTORY;
+		directory_free(h);
+		return;
+	}
+	h->flags |= SET_FLAG_DIRECTORY;
+	if (set_is_hashed(h) && h->_directory == NULL) {
+		set_flush_header(h, type_size);
+		directory_build(h);
+	}
+}
+
+// swiss engine: open addressing over groups of 16 control bytes, which are
+// matched against the probed hash all at once. the slots only hold positions
+// into the set data, so the elements themselves stay contiguous
+
+static unsigned set_ctz(uint32_t m) {
+#if defined(__GNUC__) || defined(__clang__)
+	return (unsigned)__builtin_ctz(m);
+#else
+	unsigned n = 0;
+	while (!(m & 1)) {
+		m >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+// bitmask of the bytes in the group at g that are equal to c
+static uint32_t swiss_match(const int8_t* g, int8_t c) {
+#ifdef SET_SSE2
+	__m128i group = _mm_loadu_si128((const __m128i*)g);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+#else
+	uint32_t m = 0;
+	for (int i = 0; i < SWISS_GROUP; i++) {
+		m |= (uint32_t)(g[i] == c) << i;
+	}
+	return m;
+#endif
+}
+
+// bitmask of the empty or deleted slots in the group at g
+static uint32_t swiss_match_free(const int8_t* g) {
+#ifdef SET_SSE2
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)g));
+#else
+	uint32_t m = 0;
+	for (int i = 0; i < SWISS_GROUP; i++) {
+		m |= (uint32_t)(g[i] < 0) << i;
+	}
+	return m;
+#endif
+}
+
+static void swiss_set_ctrl(set_swiss* t, set_size_t slot, int8_t c) {
+	t->ctrl[slot] = c;
+	// keep the mirrored group in sync so probes can run past the last slot
+	if (slot < SWISS_GROUP) {
+		t->ctrl[t->mask + 1 + slot] = c;
+	}
+}
+
+static set_size_t swiss_find_free(set_swiss* t, set_hash_t value_hash) {
+	set_size_t pos = (value_hash >> 7) & t->mask, step = 0;
+	uint32_t m;
+
+	while (!(m = swiss_match_free(&t->ctrl[pos]))) {
+		step += SWISS_GROUP;
+		pos = (pos + step) & t->mask;
+	}
+	return (pos + set_ctz(m)) & t->mask;
+}
+
+static void swiss_place(set_header* h, set_size_t pos) {
+	set_swiss* t = h->_swiss;
+	set_size_t slot = swiss_find_free(t, h->_hash[pos]);
+
+	if (t->ctrl[slot] == SWISS_EMPTY) {
+		++t->used;
+	}
+	swiss_set_ctrl(t, slot, (int8_t)(h->_hash[pos] & 0x7f));
+	t->slots[slot] = pos;
+}
+
+static pack swiss_find(set_header* h, const void* value, set_type_t type_size, set_hash_t value_hash) {
+	set_swiss* t = h->_swiss;
+	int8_t tag = (int8_t)(value_hash & 0x7f);
+	set_size_t pos = (value_hash >> 7) & t->mask, step = 0;
+	pack result;
+
+	for (;;) {
+		const int8_t* g = &t->ctrl[pos];
+		for (uint32_t m = swiss_match(g, tag); m; m &= m - 1) {
+			set_size_t slot = (pos + set_ctz(m)) & t->mask;
+			set_size_t i = t->slots[slot];
+			if (h->_hash[i] == value_hash &&
+			    memcmp(&h->data[i * type_size], value, type_size) == 0) {
+				result.code = true;
+				result.index = i;
+				return result;
+			}
+		}
+		// an empty slot ends the probe sequence
+		if (swiss_match(g, SWISS_EMPTY)) {
+			break;
+		}
+		step += SWISS_GROUP;
+		pos = (pos + step) & t->mask;
+	}
+
+	// new elements are appended, so the table never has to renumber them
+	result.code = false;
+	result.index = h->size;
+	return result;
+}
+
+static void swiss_rebuild(set_header* h, set_size_t slot_count) {
+	set_swiss* t = h->_swiss;
+
+	// keep the load factor at or below 7/8 with room to grow
+	while (slot_count / 8 * 7 < h->size * 2) {
+		slot_count *= 2;
+	}
+	if (slot_count != t->mask + 1 || t->ctrl == NULL) {
+		if (t->ctrl != NULL) {
+			set_dealloc(h->allocator, t->ctrl, t->mask + 1 + SWISS_GROUP);
+			set_dealloc(h->allocator, t->slots, (t->mask + 1) * sizeof(set_size_t));
+		}
+		t->ctrl = (int8_t*)set_alloc(h->allocator, slot_count + SWISS_GROUP);
+		t->slots = (set_size_t*)set_alloc(h->allocator, slot_count * sizeof(set_size_t));
+		t->mask = slot_count - 1;
+	}
+	memset(t->ctrl, SWISS_EMPTY, slot_count + SWISS_GROUP);
+	t->used = 0;
+
+	for (set_size_t i = 0; i < h->size; i++) {
+		swiss_place(h, i);
+	}
+}
+
+static void swiss_add(set_header* h, set_size_t pos) {
+	set_swiss* t = h->_swiss;
+	set_size_t slot_count = t->mask + 1;
+
+	if ((t->used + 1) * 8 > slot_count * 7) {
+		// the new element's hash is already stored, so the rebuild places it
+		swiss_rebuild(h, slot_count);
+		return;
+	}
+	swiss_place(h, pos);
+}
+
+// the slot holding the element at pos, or SWISS_NO_SLOT
+#define SWISS_NO_SLOT ((set_size_t)-1)
+static set_size_t swiss_slot(set_header* h, set_size_t pos) {
+	set_swiss* t = h->_swiss;
+	set_hash_t value_hash = h->_hash[pos];
+	int8_t tag = (int8_t)(value_hash & 0x7f);
+	set_size_t p = (value_hash >> 7) & t->mask, step = 0;
+
+	for (;;) {
+		const int8_t* g = &t->ctrl[p];
+		for (uint32_t m = swiss_match(g, tag); m; m &= m - 1) {
+			set_size_t slot = (p + set_ctz(m)) & t->mask;
+			if (t->slots[slot] == pos) {
+				return slot;
+			}
+		}
+		if (swiss_match(g, SWISS_EMPTY)) {
+			return SWISS_NO_SLOT;
+		}
+		step += SWISS_GROUP;
+		p = (p + step) & t->mask;
+	}
+}
+
+static void swiss_unlink(set_header* h, set_size_t pos) {
+	set_size_t slot = swiss_slot(h, pos);
+
+	if (slot != SWISS_NO_SLOT) {
+		swiss_set_ctrl(h->_swiss, slot, SWISS_DELETED);
+	}
+}
+
+// points the slot of the element at from to its new position to
+static void swiss_renumber(set_header* h, set_size_t from, set_size_t to) {
+	set_size_t slot = swiss_slot(h, from);
+
+	if (slot != SWISS_NO_SLOT) {
+		h->_swiss->slots[slot] = to;
+	}
+}
+
+static void swiss_free(set_header* h) {
+	set_swiss* t = h->_swiss;
+
+	if (t == NULL) {
+		return;
+	}
+	set_dealloc(h->allocator, t->ctrl, t->mask + 1 + SWISS_GROUP);
+	set_dealloc(h->allocator, t->slots, (t->mask + 1) * sizeof(set_size_t));
+	set_dealloc(h->allocator, t, sizeof(set_swiss));
+	h->_swiss = NULL;
+}
+
+// first cell whose hash is not less than value
+static set_size_t pma_lower_bound(set_pma* p, set_hash_t value) {
+	const set_hash_t* a = p->hashes;
+	set_size_t base = 0, len = p->capacity;
+
+	while (len > 1) {
+		set_size_t half = len / 2;
+		base += (a[base + half - 1] < value) ? half : 0;
+		len -= half;
+	}
+	return base + (a[base] < value);
+}
+
+// looks for value among the cells with its hash, starting from their lower bound
+static pack pma_match(set_header* h, const void* value, set_type_t type_size, set_hash_t value_hash, set_size_t cell) {
+	set_pma* p = h->_pma;
+	pack result;
+
+	for (set_size_t c = cell; c < p->capacity && p->hashes[c] == value_hash; c++) {
+		set_size_t i = p->slots[c];
+		if (i != SET_PMA_GAP && memcmp(&h->data[i * type_size], value, type_size) == 0) {
+			result.code = true;
+			result.index = i;
+			return result;
+		}
+	}
+
+	// like the swiss engine, new elements are appended
+	result.code = false;
+	result.index = h->size;
+	return result;
+}
+
+static pack pma_find(set_header* h, const void* value, set_type_t type_size, set_hash_t value_hash) {
+	return pma_match(h, value, type_size, value_hash, pma_lower_bound(h->_pma, value_hash));
+}
+
+// lays out the entries evenly over the cells [from, from + width)
+static void pma_spread(set_pma* p, set_size_t from, set_size_t width, const set_batch_entry* entries, set_size_t n) {
+	set_hash_t last = from > 0 ? p->hashes[from - 1] : 0;
+	set_size_t e = 0;
+
+	for (set_size_t c = 0; c < width; c++) {
+		// entry e goes to cell e * width / n
+		if (e < n && c == e * width / n) {
+			last = entries[e].hash;
+			p->slots[from + c] = entries[e].pos;
+			++e;
+		} else {
+			p->slots[from + c] = SET_PMA_GAP;
+		}
+		p->hashes[from + c] = last;
+	}
+	for (set_size_t s = from / p->segment; s < (from + width) / p->segment; s++) {
+		set_size_t count = 0;
+		for (set_size_t c = s * p->segment; c < (s + 1) * p->segment; c++) {
+			count += p->slots[c] != SET_PMA_GAP;
+		}
+		p->counts[s] = count;
+	}
+}
+
+// sizes the array for twice the set's elements and spreads them all out
+static void pma_rebuild(set_header* h) {
+	set_pma* p = h->_pma;
+	set_size_t capacity = SET_PMA_MIN, segment = 4, bits = 4;
+
+	while (capacity < h->size * 2) {
+		capacity *= 2;
+		++bits;
+	}
+	while (segment < bits) {
+		segment *= 2;
+	}
+
+	if (capacity != p->capacity) {
+		if (p->hashes != NULL) {
+			set_dealloc(h->allocator, p->hashes, p->capacity * sizeof(set_hash_t));
+			set_dealloc(h->allocator, p->slots, p->capacity * sizeof(set_size_t));
+			set_dealloc(h->allocator, p->counts, p->capacity / p->segment * sizeof(set_size_t));
+		}
+		p->hashes = (set_hash_t*)set_alloc(h->allocator, capacity * sizeof(set_hash_t));
+		p->slots = (set_size_t*)set_alloc(h->allocator, capacity * sizeof(set_size_t));
+		p->counts = (set_size_t*)set_alloc(h->allocator, capacity / segment * sizeof(set_size_t));
+		p->capacity = capacity;
+		p->segment = segment;
+	}
+
+	size_t entries_size = 2 * (h->size ? h->size : 1) * sizeof(set_batch_entry);
+	set_batch_entry* entries = (set_batch_entry*)set_alloc(h->allocator, entries_size);
+	set_batch_entry* sorted = entries;
+	for (set_size_t i = 0; i < h->size; i++) {
+		entries[i].hash = h->_hash[i];
+		entries[i].pos = i;
+	}
+	if (h->size > 0) {
+		sorted = set_radix_sort(entries, entries + h->size, h->size);
+	}
+	pma_spread(p, 0, capacity, sorted, h->size);
+	set_dealloc(h->allocator, entries, entries_size);
+}
+
+// the element at pos was just appended, with its hash in _hash[pos]
+static void pma_add(set_header* h, set_size_t pos) {
+	set_pma* p = h->_pma;
+	set_hash_t value = h->_hash[pos];
+
+	// the whole array may only be 3/4 full
+	if (h->size * 4 > p->capacity * 3) {
+		pma_rebuild(h);
+		return;
+	}
+
+	set_size_t c = pma_lower_bound(p, value);
+	set_size_t seg = (c == p->capacity ? c - 1 : c) / p->segment;
+	set_size_t start = seg * p->segment, end = start + p->segment;
+
+	if (p->counts[seg] < p->segment) {
+		// shift towards the nearest gap in the segment, then fill the hole
+		set_size_t gap = c;
+		while (gap < end && p->slots[gap] != SET_PMA_GAP) {
+			++gap;
+		}
+		if (gap < end) {
+			memmove(&p->hashes[c + 1], &p->hashes[c], (gap - c) * sizeof(set_hash_t));
+			memmove(&p->slots[c + 1], &p->slots[c], (gap - c) * sizeof(set_size_t));
+		} else {
+			gap = c - 1;
+			while (p->slots[gap] != SET_PMA_GAP) {
+				--gap;
+			}
+			memmove(&p->hashes[gap], &p->hashes[gap + 1], (c - 1 - gap) * sizeof(set_hash_t));
+			memmove(&p->slots[gap], &p->slots[gap + 1], (c - 1 - gap) * sizeof(set_size_t));
+			--c;
+		}
+		p->hashes[c] = value;
+		p->slots[c] = pos;
+		++p->counts[seg];
+		return;
+	}
+
+	// find the smallest window around the segment below its density limit,
+	// which goes from 1 for a segment down to 3/4 for the whole array
+	set_size_t height = 0;
+	while ((p->segment << height) < p->capacity) {
+		++height;
+	}
+	for (set_size_t level = 1; level <= height; level++) {
+		set_size_t width = p->segment << level;
+		set_size_t from = start & ~(width - 1);
+		set_size_t count = 1;
+		for (set_size_t s = from / p->segment; s < (from + width) / p->segment; s++) {
+			count += p->counts[s];
+		}
+		if (count * 4 * height > width * (4 * height - level)) {
+			continue;
+		}
+
+		size_t entries_size = count * sizeof(set_batch_entry);
+		set_batch_entry* entries = (set_batch_entry*)set_alloc(h->allocator, entries_size);
+		set_size_t n = 0;
+		for (set_size_t i = from; i < from + width; i++) {
+			if (i == c) {
+				entries[n].hash = value;
+				entries[n++].pos = pos;
+			}
+			if (p->slots[i] != SET_PMA_GAP) {
+				entries[n].hash = p->hashes[i];
+				entries[n++].pos = p->slots[i];
+			}
+		}
+		if (n < count) {
+			entries[n].hash = value;
+			entries[n++].pos = pos;
+		}
+		pma_spread(p, from, width, entries, n);
+		set_dealloc(h->allocator, entries, entries_size);
+		return;
+	}
+	pma_rebuild(h);
+}
+
+// the cell holding the element at pos
+static set_size_t pma_cell(set_header* h, set_size_t pos) {
+	set_pma* p = h->_pma;
+	set_size_t c = pma_lower_bound(p, h->_hash[pos]);
+
+	while (p->slots[c] != pos) {
+		++c;
+	}
+	return c;
+}
+
+// drops the cell of the element at pos
+static void pma_unlink(set_header* h, set_size_t pos) {
+	set_pma* p = h->_pma;
+	set_size_t c = pma_cell(h, pos);
+
+	p->slots[c] = SET_PMA_GAP;
+	--p->counts[c / p->segment];
+}
+
+static void pma_renumber(set_header* h, set_size_t from, set_size_t to) {
+	h->_pma->slots[pma_cell(h, from)] = to;
+}
+
+// drops the cells of the elements in [pos, pos + len) and renumbers the ones
+// after them. the cells keep their hashes, so the order still holds
+static void pma_erase(set_header* h, set_size_t pos, set_size_t len) {
+	set_pma* p = h->_pma;
+
+	for (set_size_t c = 0; c < p->capacity; c++) {
+		set_size_t i = p->slots[c];
+		if (i == SET_PMA_GAP || i < pos) {
+			continue;
+		}
+		if (i < pos + len) {
+			p->slots[c] = SET_PMA_GAP;
+			--p->counts[c / p->segment];
+		} else {
+			p->slots[c] = i - len;
+		}
+	}
+}
+
+static set_pma* pma_copy(set_header* h) {
+	set_pma* p = h->_pma;
+	set_pma* copy = (set_pma*)set_alloc(h->allocator, sizeof(set_pma));
+	set_size_t segments = p->capacity / p->segment;
+
+	*copy = *p;
+	copy->hashes = (set_hash_t*)set_alloc(h->allocator, p->capacity * sizeof(set_hash_t));
+	copy->slots = (set_size_t*)set_alloc(h->allocator, p->capacity * sizeof(set_size_t));
+	copy->counts = (set_size_t*)set_alloc(h->allocator, segments * sizeof(set_size_t));
+	memcpy(copy->hashes, p->hashes, p->capacity * sizeof(set_hash_t));
+	memcpy(copy->slots, p->slots, p->capacity * sizeof(set_size_t));
+	memcpy(copy->counts, p->counts, segments * sizeof(set_size_t));
+	return copy;
+}
+
+static void pma_free(set_header* h) {
+	set_pma* p = h->_pma;
+
+	if (p == NULL) {
+		return;
+	}
+	if (p->hashes != NULL) {
+		set_dealloc(h->allocator, p->hashes, p->capacity * sizeof(set_hash_t));
+		set_dealloc(h->allocator, p->slots, p->capacity * sizeof(set_size_t));
+		set_dealloc(h->allocator, p->counts, p->capacity / p->segment * sizeof(set_size_t));
+	}
+	set_dealloc(h->allocator, p, sizeof(set_pma));
+	h->_pma = NULL;
+}
+
+// dense index: elements of 1, 2, 4 or 8 bytes are read as integers with the
+// top bit flipped, so that small signed and small unsigned values both end up
+// next to each other, and looked up by offset from the base of a bitmap
+
+static bool set_key(const void* value, set_type_t type_size, uint64_t* key) {
+	switch (type_size) {
+	case 1: { uint8_t v; memcpy(&v, value, 1); *key = v ^ 0x80u; return true; }
+	case 2: { uint16_t v; memcpy(&v, value, 2); *key = v ^ 0x8000u; return true; }
+	case 4: { uint32_t v; memcpy(&v, value, 4); *key = v ^ 0x80000000u; return true; }
+	case 8: { uint64_t v; memcpy(&v, value, 8); *key = v ^ 0x8000000000000000ULL; return true; }
+	default: *key = 0; return false;
+	}
+}
+
+static bool set_key_range(set_header* h, set_type_t type_size, uint64_t* lo, uint64_t* hi) {
+	uint64_t key;
+
+	if (h->size == 0 || !set_key(h->data, type_size, &key)) {
+		return false;
+	}
+	*lo = *hi = key;
+	for (set_size_t i = 1; i < h->size; i++) {
+		set_key(&h->data[i * type_size], type_size, &key);
+		if (key < *lo) {
+			*lo = key;
+		} else if (key > *hi) {
+			*hi = key;
+		}
+	}
+	return true;
+}
+
+static bool dense_has(set_dense* d, uint64_t key) {
+	uint64_t k = key - d->base;
+	return key >= d->base && k < d->range && (d->bits[k / 64] >> (k % 64) & 1);
+}
+
+static pack dense_find(set_header* h, const void* value, set_type_t type_size) {
+	set_dense* d = h->_dense;
+	uint64_t key;
+	pack result;
+
+	set_key(value, type_size, &key);
+	result.code = dense_has(d, key);
+	result.index = result.code ? d->pos[key - d->base] : h->size;
+	return result;
+}
+
+// (re)indexes every element of the set over [base, base + range)
+static void dense_build(set_header* h, set_type_t type_size, uint64_t base, set_size_t range) {
+	set_dense* d = h->_dense;
+	size_t words = (range + 63) / 64;
+	uint64_t key;
+
+	if (d == NULL) {
+		d = h->_dense = (set_dense*)set_alloc(h->allocator, sizeof(set_dense));
+		d->range = 0;
+		d->bits = NULL;
+		d->pos = NULL;
+	}
+	if (d->range != range) {
+		set_dealloc(h->allocator, d->bits, (d->range + 63) / 64 * sizeof(uint64_t));
+		set_dealloc(h->allocator, d->pos, d->range * sizeof(uint32_t));
+		d->bits = (uint64_t*)set_alloc(h->allocator, words * sizeof(uint64_t));
+		d->pos = (uint32_t*)set_alloc(h->allocator, range * sizeof(uint32_t));
+	}
+	d->base = base;
+	d->range = range;
+	d->type_size = type_size;
+	memset(d->bits, 0, words * sizeof(uint64_t));
+
+	for (set_size_t i = 0; i < h->size; i++) {
+		set_key(&h->data[i * type_size], type_size, &key);
+		key -= base;
+		d->bits[key / 64] |= (uint64_t)1 << (key % 64);
+		d->pos[key] = (uint32_t)i;
+	}
+}
+
+// indexes the element at pos, widening the index if the set stays dense
+// enough. the range at least doubles when it grows, so sets that grow at one
+// end are re-indexed a logarithmic number of times
+static bool dense_insert(set_header* h, set_type_t type_size, set_size_t pos) {
+	set_dense* d = h->_dense;
+	uint64_t key, k;
+
+	set_key(&h->data[pos * type_size], type_size, &key);
+	k = key - d->base;
+	if (key >= d->base && k < d->range) {
+		d->bits[k / 64] |= (uint64_t)1 << (k % 64);
+		d->pos[k] = (uint32_t)pos;
+		return true;
+	}
+
+	uint64_t lo = key < d->base ? key : d->base;
+	uint64_t hi = key < d->base ? d->base + (d->range - 1) : key;
+	if (h->size >= UINT32_MAX || hi - lo >= (uint64_t)h->size * SET_DENSE_FACTOR) {
+		return false;
+	}
+
+	uint64_t range = hi - lo + 1;
+	if (range < (uint64_t)d->range * 2) {
+		range = (uint64_t)d->range * 2;
+		if (key < d->base) {
+			lo = hi >= range - 1 ? hi - (range - 1) : 0;
+		} else if (range - 1 > UINT64_MAX - lo) {
+			range = UINT64_MAX - lo + 1;
+		}
+	}
+	dense_build(h, type_size, lo, (set_size_t)range);
+	return true;
+}
+
+static void dense_erase(set_header* h, set_type_t type_size, set_size_t pos, set_size_t len) {
+	set_dense* d = h->_dense;
+	uint64_t key;
+
+	for (set_size_t i = pos; i < pos + len; i++) {
+		set_key(&h->data[i * type_size], type_size, &key);
+		key -= d->base;
+		d->bits[key / 64] &= ~((uint64_t)1 << (key % 64));
+	}
+	memmove(&h->data[pos * type_size],
+		&h->data[(pos + len) * type_size],
+		(h->size - pos - len) * type_size);
+	h->size -= len;
+
+	for (set_size_t i = pos; i < h->size; i++) {
+		set_key(&h->data[i * type_size], type_size, &key);
+		d->pos[key - d->base] = (uint32_t)i;
+	}
+}
+
+static set_dense* dense_copy(set_header* h) {
+	set_dense* d = h->_dense;
+	set_dense* copy = (set_dense*)set_alloc(h->allocator, sizeof(set_dense));
+	size_t bits_size = (d->range + 63) / 64 * sizeof(uint64_t);
+
+	*copy = *d;
+	copy->bits = (uint64_t*)set_alloc(h->allocator, bits_size);
+	copy->pos = (uint32_t*)set_alloc(h->allocator, d->range * sizeof(uint32_t));
+	memcpy(copy->bits, d->bits, bits_size);
+	memcpy(copy->pos, d->pos, d->range * sizeof(uint32_t));
+	return copy;
+}
+
+static void dense_free(set_header* h) {
+	set_dense* d = h->_dense;
+
+	if (d == NULL) {
+		return;
+	}
+	set_dealloc(h->allocator, d->bits, (d->range + 63) / 64 * sizeof(uint64_t));
+	set_dealloc(h->allocator, d->pos, d->range * sizeof(uint32_t));
+	set_dealloc(h->allocator, d, sizeof(set_dense));
+	h->_dense = NULL;
+}
+
+// bump arena: allocations are carved out of big chunks and only given back
+// all at once. freeing or growing the most recent allocation happens in place
+
+#define SET_ARENA_ALIGN 16
+
+struct set_arena_chunk {
+	set_arena_chunk* next;
+	size_t size;
+	size_t used;
+	unsigned char data[];
+};
+
+static unsigned char* set_arena_top(set_arena_chunk* c) {
+	uintptr_t p = (uintptr_t)&c->data[c->used];
+	return (unsigned char*)((p + SET_ARENA_ALIGN - 1) & ~(uintptr_t)(SET_ARENA_ALIGN - 1));
+}
+
+static void* set_arena_alloc(void* ctx, size_t size) {
+	set_arena* arena = (set_arena*)ctx;
+	set_arena_chunk* c = arena->chunks;
+	unsigned char* p = c != NULL ? set_arena_top(c) : NULL;
+
+	if (c == NULL || p + size > c->data + c->size) {
+		size_t chunk_size = size + SET_ARENA_ALIGN > arena->chunk_size ? size + SET_ARENA_ALIGN : arena->chunk_size;
+		c = (set_arena_chunk*)malloc(sizeof(set_arena_chunk) + chunk_size);
+		c->next = arena->chunks;
+		c->size = chunk_size;
+		c->used = 0;
+		arena->chunks = c;
+		p = set_arena_top(c);
+	}
+	c->used = (size_t)(p - c->data) + size;
+	arena->last = p;
+	return p;
+}
+
+static void* set_arena_realloc(void* ctx, void* p, size_t old_size, size_t new_size) {
+	set_arena* arena = (set_arena*)ctx;
+	set_arena_chunk* c = arena->chunks;
+
+	if (p != NULL && p == arena->last && (unsigned char*)p + new_size <= c->data + c->size) {
+		c->used = (size_t)((unsigned char*)p - c->data) + new_size;
+		return p;
+	}
+	void* q = set_arena_alloc(ctx, new_size);
+	if (p != NULL) {
+		memcpy(q, p, old_size < new_size ? old_size : new_size);
+	}
+	return q;
+}
+
+static void set_arena_free(void* ctx, void* p, size_t size) {
+	set_arena* arena = (set_arena*)ctx;
+	(void)size;
+
+	if (p == arena->last) {
+		arena->chunks->used = (size_t)((unsigned char*)p - arena->chunks->data);
+		arena->last = NULL;
+	}
+}
+
+void set_arena_init(set_arena* arena, size_t chunk_size) {
+	arena->allocator.alloc_fn = set_arena_alloc;
+	arena->allocator.realloc_fn = set_arena_realloc;
+	arena->allocator.free_fn = set_arena_free;
+	arena->allocator.ctx = arena;
+	arena->chunks = NULL;
+	arena->chunk_size = chunk_size;
+	arena->last = NULL;
+}
+
+void set_arena_reset(set_arena* arena) {
+	set_arena_chunk* c = arena->chunks;
+
+	if (c == NULL) {
+		return;
+	}
+	// keep the newest chunk around for the next round of allocations
+	while (c->next != NULL) {
+		set_arena_chunk* next = c->next->next;
+		free(c->next);
+		c->next = next;
+	}
+	c->used = 0;
+	arena->last = NULL;
+}
+
+void set_arena_release(set_arena* arena) {
+	while (arena->chunks != NULL) {
+		set_arena_chunk* next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+	arena->last = NULL;
+}
+
+// size-class pool: power of two classes from 16 bytes up, each with its own
+// free list refilled from shared slabs. bigger blocks go straight to malloc
+
+#define SET_POOL_MIN 16
+#define SET_POOL_SLAB (64 * 1024)
+
+typedef struct set_pool_slab {
+	struct set_pool_slab* next;
+	size_t _pad;	// keeps the blocks 16 byte aligned
+} set_pool_slab;
+
+static int set_pool_class(size_t size) {
+	int c = 0;
+	size_t block = SET_POOL_MIN;
+
+	while (block < size) {
+		block *= 2;
+		++c;
+	}
+	return c < SET_POOL_CLASSES ? c : -1;
+}
+
+static void* set_pool_alloc(void* ctx, size_t size) {
+	set_pool* pool = (set_pool*)ctx;
+	int c = set_pool_class(size);
+
+	if (c < 0) {
+		return malloc(size);
+	}
+	if (pool->free_lists[c] == NULL) {
+		size_t block = (size_t)SET_POOL_MIN << c;
+		size_t count = SET_POOL_SLAB / block;
+		set_pool_slab* slab = (set_pool_slab*)malloc(sizeof(set_pool_slab) + count * block);
+		unsigned char* blocks = (unsigned char*)(slab + 1);
+
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		for (size_t i = count; i-- > 0;) {
+			*(void**)&blocks[i * block] = pool->free_lists[c];
+			pool->free_lists[c] = &blocks[i * block];
+		}
+	}
+
+	void* p = pool->free_lists[c];
+	pool->free_lists[c] = *(void**)p;
+	return p;
+}
+
+static void set_pool_free(void* ctx, void* p, size_t size) {
+	set_pool* pool = (set_pool*)ctx;
+	int c = set_pool_class(size);
+
+	if (c < 0) {
+		free(p);
+		return;
+	}
+	*(void**)p = pool->free_lists[c];
+	pool->free_lists[c] = p;
+}
+
+static void* set_pool_realloc(void* ctx, void* p, size_t old_size, size_t new_size) {
+	int old_class = set_pool_class(old_size), new_class = set_pool_class(new_size);
+
+	if (p == NULL) {
+		return set_pool_alloc(ctx, new_size);
+	}
+	if (old_class == new_class) {
+		return old_class < 0 ? realloc(p, new_size) : p;
+	}
+	void* q = set_pool_alloc(ctx, new_size);
+	memcpy(q, p, old_size < new_size ? old_size : new_size);
+	set_pool_free(ctx, p, old_size);
+	return q;
+}
+
+void set_pool_init(set_pool* pool) {
+	pool->allocator.alloc_fn = set_pool_alloc;
+	pool->allocator.realloc_fn = set_pool_realloc;
+	pool->allocator.free_fn = set_pool_free;
+	pool->allocator.ctx = pool;
+	memset(pool->free_lists, 0, sizeof(pool->free_lists));
+	pool->slabs = NULL;
+}
+
+void set_pool_release(set_pool* pool) {
+	set_pool_slab* slab = (set_pool_slab*)pool->slabs;
+
+	while (slab != NULL) {
+		set_pool_slab* next = slab->next;
+		free(slab);
+		slab = next;
+	}
+	set_pool_init(pool);
+}
+
+// mapped allocator: blocks of at least the threshold get a private anonymous
+// mapping each, which mremap grows or shrinks by moving page table entries
+// instead of copying the block. shrinking unmaps the tail, which gives its
+// pages back right away. smaller blocks, and every block on systems without
+// mremap, come from malloc. whether a block is mapped follows from its size,
+// which the allocator hooks always pass back
+
+#define SET_MMAP_THRESHOLD ((size_t)1 << 20)
+
+static bool set_mmap_is_mapped(const set_mmap* m, size_t size) {
+#ifdef SET_MMAP
+	return size >= m->threshold;
+#else
+	(void)m;
+	(void)size;
+	return false;
+#endif
+}
+
+static void* set_mmap_alloc(void* ctx, size_t size) {
+	set_mmap* m = (set_mmap*)ctx;
+
+	if (!set_mmap_is_mapped(m, size)) {
+		return malloc(size);
+	}
+#ifdef SET_MMAP
+	void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if (m->huge_pages) {
+		madvise(p, size, MADV_HUGEPAGE);
+	}
+#endif
+	return p;
+#else
+	return NULL;
+#endif
+}
+
+static void set_mmap_free(void* ctx, void* p, size_t size) {
+	set_mmap* m = (set_mmap*)ctx;
+
+	if (!set_mmap_is_mapped(m, size)) {
+		free(p);
+		return;
+	}
+#ifdef SET_MMAP
+	munmap(p, size);
+#endif
+}
+
+static void* set_mmap_realloc(void* ctx, void* p, size_t old_size, size_t new_size) {
+	set_mmap* m = (set_mmap*)ctx;
+	bool was_mapped = set_mmap_is_mapped(m, old_size), mapped = set_mmap_is_mapped(m, new_size);
+
+	if (p == NULL) {
+		return set_mmap_alloc(ctx, new_size);
+	}
+	if (!was_mapped && !mapped) {
+		return realloc(p, new_size);
+	}
+#ifdef SET_MMAP
+	if (was_mapped && mapped) {
+		void* q = mremap(p, old_size, new_size, MREMAP_MAYMOVE);
+		if (q == MAP_FAILED) {
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (m->huge_pages && new_size > old_size) {
+			madvise(q, new_size, MADV_HUGEPAGE);
+		}
+#endif
+		return q;
+	}
+#endif
+	// crossing the threshold switches between malloc and a mapping
+	void* q = set_mmap_alloc(ctx, new_size);
+	if (q != NULL) {
+		memcpy(q, p, old_size < new_size ? old_size : new_size);
+		set_mmap_free(ctx, p, old_size);
+	}
+	return q;
+}
+
+void set_mmap_init(set_mmap* m, size_t threshold, bool huge_pages) {
+	m->allocator.alloc_fn = set_mmap_alloc;
+	m->allocator.realloc_fn = set_mmap_realloc;
+	m->allocator.free_fn = set_mmap_free;
+	m->allocator.ctx = m;
+	m->threshold = threshold != 0 ? threshold : SET_MMAP_THRESHOLD;
+	m->huge_pages = huge_pages;
+}
+
+// set files: a page holding a set_file_header, then the set's block exactly as
+// it would be in memory, with the capacity equal to the size, the elements in
+// hash order and the sorted hashes after them, so that a mapping of the file
+// is a sorted set as it is. the pointers in the block's header are written
+// as zeros and filled in when the file is opened. the page is mapped
+// privately, so that only the page holding the header gets copied, and
+// changes to the set never reach the file
+
+#define SET_FILE_MAGIC "SETIMAGE"
+#define SET_FILE_VERSION 1
+#define SET_FILE_BYTE_ORDER 0x01020304u
+#define SET_FILE_PAGE 4096
+#define SET_FILE_CHUNK (64 * 1024)
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;	// SET_FILE_BYTE_ORDER as the writer stored it
+	uint32_t hash_size;	// sizeof(set_hash_t) of the writer
+	uint32_t header_size;	// sizeof(set_header) of the writer
+	uint64_t type_size;
+	uint64_t size;
+	uint64_t file_size;
+	uint64_t checksum;	// of everything after the first page
+	uint64_t header_checksum;	// of the fields above
+} set_file_header;
+
+// the first page of a mapped set file, once it's open. the allocator of the
+// set points here, and its ctx at the start of the mapping
+typedef struct {
+	set_file_header file;
+	set_allocator allocator;
+	size_t length;
+} set_file_mapping;
+
+// one 8 byte word at a time, with a zero padded tail. checksumming a buffer
+// in pieces whose lengths are multiples of 8 gives the same result
+static uint64_t set_checksum(uint64_t sum, const void* p, size_t len) {
+	const unsigned char* bytes = (const unsigned char*)p;
+	size_t i = 0;
+	uint64_t word;
+
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&word, &bytes[i], 8);
+		sum = ((sum << 23 | sum >> 41) ^ word) * 0x9e3779b97f4a7c15ULL;
+	}
+	if (i < len) {
+		word = 0;
+		memcpy(&word, &bytes[i], len - i);
+		sum = ((sum << 23 | sum >> 41) ^ word) * 0x9e3779b97f4a7c15ULL;
+	}
+	return sum;
+}
+
+static uint64_t set_file_header_checksum(const set_file_header* fh) {
+	set_file_header copy = *fh;
+
+	copy.header_checksum = 0;
+	return set_checksum(0, &copy, sizeof(copy));
+}
+
+typedef struct {
+	FILE* f;
+	uint64_t sum;
+	size_t fill;
+	bool ok;
+	unsigned char buf[SET_FILE_CHUNK];
+} set_file_writer;
+
+static void set_file_drain(set_file_writer* w) {
+	w->sum = set_checksum(w->sum, w->buf, w->fill);
+	w->ok = w->ok && fwrite(w->buf, 1, w->fill, w->f) == w->fill;
+	w->fill = 0;
+}
+
+static void set_file_put(set_file_writer* w, const void* p, size_t len) {
+	const unsigned char* bytes = (const unsigned char*)p;
+
+	while (len > 0) {
+		size_t n = SET_FILE_CHUNK - w->fill < len ? SET_FILE_CHUNK - w->fill : len;
+		memcpy(&w->buf[w->fill], bytes, n);
+		w->fill += n;
+		bytes += n;
+		len -= n;
+		if (w->fill == SET_FILE_CHUNK) {
+			set_file_drain(w);
+		}
+	}
+}
+
+bool _set_save(set st, set_type_t type_size, const char* path) {
+	set_header* h = set_flushed(set_get_header(st), type_size);
+	set_size_t n = h->size;
+	size_t entries_size = 2 * (n ? n : 1) * sizeof(set_batch_entry);
+	set_batch_entry* entries;
+	set_batch_entry* sorted;
+	set_header image;
+	set_file_header fh;
+	set_file_writer* w;
+	static const unsigned char zeros[SET_FILE_PAGE];
+
+	// other engines (and small or dense sets) are written in hash order too
+	entries = (set_batch_entry*)set_alloc(h->allocator, entries_size);
+	for (set_size_t i = 0; i < n; i++) {
+		entries[i].hash = set_is_hashed(h) ? h->_hash[i] : _default_hash(&h->data[i * type_size], type_size);
+		entries[i].pos = i;
+	}
+	sorted = entries;
+	if (n > 0 && !set_is_mergeable(h)) {
+		sorted = set_radix_sort(entries, entries + n, n);
+	}
+
+	memset(&image, 0, sizeof(image));
+	image.size = n;
+	image.capacity = n;
+	image.refs = 1;
+	image.engine = SET_ENGINE_SORTED;
+	image.flags = 0;
+
+	memset(&fh, 0, sizeof(fh));
+	memcpy(fh.magic, SET_FILE_MAGIC, sizeof(fh.magic));
+	fh.version = SET_FILE_VERSION;
+	fh.byte_order = SET_FILE_BYTE_ORDER;
+	fh.hash_size = sizeof(set_hash_t);
+	fh.header_size = sizeof(set_header);
+	fh.type_size = type_size;
+	fh.size = n;
+	fh.file_size = SET_FILE_PAGE + set_alloc_size(n, type_size, true);
+
+	w = (set_file_writer*)malloc(sizeof(set_file_writer));
+	w->f = fopen(path, "wb");
+	w->sum = 0;
+	w->fill = 0;
+	w->ok = w->f != NULL;
+	if (w->ok) {
+		// the header page is rewritten once the checksum is known
+		w->ok = fwrite(zeros, 1, SET_FILE_PAGE, w->f) == SET_FILE_PAGE;
+		set_file_put(w, &image, sizeof(image));
+		for (set_size_t i = 0; i < n; i++) {
+			set_file_put(w, &h->data[sorted[i].pos * type_size], type_size);
+		}
+		set_file_put(w, zeros, set_hash_offset(n, type_size) - sizeof(set_header) - n * type_size);
+		for (set_size_t i = 0; i < n; i++) {
+			set_file_put(w, &sorted[i].hash, sizeof(set_hash_t));
+		}
+		set_file_drain(w);
+
+		fh.checksum = w->sum;
+		fh.header_checksum = set_file_header_checksum(&fh);
+		w->ok = w->ok && fseek(w->f, 0, SEEK_SET) == 0 && fwrite(&fh, 1, sizeof(fh), w->f) == sizeof(fh);
+	}
+	bool ok = w->ok;
+	if (w->f != NULL && fclose(w->f) != 0) {
+		ok = false;
+	}
+	free(w);
+	set_dealloc(h->allocator, entries, entries_size);
+	set_release_flushed(h, set_get_header(st));
+	return ok;
+}
+
+// whether a set file's header was written by a build like this one and
+// describes a file of this length
+// whether the size and element size a header claims fit the types they're
+// read into, and the block they make up fits a size_t. without this, a
+// crafted header could make set_alloc_size wrap around to the file's length
+static bool set_file_sizes_fit(const set_file_header* fh) {
+	size_t room = SIZE_MAX - SET_FILE_PAGE - sizeof(set_header) - sizeof(set_hash_t);
+
+	return fh->size == (set_size_t)fh->size && fh->type_size == (set_type_t)fh->type_size &&
+	       fh->type_size <= room && fh->size <= room / (fh->type_size + sizeof(set_hash_t));
+}
+
+static bool set_file_header_is_valid(const set_file_header* fh, size_t length, set_type_t type_size) {
+	return length >= SET_FILE_PAGE + sizeof(set_header) &&
+	       memcmp(fh->magic, SET_FILE_MAGIC, sizeof(fh->magic)) == 0 && fh->version == SET_FILE_VERSION &&
+	       fh->header_checksum == set_file_header_checksum(fh) && fh->byte_order == SET_FILE_BYTE_ORDER &&
+	       fh->hash_size == sizeof(set_hash_t) && fh->header_size == sizeof(set_header) &&
+	       (type_size == 0 || fh->type_size == type_size) && fh->type_size > 0 &&
+	       fh->file_size == length && set_file_sizes_fit(fh) &&
+	       length == SET_FILE_PAGE + set_alloc_size((set_size_t)fh->size, (set_type_t)fh->type_size, true);
+}
+
+static void* set_file_alloc(void* ctx, size_t size) {
+	(void)ctx;
+	return malloc(size);
+}
+
+// the allocator for a set made from the one at h. a mapped set's allocator
+// goes away with its mapping, but it allocates with malloc anyway
+static const set_allocator* set_copy_allocator(set_header* h) {
+	return h->allocator->alloc_fn == set_file_alloc ? &set_default_allocator : h->allocator;
+}
+
+#ifdef SET_MAP_FILES
+
+// the allocator of a mapped set. its block is the only thing that lives in
+// the mapping: when it has to be resized it moves to the heap, and the set
+// goes on with the default allocator
+static set_header* set_file_block(set_file_mapping* m) {
+	return (set_header*)((unsigned char*)m + SET_FILE_PAGE);
+}
+
+static void* set_file_realloc(void* ctx, void* p, size_t old_size, size_t new_size) {
+	set_file_mapping* m = (set_file_mapping*)ctx;
+
+	if (p != set_file_block(m)) {
+		return realloc(p, new_size);
+	}
+	set_header* q = (set_header*)malloc(new_size);
+	memcpy(q, p, old_size < new_size ? old_size : new_size);
+	q->allocator = &set_default_allocator;
+	munmap(m, m->length);
+	return q;
+}
+
+static void set_file_free(void* ctx, void* p, size_t size) {
+	set_file_mapping* m = (set_file_mapping*)ctx;
+
+	(void)size;
+	if (p == set_file_block(m)) {
+		munmap(m, m->length);
+	} else {
+		free(p);
+	}
+}
+
+#endif
+
+set _set_open_mmap(const char* path, set_type_t type_size) {
+#ifdef SET_MAP_FILES
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < SET_FILE_PAGE + sizeof(set_header)) {
+		close(fd);
+		return NULL;
+	}
+	size_t length = (size_t)st.st_size;
+	void* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	set_file_mapping* m = (set_file_mapping*)base;
+	if (!set_file_header_is_valid(&m->file, length, type_size)) {
+		munmap(base, length);
+		return NULL;
+	}
+	m->allocator.alloc_fn = set_file_alloc;
+	m->allocator.realloc_fn = set_file_realloc;
+	m->allocator.free_fn = set_file_free;
+	m->allocator.ctx = m;
+	m->length = length;
+
+	// only the file header is checked, so the block's header is rebuilt from
+	// it rather than trusted: a damaged or crafted file can give wrong answers,
+	// but not make the set read past the mapping or free pointers it stored
+	set_header* h = set_file_block(m);
+	memset(h, 0, sizeof(set_header));
+	h->size = (set_size_t)m->file.size;
+	h->capacity = (set_size_t)m->file.size;
+	h->_hash = (set_hash_t*)((unsigned char*)h + set_hash_offset(h->size, (set_type_t)m->file.type_size));
+	h->refs = 1;
+	h->allocator = &m->allocator;
+	h->growth = &set_default_growth;
+	h->engine = SET_ENGINE_SORTED;
+	h->flags = 0;
+	return h->data;
+#else
+	(void)path;
+	(void)type_size;
+	return NULL;
+#endif
+}
+
+bool set_verify_file(const char* path) {
+	FILE* f = fopen(path, "rb");
+	set_file_header fh;
+	bool ok = false;
+
+	if (f == NULL) {
+		return false;
+	}
+	if (fread(&fh, 1, sizeof(fh), f) == sizeof(fh) && fseek(f, 0, SEEK_END) == 0) {
+		long length = ftell(f);
+		unsigned char* buf = (unsigned char*)malloc(SET_FILE_CHUNK);
+		uint64_t sum = 0;
+		size_t n;
+
+		ok = length > 0 && set_file_header_is_valid(&fh, (size_t)length, 0) && fseek(f, SET_FILE_PAGE, SEEK_SET) == 0;
+		while (ok && (n = fread(buf, 1, SET_FILE_CHUNK, f)) > 0) {
+			sum = set_checksum(sum, buf, n);
+		}
+		ok = ok && !ferror(f) && sum == fh.checksum;
+		free(buf);
+	}
+	fclose(f);
+	return ok;
+}
+
+// bitmap sets: a header with the universe, then one bit per possible key.
+// the word-wise operations are vectorised with AVX2 or SSE2 when available
+
+typedef struct {
+	size_t universe;
+	size_t words;
+	uint64_t bits[];
+} set_bitmap_header;
+
+// how two bitmaps are combined
+#define SET_BITMAP_OR 0
+#define SET_BITMAP_AND 1
+#define SET_BITMAP_ANDNOT 2
+
+static set_bitmap_header* set_bitmap_get_header(set_bitmap bm) {
+	return &((set_bitmap_header*)bm)[-1];
+}
+
+static size_t set_bitmap_words(size_t universe) {
+	return (universe + 63) / 64;
+}
+
+static unsigned set_popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+	return (unsigned)__builtin_popcountll(x);
+#else
+	x -= (x >> 1) & 0x5555555555555555ULL;
+	x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (unsigned)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+// out[i] = a[i] op b[i] for n words. out may be a
+static void set_bitmap_combine(uint64_t* out, const uint64_t* a, const uint64_t* b, size_t n, int op) {
+	size_t i = 0;
+
+#if defined(__AVX2__)
+	for (; i < n / 4 * 4; i += 4) {
+		__m256i x = _mm256_loadu_si256((const __m256i*)&a[i]);
+		__m256i y = _mm256_loadu_si256((const __m256i*)&b[i]);
+		__m256i r = op == SET_BITMAP_OR ? _mm256_or_si256(x, y) :
+		            op == SET_BITMAP_AND ? _mm256_and_si256(x, y) : _mm256_andnot_si256(y, x);
+		_mm256_storeu_si256((__m256i*)&out[i], r);
+	}
+#elif defined(SET_SSE2)
+	for (; i < n / 2 * 2; i += 2) {
+		__m128i x = _mm_loadu_si128((const __m128i*)&a[i]);
+		__m128i y = _mm_loadu_si128((const __m128i*)&b[i]);
+		__m128i r = op == SET_BITMAP_OR ? _mm_or_si128(x, y) :
+		            op == SET_BITMAP_AND ? _mm_and_si128(x, y) : _mm_andnot_si128(y, x);
+		_mm_storeu_si128((__m128i*)&out[i], r);
+	}
+#endif
+	for (; i < n; i++) {
+		out[i] = op == SET_BITMAP_OR ? a[i] | b[i] :
+		         op == SET_BITMAP_AND ? a[i] & b[i] : a[i] & ~b[i];
+	}
+}
+
+set_bitmap set_create_bitmap(size_t universe) {
+	size_t words = set_bitmap_words(universe);
+	set_bitmap_header* h = (set_bitmap_header*)malloc(sizeof(set_bitmap_header) + words * sizeof(uint64_t));
+
+	h->universe = universe;
+	h->words = words;
+	memset(h->bits, 0, words * sizeof(uint64_t));
+	return h->bits;
+}
+
+void set_bitmap_free(set_bitmap bm) {
+	free(set_bitmap_get_header(bm));
+}
+
+set_bitmap set_bitmap_copy(set_bitmap bm) {
+	set_bitmap_header* h = set_bitmap_get_header(bm);
+	set_bitmap copy = set_create_bitmap(h->universe);
+
+	memcpy(copy, bm, h->words * sizeof(uint64_t));
+	return copy;
+}
+
+size_t set_bitmap_universe(set_bitmap bm) {
+	return set_bitmap_get_header(bm)->universe;
+}
+
+bool set_bitmap_add(set_bitmap bm, size_t key) {
+	if (key >= set_bitmap_get_header(bm)->universe) {
+		return false;
+	}
+	bm[key / 64] |= (uint64_t)1 << (key % 64);
+	return true;
+}
+
+bool set_bitmap_contains(set_bitmap bm, size_t key) {
+	return key < set_bitmap_get_header(bm)->universe && (bm[key / 64] >> (key % 64) & 1);
+}
+
+void set_bitmap_remove(set_bitmap bm, size_t key) {
+	if (key < set_bitmap_get_header(bm)->universe) {
+		bm[key / 64] &= ~((uint64_t)1 << (key % 64));
+	}
+}
+
+size_t set_bitmap_size(set_bitmap bm) {
+	set_bitmap_header* h = set_bitmap_get_header(bm);
+	size_t count = 0;
+
+	for (size_t i = 0; i < h->words; i++) {
+		count += set_popcount64(bm[i]);
+	}
+	return count;
+}
+
+// the result of a union covers both universes, the other operations keep a's
+static set_bitmap set_bitmap_apply(set_bitmap a, set_bitmap b, int op) {
+	set_bitmap_header* ha = set_bitmap_get_header(a);
+	set_bitmap_header* hb = set_bitmap_get_header(b);
+	size_t universe = op == SET_BITMAP_OR && hb->universe > ha->universe ? hb->universe : ha->universe;
+	size_t common = ha->words < hb->words ? ha->words : hb->words;
+	set_bitmap out = set_create_bitmap(universe);
+
+	set_bitmap_combine(out, a, b, common, op);
+	if (op == SET_BITMAP_AND) {
+		return out;
+	}
+	// past the end of the shorter bitmap, a union or difference keeps what's
+	// in the longer one (for a difference, that can only be a)
+	if (ha->words > common) {
+		memcpy(&out[common], &a[common], (ha->words - common) * sizeof(uint64_t));
+	} else if (op == SET_BITMAP_OR && hb->words > common) {
+		memcpy(&out[common], &b[common], (hb->words - common) * sizeof(uint64_t));
+	}
+	return out;
+}
+
+static void set_bitmap_apply_update(set_bitmap* bm_addr, set_bitmap other, int op) {
+	set_bitmap_header* ha = set_bitmap_get_header(*bm_addr);
+	set_bitmap_header* hb = set_bitmap_get_header(other);
+
+	if (op == SET_BITMAP_OR && hb->universe > ha->universe) {
+		set_bitmap out = set_bitmap_apply(*bm_addr, other, op);
+		set_bitmap_free(*bm_addr);
+		*bm_addr = out;
+		return;
+	}
+
+	size_t common = ha->words < hb->words ? ha->words : hb->words;
+	set_bitmap_combine(*bm_addr, *bm_addr, other, common, op);
+	if (op == SET_BITMAP_AND) {
+		memset(&(*bm_addr)[common], 0, (ha->words - common) * sizeof(uint64_t));
+	}
+}
+
+set_bitmap set_bitmap_union(set_bitmap a, set_bitmap b) {
+	return set_bitmap_apply(a, b, SET_BITMAP_OR);
+}
+
+set_bitmap set_bitmap_intersection(set_bitmap a, set_bitmap b) {
+	return set_bitmap_apply(a, b, SET_BITMAP_AND);
+}
+
+set_bitmap set_bitmap_difference(set_bitmap a, set_bitmap b) {
+	return set_bitmap_apply(a, b, SET_BITMAP_ANDNOT);
+}
+
+void set_bitmap_union_update(set_bitmap* bm_addr, set_bitmap other) {
+	set_bitmap_apply_update(bm_addr, other, SET_BITMAP_OR);
+}
+
+void set_bitmap_intersection_update(set_bitmap* bm_addr, set_bitmap other) {
+	set_bitmap_apply_update(bm_addr, other, SET_BITMAP_AND);
+}
+
+void set_bitmap_difference_update(set_bitmap* bm_addr, set_bitmap other) {
+	set_bitmap_apply_update(bm_addr, other, SET_BITMAP_ANDNOT);
+}
+
+// roaring sets: 32 bit keys are bucketed by their high 16 bits, and each
+// bucket keeps its low 16 bits in whichever container is smallest for it: a
+// sorted array for up to ROARING_ARRAY_MAX keys, a 65536 bit bitmap above
+// that, or a list of runs for long consecutive stretches
+
+#define ROARING_ARRAY 0
+#define ROARING_BITMAP 1
+#define ROARING_RUN 2
+
+#define ROARING_ARRAY_MAX 4096
+#define ROARING_WORDS 1024
+// a run container with more runs than this is bigger than a bitmap
+#define ROARING_RUNS_MAX 2048
+
+// the keys [start, start + length]
+typedef struct {
+	uint16_t start;
+	uint16_t length;
+} set_roaring_run;
+
+typedef struct {
+	uint16_t key;		// high 16 bits shared by the container's keys
+	uint16_t type;
+	uint32_t n;		// values of an array, runs of a run container
+	uint32_t capacity;	// room for that many, unused for bitmaps
+	uint32_t cardinality;
+	void* data;
+} set_roaring_container;
+
+struct set_roaring {
+	set_roaring_container* containers;
+	size_t count;
+	size_t capacity;
+};
+
+// first i with v[i] >= x
+static uint32_t roaring_lower_bound(const uint16_t* v, uint32_t n, uint16_t x) {
+	uint32_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (v[mid] < x) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// the last run starting at or before x, or -1
+static int32_t roaring_run_index(const set_roaring_run* runs, uint32_t n, uint16_t x) {
+	uint32_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (runs[mid].start <= x) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (int32_t)lo - 1;
+}
+
+static size_t roaring_find_container(const set_roaring* r, uint16_t key) {
+	size_t lo = 0, hi = r->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (r->containers[mid].key < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static bool roaring_container_contains(const set_roaring_container* c, uint16_t low) {
+	switch (c->type) {
+	case ROARING_ARRAY: {
+		const uint16_t* values = (const uint16_t*)c->data;
+		uint32_t i = roaring_lower_bound(values, c->n, low);
+		return i < c->n && values[i] == low;
+	}
+	case ROARING_BITMAP:
+		return ((const uint64_t*)c->data)[low / 64] >> (low % 64) & 1;
+	default: {
+		const set_roaring_run* runs = (const set_roaring_run*)c->data;
+		int32_t i = roaring_run_index(runs, c->n, low);
+		return i >= 0 && low - runs[i].start <= runs[i].length;
+	}
+	}
+}
+
+// sets the bits [from, to] of a container bitmap
+static void roaring_set_range(uint64_t* words, uint32_t from, uint32_t to) {
+	uint32_t first = from / 64, last = to / 64;
+	uint64_t head = ~(uint64_t)0 << (from % 64);
+	uint64_t tail = ~(uint64_t)0 >> (63 - to % 64);
+
+	if (first == last) {
+		words[first] |= head & tail;
+		return;
+	}
+	words[first] |= head;
+	for (uint32_t w = first + 1; w < last; w++) {
+		words[w] = ~(uint64_t)0;
+	}
+	words[last] |= tail;
+}
+
+static void roaring_to_bitmap(const set_roaring_container* c, uint64_t* words) {
+	if (c->type == ROARING_BITMAP) {
+		memcpy(words, c->data, ROARING_WORDS * sizeof(uint64_t));
+		return;
+	}
+	memset(words, 0, ROARING_WORDS * sizeof(uint64_t));
+	if (c->type == ROARING_ARRAY) {
+		const uint16_t* values = (const uint16_t*)c->data;
+		for (uint32_t i = 0; i < c->n; i++) {
+			words[values[i] / 64] |= (uint64_t)1 << (values[i] % 64);
+		}
+	} else {
+		const set_roaring_run* runs = (const set_roaring_run*)c->data;
+		for (uint32_t i = 0; i < c->n; i++) {
+			roaring_set_range(words, runs[i].start, runs[i].start + runs[i].length);
+		}
+	}
+}
+
+static uint32_t roaring_popcount(const uint64_t* words) {
+	uint32_t count = 0;
+
+	for (uint32_t w = 0; w < ROARING_WORDS; w++) {
+		count += set_popcount64(words[w]);
+	}
+	return count;
+}
+
+// turns c into a container for the bits of words, taking ownership of them.
+// sparse results become arrays
+static void roaring_from_bitmap(set_roaring_container* c, uint64_t* words, uint32_t cardinality) {
+	c->cardinality = cardinality;
+	if (cardinality > ROARING_ARRAY_MAX) {
+		c->type = ROARING_BITMAP;
+		c->n = c->capacity = 0;
+		c->data = words;
+		return;
+	}
+
+	uint16_t* values = (uint16_t*)malloc((cardinality ? cardinality : 1) * sizeof(uint16_t));
+	uint32_t n = 0;
+	for (uint32_t w = 0; w < ROARING_WORDS; w++) {
+		for (uint64_t bits = words[w]; bits != 0; bits &= bits - 1) {
+			values[n++] = (uint16_t)(w * 64 + set_popcount64((bits & -bits) - 1));
+		}
+	}
+	free(words);
+	c->type = ROARING_ARRAY;
+	c->n = c->capacity = cardinality;
+	c->data = values;
+}
+
+static void roaring_convert_to_bitmap(set_roaring_container* c) {
+	uint64_t* words = (uint64_t*)malloc(ROARING_WORDS * sizeof(uint64_t));
+
+	roaring_to_bitmap(c, words);
+	free(c->data);
+	c->type = ROARING_BITMAP;
+	c->n = c->capacity = 0;
+	c->data = words;
+}
+
+// makes room for one more array value or run
+static void roaring_reserve(set_roaring_container* c, size_t element_size) {
+	if (c->n == c->capacity) {
+		c->capacity = c->capacity ? c->capacity * 2 : 4;
+		c->data = realloc(c->data, c->capacity * element_size);
+	}
+}
+
+static bool roaring_container_add(set_roaring_container* c, uint16_t low) {
+	if (c->type == ROARING_BITMAP) {
+		uint64_t* words = (uint64_t*)c->data;
+		uint64_t bit = (uint64_t)1 << (low % 64);
+		if (words[low / 64] & bit) {
+			return false;
+		}
+		words[low / 64] |= bit;
+		++c->cardinality;
+		return true;
+	}
+
+	if (c->type == ROARING_ARRAY) {
+		uint16_t* values = (uint16_t*)c->data;
+		uint32_t i = roaring_lower_bound(values, c->n, low);
+		if (i < c->n && values[i] == low) {
+			return false;
+		}
+		if (c->n == ROARING_ARRAY_MAX) {
+			roaring_convert_to_bitmap(c);
+			return roaring_container_add(c, low);
+		}
+		roaring_reserve(c, sizeof(uint16_t));
+		values = (uint16_t*)c->data;
+		memmove(&values[i + 1], &values[i], (c->n - i) * sizeof(uint16_t));
+		values[i] = low;
+		++c->n;
+		++c->cardinality;
+		return true;
+	}
+
+	set_roaring_run* runs = (set_roaring_run*)c->data;
+	int32_t i = roaring_run_index(runs, c->n, low);
+	if (i >= 0 && low - runs[i].start <= runs[i].length) {
+		return false;
+	}
+	bool after_prev = i >= 0 && runs[i].start + runs[i].length + 1 == low;
+	bool before_next = (uint32_t)(i + 1) < c->n && runs[i + 1].start == low + 1;
+
+	if (after_prev && before_next) {
+		runs[i].length += runs[i + 1].length + 2;
+		memmove(&runs[i + 1], &runs[i + 2], (c->n - i - 2) * sizeof(set_roaring_run));
+		--c->n;
+	} else if (after_prev) {
+		++runs[i].length;
+	} else if (before_next) {
+		--runs[i + 1].start;
+		++runs[i + 1].length;
+	} else {
+		roaring_reserve(c, sizeof(set_roaring_run));
+		runs = (set_roaring_run*)c->data;
+		memmove(&runs[i + 2], &runs[i + 1], (c->n - i - 1) * sizeof(set_roaring_run));
+		runs[i + 1].start = low;
+		runs[i + 1].length = 0;
+		++c->n;
+	}
+	++c->cardinality;
+	if (c->n > ROARING_RUNS_MAX) {
+		roaring_convert_to_bitmap(c);
+	}
+	return true;
+}
+
+static bool roaring_container_remove(set_roaring_container* c, uint16_t low) {
+	if (c->type == ROARING_BITMAP) {
+		uint64_t* words = (uint64_t*)c->data;
+		uint64_t bit = (uint64_t)1 << (low % 64);
+		if (!(words[low / 64] & bit)) {
+			return false;
+		}
+		words[low / 64] &= ~bit;
+		// only go back to an array well below the limit, so that adding and
+		// removing around it doesn't convert every time
+		if (--c->cardinality <= ROARING_ARRAY_MAX / 2) {
+			roaring_from_bitmap(c, words, c->cardinality);
+		}
+		return true;
+	}
+
+	if (c->type == ROARING_ARRAY) {
+		uint16_t* values = (uint16_t*)c->data;
+		uint32_t i = roaring_lower_bound(values, c->n, low);
+		if (i == c->n || values[i] != low) {
+			return false;
+		}
+		memmove(&values[i], &values[i + 1], (c->n - i - 1) * sizeof(uint16_t));
+		--c->n;
+		--c->cardinality;
+		return true;
+	}
+
+	set_roaring_run* runs = (set_roaring_run*)c->data;
+	int32_t i = roaring_run_index(runs, c->n, low);
+	if (i < 0 || low - runs[i].start > runs[i].length) {
+		return false;
+	}
+	uint16_t end = runs[i].start + runs[i].length;
+	if (runs[i].length == 0) {
+		memmove(&runs[i], &runs[i + 1], (c->n - i - 1) * sizeof(set_roaring_run));
+		--c->n;
+	} else if (low == runs[i].start) {
+		++runs[i].start;
+		--runs[i].length;
+	} else if (low == end) {
+		--runs[i].length;
+	} else {
+		// split the run around low
+		roaring_reserve(c, sizeof(set_roaring_run));
+		runs = (set_roaring_run*)c->data;
+		memmove(&runs[i + 2], &runs[i + 1], (c->n - i - 1) * sizeof(set_roaring_run));
+		runs[i].length = low - 1 - runs[i].start;
+		runs[i + 1].start = low + 1;
+		runs[i + 1].length = end - (low + 1);
+		++c->n;
+		if (c->n > ROARING_RUNS_MAX) {
+			--c->cardinality;
+			roaring_convert_to_bitmap(c);
+			return true;
+		}
+	}
+	--c->cardinality;
+	return true;
+}
+
+static void roaring_container_copy(set_roaring_container* out, const set_roaring_container* c) {
+	size_t size = c->type == ROARING_BITMAP ? ROARING_WORDS * sizeof(uint64_t) :
+	              c->type == ROARING_ARRAY ? c->n * sizeof(uint16_t) : c->n * sizeof(set_roaring_run);
+
+	*out = *c;
+	out->capacity = c->n;
+	out->data = malloc(size ? size : 1);
+	memcpy(out->data, c->data, size);
+}
+
+static size_t roaring_container_memory(const set_roaring_container* c) {
+	return c->type == ROARING_BITMAP ? ROARING_WORDS * sizeof(uint64_t) :
+	       c->type == ROARING_ARRAY ? c->capacity * sizeof(uint16_t) : c->capacity * sizeof(set_roaring_run);
+}
+
+// intersection of two containers with the same key into out
+static void roaring_container_and(set_roaring_container* out, const set_roaring_container* a, const set_roaring_container* b) {
+	out->key = a->key;
+	if (a->type == ROARING_ARRAY || b->type == ROARING_ARRAY) {
+		if (b->type == ROARING_ARRAY && a->type != ROARING_ARRAY) {
+			const set_roaring_container* t = a;
+			a = b;
+			b = t;
+		}
+		const uint16_t* av = (const uint16_t*)a->data;
+		uint16_t* values = (uint16_t*)malloc((a->n ? a->n : 1) * sizeof(uint16_t));
+		uint32_t n = 0;
+
+		if (b->type == ROARING_ARRAY) {
+			const uint16_t* bv = (const uint16_t*)b->data;
+			for (uint32_t i = 0, j = 0; i < a->n && j < b->n;) {
+				if (av[i] < bv[j]) {
+					++i;
+				} else if (av[i] > bv[j]) {
+					++j;
+				} else {
+					values[n++] = av[i];
+					++i;
+					++j;
+				}
+			}
+		} else {
+			for (uint32_t i = 0; i < a->n; i++) {
+				values[n] = av[i];
+				n += roaring_container_contains(b, av[i]);
+			}
+		}
+		out->type = ROARING_ARRAY;
+		out->n = out->capacity = out->cardinality = n;
+		out->data = values;
+		return;
+	}
+
+	uint64_t* words = (uint64_t*)malloc(ROARING_WORDS * sizeof(uint64_t));
+	uint64_t other[ROARING_WORDS];
+	roaring_to_bitmap(a, words);
+	if (b->type != ROARING_BITMAP) {
+		roaring_to_bitmap(b, other);
+	}
+	set_bitmap_combine(words, words, b->type == ROARING_BITMAP ? (const uint64_t*)b->data : other,
+	                   ROARING_WORDS, SET_BITMAP_AND);
+	roaring_from_bitmap(out, words, roaring_popcount(words));
+}
+
+// union of two containers with the same key into out
+static void roaring_container_or(set_roaring_container* out, const set_roaring_container* a, const set_roaring_container* b) {
+	out->key = a->key;
+	if (a->type == ROARING_ARRAY && b->type == ROARING_ARRAY && a->n + b->n <= ROARING_ARRAY_MAX) {
+		const uint16_t* av = (const uint16_t*)a->data;
+		const uint16_t* bv = (const uint16_t*)b->data;
+		uint16_t* values = (uint16_t*)malloc((a->n + b->n ? a->n + b->n : 1) * sizeof(uint16_t));
+		uint32_t n = 0, i = 0, j = 0;
+
+		while (i < a->n && j < b->n) {
+			uint16_t x = av[i], y = bv[j];
+			values[n++] = x < y ? x : y;
+			i += x <= y;
+			j += y <= x;
+		}
+		while (i < a->n) {
+			values[n++] = av[i++];
+		}
+		while (j < b->n) {
+			values[n++] = bv[j++];
+		}
+		out->type = ROARING_ARRAY;
+		out->n = out->cardinality = n;
+		out->capacity = a->n + b->n;
+		out->data = values;
+		return;
+	}
+
+	if (b->type == ROARING_BITMAP && a->type != ROARING_BITMAP) {
+		const set_roaring_container* t = a;
+		a = b;
+		b = t;
+	}
+	uint64_t* words = (uint64_t*)malloc(ROARING_WORDS * sizeof(uint64_t));
+	roaring_to_bitmap(a, words);
+	if (b->type == ROARING_ARRAY) {
+		const uint16_t* bv = (const uint16_t*)b->data;
+		for (uint32_t i = 0; i < b->n; i++) {
+			words[bv[i] / 64] |= (uint64_t)1 << (bv[i] % 64);
+		}
+	} else {
+		uint64_t other[ROARING_WORDS];
+		if (b->type != ROARING_BITMAP) {
+			roaring_to_bitmap(b, other);
+		}
+		set_bitmap_combine(words, words, b->type == ROARING_BITMAP ? (const uint64_t*)b->data : other,
+		                   ROARING_WORDS, SET_BITMAP_OR);
+	}
+	roaring_from_bitmap(out, words, roaring_popcount(words));
+}
+
+static set_roaring_container* roaring_insert_container(set_roaring* r, size_t i, uint16_t key) {
+	if (r->count == r->capacity) {
+		r->capacity = r->capacity ? r->capacity * 2 : 4;
+		r->containers = (set_roaring_container*)realloc(r->containers, r->capacity * sizeof(set_roaring_container));
+	}
+	memmove(&r->containers[i + 1], &r->containers[i], (r->count - i) * sizeof(set_roaring_container));
+	++r->count;
+
+	set_roaring_container* c = &r->containers[i];
+	c->key = key;
+	c->type = ROARING_ARRAY;
+	c->n = c->capacity = c->cardinality = 0;
+	c->data = NULL;
+	return c;
+}
+
+set_roaring* set_create_roaring(void) {
+	set_roaring* r = (set_roaring*)malloc(sizeof(set_roaring));
+
+	r->containers = NULL;
+	r->count = r->capacity = 0;
+	return r;
+}
+
+void set_roaring_free(set_roaring* r) {
+	for (size_t i = 0; i < r->count; i++) {
+		free(r->containers[i].data);
+	}
+	free(r->containers);
+	free(r);
+}
+
+bool set_roaring_add(set_roaring* r, uint32_t key) {
+	uint16_t high = (uint16_t)(key >> 16);
+	size_t i = roaring_find_container(r, high);
+
+	if (i == r->count || r->containers[i].key != high) {
+		roaring_insert_container(r, i, high);
+	}
+	return roaring_container_add(&r->containers[i], (uint16_t)key);
+}
+
+bool set_roaring_remove(set_roaring* r, uint32_t key) {
+	uint16_t high = (uint16_t)(key >> 16);
+	size_t i = roaring_find_container(r, high);
+
+	if (i == r->count || r->containers[i].key != high || !roaring_container_remove(&r->containers[i], (uint16_t)key)) {
+		return false;
+	}
+	if (r->containers[i].cardinality == 0) {
+		free(r->containers[i].data);
+		memmove(&r->containers[i], &r->containers[i + 1], (r->count - i - 1) * sizeof(set_roaring_container));
+		--r->count;
+	}
+	return true;
+}
+
+bool set_roaring_contains(const set_roaring* r, uint32_t key) {
+	uint16_t high = (uint16_t)(key >> 16);
+	size_t i = roaring_find_container(r, high);
+
+	return i < r->count && r->containers[i].key == high &&
+	       roaring_container_contains(&r->containers[i], (uint16_t)key);
+}
+
+size_t set_roaring_size(const set_roaring* r) {
+	size_t count = 0;
+
+	for (size_t i = 0; i < r->count; i++) {
+		count += r->containers[i].cardinality;
+	}
+	return count;
+}
+
+size_t set_roaring_memory(const set_roaring* r) {
+	size_t bytes = sizeof(set_roaring) + r->capacity * sizeof(set_roaring_container);
+
+	for (size_t i = 0; i < r->count; i++) {
+		bytes += roaring_container_memory(&r->containers[i]);
+	}
+	return bytes;
+}
+
+// switches every container to run encoding if that is smaller, or back from
+// it if not, and trims arrays to their size
+void set_roaring_optimize(set_roaring* r) {
+	uint64_t words[ROARING_WORDS];
+
+	for (size_t i = 0; i < r->count; i++) {
+		set_roaring_container* c = &r->containers[i];
+		uint32_t runs = 0;
+
+		roaring_to_bitmap(c, words);
+		// a run starts at every set bit whose lower neighbour is clear
+		for (uint32_t w = 0; w < ROARING_WORDS; w++) {
+			uint64_t carry = w > 0 ? words[w - 1] >> 63 : 0;
+			runs += set_popcount64(words[w] & ~(words[w] << 1 | carry));
+		}
+
+		size_t run_size = runs * sizeof(set_roaring_run);
+		size_t other_size = c->cardinality > ROARING_ARRAY_MAX ? ROARING_WORDS * sizeof(uint64_t) :
+		                    c->cardinality * sizeof(uint16_t);
+		if (run_size < other_size) {
+			set_roaring_run* list = (set_roaring_run*)malloc(run_size);
+			uint32_t n = 0;
+			for (uint32_t bit = 0; bit < 65536; bit++) {
+				if (words[bit / 64] >> (bit % 64) & 1) {
+					if (n > 0 && (uint32_t)list[n - 1].start + list[n - 1].length + 1 == bit) {
+						++list[n - 1].length;
+					} else {
+						list[n].start = (uint16_t)bit;
+						list[n].length = 0;
+						++n;
+					}
+				}
+			}
+			free(c->data);
+			c->type = ROARING_RUN;
+			c->n = c->capacity = n;
+			c->data = list;
+		} else if (c->type == ROARING_RUN) {
+			uint64_t* copy = (uint64_t*)malloc(sizeof(words));
+			memcpy(copy, words, sizeof(words));
+			free(c->data);
+			roaring_from_bitmap(c, copy, c->cardinality);
+		} else if (c->type == ROARING_ARRAY && c->capacity > c->n) {
+			c->capacity = c->n;
+			c->data = realloc(c->data, (c->n ? c->n : 1) * sizeof(uint16_t));
+		}
+	}
+}
+
+static set_roaring* roaring_combine(const set_roaring* a, const set_roaring* b, bool is_union) {
+	set_roaring* out = set_create_roaring();
+	size_t i = 0, j = 0;
+
+	while (i < a->count || j < b->count) {
+		const set_roaring_container* ca = i < a->count ? &a->containers[i] : NULL;
+		const set_roaring_container* cb = j < b->count ? &b->containers[j] : NULL;
+		set_roaring_container c;
+
+		if (ca != NULL && cb != NULL && ca->key == cb->key) {
+			if (is_union) {
+				roaring_container_or(&c, ca, cb);
+			} else {
+				roaring_container_and(&c, ca, cb);
+			}
+			++i;
+			++j;
+		} else if (cb == NULL || (ca != NULL && ca->key < cb->key)) {
+			++i;
+			if (!is_union) {
+				continue;
+			}
+			roaring_container_copy(&c, ca);
+		} else {
+			++j;
+			if (!is_union) {
+				continue;
+			}
+			roaring_container_copy(&c, cb);
+		}
+
+		if (c.cardinality == 0) {
+			free(c.data);
+			continue;
+		}
+		*roaring_insert_container(out, out->count, c.key) = c;
+	}
+	return out;
+}
+
+set_roaring* set_roaring_union(const set_roaring* a, const set_roaring* b) {
+	return roaring_combine(a, b, true);
+}
+
+set_roaring* set_roaring_intersection(const set_roaring* a, const set_roaring* b) {
+	return roaring_combine(a, b, false);
+}
+
+// persistent sets: a hash array mapped trie in the CHAMP layout. a node
+// covers 5 bits of the hash and keeps the elements whose slot ends at it
+// inline, ahead of its children, so a walk reads a node's elements in one go.
+// nodes never change once built: adding or removing copies the path from the
+// root down to the changed node and shares every other node with the old
+// version, counting its sharers. hashes that are still equal once all their
+// bits are used end in a collision node, which just lists its elements
+
+#define SET_HAMT_BITS 5
+#define SET_HAMT_HASH_BITS ((unsigned)sizeof(set_hash_t) * 8)
+
+typedef struct set_hamt_node {
+	set_size_t refs;
+	uint32_t datamap;	// slots holding an element
+	uint32_t nodemap;	// slots holding a child
+	uint32_t count;		// elements, followed by children child pointers
+	uint32_t children;
+} set_hamt_node;
+
+struct set_hamt {
+	set_hamt_node* root;	// NULL for the empty set
+	size_t size;
+	set_type_t type_size;
+};
+
+// an element is stored after its hash, padded so that the children that
+// follow the elements stay aligned
+static size_t hamt_entry_size(set_type_t type_size) {
+	return (sizeof(set_hash_t) + type_size + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+}
+
+static unsigned char* hamt_entry(const set_hamt_node* n, uint32_t i, set_type_t type_size) {
+	return (unsigned char*)(n + 1) + i * hamt_entry_size(type_size);
+}
+
+static set_hash_t hamt_entry_hash(const unsigned char* e) {
+	set_hash_t hash;
+
+	memcpy(&hash, e, sizeof(hash));
+	return hash;
+}
+
+static set_hamt_node** hamt_children(const set_hamt_node* n, set_type_t type_size) {
+	return (set_hamt_node**)hamt_entry(n, n->count, type_size);
+}
+
+static uint32_t hamt_slot(set_hash_t hash, unsigned shift) {
+	return (uint32_t)1 << ((hash >> shift) & 31);
+}
+
+static uint32_t hamt_index(uint32_t map, uint32_t bit) {
+	return set_popcount64(map & (bit - 1));
+}
+
+static set_hamt_node* hamt_node_alloc(uint32_t count, uint32_t children, set_type_t type_size) {
+	set_hamt_node* n = (set_hamt_node*)malloc(sizeof(set_hamt_node) + count * hamt_entry_size(type_size) +
+	                                          children * sizeof(set_hamt_node*));
+	n->refs = 1;
+	n->datamap = 0;
+	n->nodemap = 0;
+	n->count = count;
+	n->children = children;
+	return n;
+}
+
+static void hamt_write_entry(unsigned char* e, set_hash_t hash, const void* value, set_type_t type_size) {
+	memcpy(e, &hash, sizeof(hash));
+	memcpy(e + sizeof(hash), value, type_size);
+}
+
+static void hamt_retain(set_hamt_node* n) {
+	if (n != NULL) {
+		SET_REFS_INC(&n->refs);
+	}
+}
+
+static void hamt_release(set_hamt_node* n, set_type_t type_size) {
+	if (n == NULL || SET_REFS_DEC(&n->refs) != 0) {
+		return;
+	}
+	for (uint32_t i = 0; i < n->children; i++) {
+		hamt_release(hamt_children(n, type_size)[i], type_size);
+	}
+	free(n);
+}
+
+// a copy of n with new maps, leaving out the element drop_entry and the child
+// drop_child (-1 for none), and adding the element (hash, value) at
+// add_entry and the child add_child at add_child_at (-1 for none). the copy
+// takes over the caller's reference to add_child and shares the rest
+static set_hamt_node* hamt_edit(const set_hamt_node* n, set_type_t type_size, uint32_t datamap, uint32_t nodemap,
+                                int drop_entry, int add_entry, set_hash_t hash, const void* value,
+                                int drop_child, int add_child_at, set_hamt_node* add_child) {
+	uint32_t count = n->count - (drop_entry >= 0) + (add_entry >= 0);
+	uint32_t children = n->children - (drop_child >= 0) + (add_child_at >= 0);
+	set_hamt_node* out = hamt_node_alloc(count, children, type_size);
+	size_t entry_size = hamt_entry_size(type_size);
+	uint32_t w = 0;
+
+	out->datamap = datamap;
+	out->nodemap = nodemap;
+	for (uint32_t i = 0; i <= n->count; i++) {
+		if ((int)i == add_entry) {
+			hamt_write_entry(hamt_entry(out, w++, type_size), hash, value, type_size);
+		}
+		if (i < n->count && (int)i != drop_entry) {
+			memcpy(hamt_entry(out, w++, type_size), hamt_entry(n, i, type_size), entry_size);
+		}
+	}
+	w = 0;
+	for (uint32_t i = 0; i <= n->children; i++) {
+		if ((int)i == add_child_at) {
+			hamt_children(out, type_size)[w++] = add_child;
+		}
+		if (i < n->children && (int)i != drop_child) {
+			set_hamt_node* c = hamt_children(n, type_size)[i];
+			hamt_retain(c);
+			hamt_children(out, type_size)[w++] = c;
+		}
+	}
+	return out;
+}
+
+// a subtree at shift holding two elements with different values
+static set_hamt_node* hamt_pair(set_hash_t h1, const void* v1, set_hash_t h2, const void* v2, unsigned shift,
+                                set_type_t type_size) {
+	set_hamt_node* n;
+
+	if (shift >= SET_HAMT_HASH_BITS) {
+		n = hamt_node_alloc(2, 0, type_size);
+		hamt_write_entry(hamt_entry(n, 0, type_size), h1, v1, type_size);
+		hamt_write_entry(hamt_entry(n, 1, type_size), h2, v2, type_size);
+		return n;
+	}
+
+	uint32_t b1 = hamt_slot(h1, shift), b2 = hamt_slot(h2, shift);
+	if (b1 == b2) {
+		n = hamt_node_alloc(0, 1, type_size);
+		n->nodemap = b1;
+		hamt_children(n, type_size)[0] = hamt_pair(h1, v1, h2, v2, shift + SET_HAMT_BITS, type_size);
+		return n;
+	}
+	n = hamt_node_alloc(2, 0, type_size);
+	n->datamap = b1 | b2;
+	hamt_write_entry(hamt_entry(n, b1 < b2 ? 0 : 1, type_size), h1, v1, type_size);
+	hamt_write_entry(hamt_entry(n, b1 < b2 ? 1 : 0, type_size), h2, v2, type_size);
+	return n;
+}
+
+static bool hamt_entry_is(const unsigned char* e, set_hash_t hash, const void* value, set_type_t type_size) {
+	return hamt_entry_hash(e) == hash && memcmp(e + sizeof(set_hash_t), value, type_size) == 0;
+}
+
+static bool hamt_find(const set_hamt_node* n, set_hash_t hash, const void* value, set_type_t type_size) {
+	for (unsigned shift = 0; n != NULL; shift += SET_HAMT_BITS) {
+		if (shift >= SET_HAMT_HASH_BITS) {
+			for (uint32_t i = 0; i < n->count; i++) {
+				if (hamt_entry_is(hamt_entry(n, i, type_size), hash, value, type_size)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		uint32_t bit = hamt_slot(hash, shift);
+		if (n->datamap & bit) {
+			return hamt_entry_is(hamt_entry(n, hamt_index(n->datamap, bit), type_size), hash, value, type_size);
+		}
+		if (!(n->nodemap & bit)) {
+			return false;
+		}
+		n = hamt_children(n, type_size)[hamt_index(n->nodemap, bit)];
+	}
+	return false;
+}
+
+// the node at shift with value added, or NULL if it's already there
+static set_hamt_node* hamt_insert(const set_hamt_node* n, set_hash_t hash, const void* value, unsigned shift,
+                                  set_type_t type_size) {
+	if (shift >= SET_HAMT_HASH_BITS) {
+		for (uint32_t i = 0; i < n->count; i++) {
+			if (hamt_entry_is(hamt_entry(n, i, type_size), hash, value, type_size)) {
+				return NULL;
+			}
+		}
+		return hamt_edit(n, type_size, 0, 0, -1, (int)n->count, hash, value, -1, -1, NULL);
+	}
+
+	uint32_t bit = hamt_slot(hash, shift);
+	if (n->datamap & bit) {
+		uint32_t i = hamt_index(n->datamap, bit);
+		const unsigned char* e = hamt_entry(n, i, type_size);
+		if (hamt_entry_is(e, hash, value, type_size)) {
+			return NULL;
+		}
+		// the two elements move down into a new child
+		set_hamt_node* child = hamt_pair(hamt_entry_hash(e), e + sizeof(set_hash_t), hash, value,
+		                                 shift + SET_HAMT_BITS, type_size);
+		return hamt_edit(n, type_size, n->datamap & ~bit, n->nodemap | bit, (int)i, -1, 0, NULL,
+		                 -1, (int)hamt_index(n->nodemap | bit, bit), child);
+	}
+	if (n->nodemap & bit) {
+		uint32_t i = hamt_index(n->nodemap, bit);
+		set_hamt_node* child = hamt_insert(hamt_children(n, type_size)[i], hash, value, shift + SET_HAMT_BITS, type_size);
+		if (child == NULL) {
+			return NULL;
+		}
+		return hamt_edit(n, type_size, n->datamap, n->nodemap, -1, -1, 0, NULL, (int)i, (int)i, child);
+	}
+	return hamt_edit(n, type_size, n->datamap | bit, n->nodemap, -1, (int)hamt_index(n->datamap | bit, bit),
+	                 hash, value, -1, -1, NULL);
+}
+
+// the node at shift without value, which is NULL once it's empty. found is
+// set to false, and nothing is built, if value isn't there. a child that is
+// left with a single element and no children of its own is folded into its
+// parent, so that every set has one shape whatever its history
+static set_hamt_node* hamt_delete(const set_hamt_node* n, set_hash_t hash, const void* value, unsigned shift,
+                                  set_type_t type_size, bool* found) {
+	*found = false;
+	if (shift >= SET_HAMT_HASH_BITS) {
+		for (uint32_t i = 0; i < n->count; i++) {
+			if (hamt_entry_is(hamt_entry(n, i, type_size), hash, value, type_size)) {
+				*found = true;
+				return n->count == 1 ? NULL : hamt_edit(n, type_size, 0, 0, (int)i, -1, 0, NULL, -1, -1, NULL);
+			}
+		}
+		return NULL;
+	}
+
+	uint32_t bit = hamt_slot(hash, shift);
+	if (n->datamap & bit) {
+		uint32_t i = hamt_index(n->datamap, bit);
+		if (!hamt_entry_is(hamt_entry(n, i, type_size), hash, value, type_size)) {
+			return NULL;
+		}
+		*found = true;
+		if (n->count == 1 && n->children == 0) {
+			return NULL;
+		}
+		return hamt_edit(n, type_size, n->datamap & ~bit, n->nodemap, (int)i, -1, 0, NULL, -1, -1, NULL);
+	}
+	if (!(n->nodemap & bit)) {
+		return NULL;
+	}
+
+	uint32_t i = hamt_index(n->nodemap, bit);
+	set_hamt_node* child = hamt_delete(hamt_children(n, type_size)[i], hash, value, shift + SET_HAMT_BITS,
+	                                   type_size, found);
+	if (!*found) {
+		return NULL;
+	}
+	if (child == NULL) {
+		if (n->count == 0 && n->children == 1) {
+			return NULL;
+		}
+		return hamt_edit(n, type_size, n->datamap, n->nodemap & ~bit, -1, -1, 0, NULL, (int)i, -1, NULL);
+	}
+	if (child->count == 1 && child->children == 0) {
+		const unsigned char* e = hamt_entry(child, 0, type_size);
+		set_hamt_node* out = hamt_edit(n, type_size, n->datamap | bit, n->nodemap & ~bit, -1,
+		                               (int)hamt_index(n->datamap | bit, bit), hamt_entry_hash(e),
+		                               e + sizeof(set_hash_t), (int)i, -1, NULL);
+		hamt_release(child, type_size);
+		return out;
+	}
+	return hamt_edit(n, type_size, n->datamap, n->nodemap, -1, -1, 0, NULL, (int)i, (int)i, child);
+}
+
+static set_hamt* hamt_version(set_hamt_node* root, size_t size, set_type_t type_size) {
+	set_hamt* v = (set_hamt*)malloc(sizeof(set_hamt));
+
+	v->root = root;
+	v->size = size;
+	v->type_size = type_size;
+	return v;
+}
+
+set_hamt* set_create_hamt(set_type_t type_size) {
+	return hamt_version(NULL, 0, type_size);
+}
+
+void set_hamt_free(set_hamt* v) {
+	hamt_release(v->root, v->type_size);
+	free(v);
+}
+
+set_hamt* set_hamt_add(const set_hamt* v, const void* value) {
+	set_hash_t hash = _default_hash(value, v->type_size);
+	set_hamt_node* root;
+
+	if (v->root == NULL) {
+		root = hamt_node_alloc(1, 0, v->type_size);
+		root->datamap = hamt_slot(hash, 0);
+		hamt_write_entry(hamt_entry(root, 0, v->type_size), hash, value, v->type_size);
+		return hamt_version(root, 1, v->type_size);
+	}
+	root = hamt_insert(v->root, hash, value, 0, v->type_size);
+	if (root == NULL) {
+		hamt_retain(v->root);
+		return hamt_version(v->root, v->size, v->type_size);
+	}
+	return hamt_version(root, v->size + 1, v->type_size);
+}
+
+set_hamt* set_hamt_remove(const set_hamt* v, const void* value) {
+	set_hash_t hash = _default_hash(value, v->type_size);
+	bool found = false;
+	set_hamt_node* root = NULL;
+
+	if (v->root != NULL) {
+		root = hamt_delete(v->root, hash, value, 0, v->type_size, &found);
+	}
+	if (!found) {
+		hamt_retain(v->root);
+		return hamt_version(v->root, v->size, v->type_size);
+	}
+	return hamt_version(root, v->size - 1, v->type_size);
+}
+
+bool set_hamt_contains(const set_hamt* v, const void* value) {
+	return hamt_find(v->root, _default_hash(value, v->type_size), value, v->type_size);
+}
+
+size_t set_hamt_size(const set_hamt* v) {
+	return v->size;
+}
+
+static void hamt_each(const set_hamt_node* n, set_type_t type_size, set_visitor fn, void* ctx) {
+	for (uint32_t i = 0; i < n->count; i++) {
+		fn(hamt_entry(n, i, type_size) + sizeof(set_hash_t), ctx);
+	}
+	for (uint32_t i = 0; i < n->children; i++) {
+		hamt_each(hamt_children(n, type_size)[i], type_size, fn, ctx);
+	}
+}
+
+void set_hamt_foreach(const set_hamt* v, set_visitor fn, void* ctx) {
+	if (v->root != NULL) {
+		hamt_each(v->root, v->type_size, fn, ctx);
+	}
+}
+
+typedef struct {
+	set_diff_visitor fn;
+	void* ctx;
+	set_type_t type_size;
+} set_hamt_differ;
+
+// reports every element under n but skip (which may be NULL), and whether
+// skip was among them
+static bool hamt_report(const set_hamt_differ* d, const set_hamt_node* n, const void* skip, bool in_a) {
+	bool skipped = false;
+
+	for (uint32_t i = 0; i < n->count; i++) {
+		const unsigned char* element = hamt_entry(n, i, d->type_size) + sizeof(set_hash_t);
+		if (skip != NULL && !skipped && memcmp(element, skip, d->type_size) == 0) {
+			skipped = true;
+		} else {
+			d->fn(element, in_a, d->ctx);
+		}
+	}
+	for (uint32_t i = 0; i < n->children; i++) {
+		skipped |= hamt_report(d, hamt_children(n, d->type_size)[i], skipped ? NULL : skip, in_a);
+	}
+	return skipped;
+}
+
+// walks a and b slot by slot, skipping every subtree the two versions share
+static void hamt_diff(const set_hamt_differ* d, const set_hamt_node* a, const set_hamt_node* b, unsigned shift) {
+	set_type_t t = d->type_size;
+
+	if (a == b) {
+		return;
+	}
+	if (a == NULL || b == NULL) {
+		hamt_report(d, a != NULL ? a : b, NULL, a != NULL);
+		return;
+	}
+	if (shift >= SET_HAMT_HASH_BITS) {
+		for (uint32_t i = 0; i < a->count; i++) {
+			const unsigned char* e = hamt_entry(a, i, t);
+			if (!hamt_find(b, hamt_entry_hash(e), e + sizeof(set_hash_t), t)) {
+				d->fn(e + sizeof(set_hash_t), true, d->ctx);
+			}
+		}
+		for (uint32_t i = 0; i < b->count; i++) {
+			const unsigned char* e = hamt_entry(b, i, t);
+			if (!hamt_find(a, hamt_entry_hash(e), e + sizeof(set_hash_t), t)) {
+				d->fn(e + sizeof(set_hash_t), false, d->ctx);
+			}
+		}
+		return;
+	}
+
+	uint32_t slots = a->datamap | a->nodemap | b->datamap | b->nodemap;
+	while (slots != 0) {
+		uint32_t bit = slots & (0u - slots);
+		const unsigned char* ea = a->datamap & bit ? hamt_entry(a, hamt_index(a->datamap, bit), t) : NULL;
+		const unsigned char* eb = b->datamap & bit ? hamt_entry(b, hamt_index(b->datamap, bit), t) : NULL;
+		const set_hamt_node* na = a->nodemap & bit ? hamt_children(a, t)[hamt_index(a->nodemap, bit)] : NULL;
+		const set_hamt_node* nb = b->nodemap & bit ? hamt_children(b, t)[hamt_index(b->nodemap, bit)] : NULL;
+
+		slots &= slots - 1;
+		if (ea != NULL && eb != NULL) {
+			if (!hamt_entry_is(ea, hamt_entry_hash(eb), eb + sizeof(set_hash_t), t)) {
+				d->fn(ea + sizeof(set_hash_t), true, d->ctx);
+				d->fn(eb + sizeof(set_hash_t), false, d->ctx);
+			}
+		} else if (ea != NULL && nb != NULL) {
+			if (!hamt_report(d, nb, ea + sizeof(set_hash_t), false)) {
+				d->fn(ea + sizeof(set_hash_t), true, d->ctx);
+			}
+		} else if (na != NULL && eb != NULL) {
+			if (!hamt_report(d, na, eb + sizeof(set_hash_t), true)) {
+				d->fn(eb + sizeof(set_hash_t), false, d->ctx);
+			}
+		} else if (na != NULL || nb != NULL) {
+			hamt_diff(d, na, nb, shift + SET_HAMT_BITS);
+		} else {
+			d->fn((ea != NULL ? ea : eb) + sizeof(set_hash_t), ea != NULL, d->ctx);
+		}
+	}
+}
+
+void set_hamt_diff(const set_hamt* a, const set_hamt* b, set_diff_visitor fn, void* ctx) {
+	set_hamt_differ d;
+
+	d.fn = fn;
+	d.ctx = ctx;
+	d.type_size = a->type_size;
+	hamt_diff(&d, a->root, b->root, 0);
+}
+
+// concurrent sets: a chained hash table with a spinlock in every bucket.
+// every operation locks only the one bucket its element hashes to, so
+// threads working on different buckets never wait for each other. growing
+// is done by all the threads that use the set while it's under way: the one
+// that finds the table too full links a table twice as big behind it, and
+// every thread that then runs into the old table claims a chunk of its
+// buckets and moves their chains over. a moved bucket is left marked, and an
+// operation that finds its bucket marked goes on to the newer table. old
+// tables are kept until the set is freed, as a thread may still be reading one
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SET_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SET_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define SET_ATOMIC_ADD(p, v) __atomic_add_fetch(p, v, __ATOMIC_RELAXED)
+#define SET_ATOMIC_CAS(p, expected, v)\
+	__atomic_compare_exchange_n(p, expected, v, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+#define SET_ATOMIC_LOAD(p) (*(p))
+#define SET_ATOMIC_STORE(p, v) (*(p) = (v))
+#define SET_ATOMIC_ADD(p, v) (*(p) += (v))
+#define SET_ATOMIC_CAS(p, expected, v) (*(p) == *(expected) ? (*(p) = (v), true) : (*(expected) = *(p), false))
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SET_SPIN_PAUSE() __builtin_ia32_pause()
+#else
+#define SET_SPIN_PAUSE() ((void)0)
+#endif
+
+#ifdef SET_MAP_FILES
+#include <sched.h>
+#define SET_SPIN_YIELD() sched_yield()
+#else
+#define SET_SPIN_YIELD() ((void)0)
+#endif
+
+// bucket states
+#define SET_BUCKET_FREE 0
+#define SET_BUCKET_LOCKED 1
+#define SET_BUCKET_MOVED 2
+
+// buckets one thread moves at a time while growing
+#define SET_MOVE_CHUNK 256
+
+// the element count is split into padded stripes picked by hash, so that
+// threads adding at once don't all update the same cache line
+#define SET_COUNT_STRIPES 64
+#define SET_CACHE_LINE 64
+
+typedef struct set_concurrent_node {
+	struct set_concurrent_node* next;
+	set_hash_t hash;
+	// the element follows
+} set_concurrent_node;
+
+typedef struct {
+	uint32_t state;
+	set_concurrent_node* head;
+} set_concurrent_bucket;
+
+typedef struct set_concurrent_table {
+	size_t mask;	// buckets - 1
+	struct set_concurrent_table* next;	// the table being grown into, if any
+	struct set_concurrent_table* older;
+	size_t move_next;	// first bucket no thread has claimed to move yet
+	size_t moved;
+	set_concurrent_bucket buckets[];
+} set_concurrent_table;
+
+typedef struct {
+	size_t count;
+	char pad[SET_CACHE_LINE - sizeof(size_t)];
+} set_count_stripe;
+
+struct set_concurrent {
+	set_concurrent_table* table;
+	set_type_t type_size;
+	set_count_stripe counts[SET_COUNT_STRIPES];
+};
+
+static set_concurrent_table* concurrent_table_alloc(size_t buckets) {
+	set_concurrent_table* t = (set_concurrent_table*)calloc(1, sizeof(set_concurrent_table) +
+	                                                         buckets * sizeof(set_concurrent_bucket));
+	t->mask = buckets - 1;
+	return t;
+}
+
+static set_count_stripe* concurrent_stripe(set_concurrent* cs, set_hash_t hash) {
+	return &cs->counts[(hash >> (sizeof(set_hash_t) * 8 - 6)) % SET_COUNT_STRIPES];
+}
+
+// takes the spinlock at state, or returns false if it's marked as moved
+static bool set_spin_lock(uint32_t* state) {
+	for (unsigned spins = 0;; spins++) {
+		uint32_t seen = SET_ATOMIC_LOAD(state);
+		if (seen == SET_BUCKET_MOVED) {
+			return false;
+		}
+		if (seen == SET_BUCKET_FREE && SET_ATOMIC_CAS(state, &seen, SET_BUCKET_LOCKED)) {
+			return true;
+		}
+		if (spins % 16 == 15) {
+			SET_SPIN_YIELD();
+		} else {
+			SET_SPIN_PAUSE();
+		}
+	}
+}
+
+static void set_spin_unlock(uint32_t* state) {
+	SET_ATOMIC_STORE(state, SET_BUCKET_FREE);
+}
+
+// locks b, or returns false if its chain has moved to a newer table
+static bool concurrent_lock(set_concurrent_bucket* b) {
+	return set_spin_lock(&b->state);
+}
+
+static void concurrent_unlock(set_concurrent_bucket* b) {
+	set_spin_unlock(&b->state);
+}
+
+// moves the chain of t's bucket i into t->next. the newer table doesn't
+// start growing before t is empty, so its buckets can always be locked
+static void concurrent_move_bucket(set_concurrent_table* t, size_t i) {
+	set_concurrent_table* to = SET_ATOMIC_LOAD(&t->next);
+	set_concurrent_bucket* b = &t->buckets[i];
+
+	concurrent_lock(b);
+	for (set_concurrent_node* n = b->head; n != NULL;) {
+		set_concurrent_node* next = n->next;
+		set_concurrent_bucket* dst = &to->buckets[n->hash & to->mask];
+		concurrent_lock(dst);
+		n->next = dst->head;
+		dst->head = n;
+		concurrent_unlock(dst);
+		n = next;
+	}
+	b->head = NULL;
+	SET_ATOMIC_STORE(&b->state, SET_BUCKET_MOVED);
+}
+
+// moves chunks of t's buckets until none are left to claim. whoever moves
+// the last one makes the newer table the set's table
+static void concurrent_help_move(set_concurrent* cs, set_concurrent_table* t) {
+	size_t buckets = t->mask + 1;
+
+	for (;;) {
+		size_t start = SET_ATOMIC_ADD(&t->move_next, SET_MOVE_CHUNK) - SET_MOVE_CHUNK;
+		if (start >= buckets) {
+			return;
+		}
+
+		size_t end = start + SET_MOVE_CHUNK < buckets ? start + SET_MOVE_CHUNK : buckets;
+		for (size_t i = start; i < end; i++) {
+			concurrent_move_bucket(t, i);
+		}
+		if (SET_ATOMIC_ADD(&t->moved, end - start) == buckets) {
+			SET_ATOMIC_STORE(&cs->table, SET_ATOMIC_LOAD(&t->next));
+		}
+	}
+}
+
+// starts growing t if the stripe an element was just added to suggests the
+// table holds more elements than buckets
+static void concurrent_maybe_grow(set_concurrent* cs, set_concurrent_table* t, size_t stripe_count) {
+	if (stripe_count * SET_COUNT_STRIPES <= t->mask + 1 || SET_ATOMIC_LOAD(&cs->table) != t ||
+	    SET_ATOMIC_LOAD(&t->next) != NULL) {
+		return;
+	}
+
+	set_concurrent_table* bigger = concurrent_table_alloc((t->mask + 1) * 2);
+	set_concurrent_table* expected = NULL;
+	bigger->older = t;
+	if (!SET_ATOMIC_CAS(&t->next, &expected, bigger)) {
+		free(bigger);
+		return;
+	}
+	concurrent_help_move(cs, t);
+}
+
+// locks the bucket hash belongs in, helping to move buckets along when the
+// set is growing, and returns the table it was found in
+static set_concurrent_table* concurrent_find_bucket(set_concurrent* cs, set_hash_t hash,
+                                                    set_concurrent_bucket** bucket) {
+	set_concurrent_table* t = SET_ATOMIC_LOAD(&cs->table);
+
+	for (;;) {
+		set_concurrent_bucket* b = &t->buckets[hash & t->mask];
+		if (concurrent_lock(b)) {
+			*bucket = b;
+			return t;
+		}
+		concurrent_help_move(cs, t);
+		t = SET_ATOMIC_LOAD(&t->next);
+	}
+}
+
+static set_concurrent_node** concurrent_chain_find(set_concurrent_bucket* b, set_hash_t hash, const void* value,
+                                                   set_type_t type_size) {
+	set_concurrent_node** link = &b->head;
+
+	for (; *link != NULL; link = &(*link)->next) {
+		if ((*link)->hash == hash && memcmp(*link + 1, value, type_size) == 0) {
+			break;
+		}
+	}
+	return link;
+}
+
+set_concurrent* set_create_concurrent(set_type_t type_size, size_t capacity) {
+	set_concurrent* cs = (set_concurrent*)calloc(1, sizeof(set_concurrent));
+	size_t buckets = 64;
+
+	while (buckets < capacity) {
+		buckets *= 2;
+	}
+	cs->table = concurrent_table_alloc(buckets);
+	cs->type_size = type_size;
+	return cs;
+}
+
+void set_concurrent_free(set_concurrent* cs) {
+	set_concurrent_table* t = cs->table;
+
+	for (size_t i = 0; i <= t->mask; i++) {
+		for (set_concurrent_node* n = t->buckets[i].head; n != NULL;) {
+			set_concurrent_node* next = n->next;
+			free(n);
+			n = next;
+		}
+	}
+	while (t != NULL) {
+		set_concurrent_table* older = t->older;
+		free(t);
+		t = older;
+	}
+	free(cs);
+}
+
+bool set_concurrent_add(set_concurrent* cs, const void* value) {
+	set_hash_t hash = _default_hash(value, cs->type_size);
+	set_concurrent_bucket* b;
+	set_concurrent_table* t = concurrent_find_bucket(cs, hash, &b);
+
+	if (*concurrent_chain_find(b, hash, value, cs->type_size) != NULL) {
+		concurrent_unlock(b);
+		return false;
+	}
+
+	set_concurrent_node* n = (set_concurrent_node*)malloc(sizeof(set_concurrent_node) + cs->type_size);
+	n->hash = hash;
+	memcpy(n + 1, value, cs->type_size);
+	n->next = b->head;
+	b->head = n;
+	concurrent_unlock(b);
+
+	concurrent_maybe_grow(cs, t, SET_ATOMIC_ADD(&concurrent_stripe(cs, hash)->count, 1));
+	return true;
+}
+
+bool set_concurrent_remove(set_concurrent* cs, const void* value) {
+	set_hash_t hash = _default_hash(value, cs->type_size);
+	set_concurrent_bucket* b;
+	concurrent_find_bucket(cs, hash, &b);
+
+	set_concurrent_node** link = concurrent_chain_find(b, hash, value, cs->type_size);
+	set_concurrent_node* n = *link;
+	if (n != NULL) {
+		*link = n->next;
+	}
+	concurrent_unlock(b);
+
+	if (n == NULL) {
+		return false;
+	}
+	free(n);
+	SET_ATOMIC_ADD(&concurrent_stripe(cs, hash)->count, (size_t)-1);
+	return true;
+}
+
+bool set_concurrent_contains(set_concurrent* cs, const void* value) {
+	set_hash_t hash = _default_hash(value, cs->type_size);
+	set_concurrent_bucket* b;
+	concurrent_find_bucket(cs, hash, &b);
+
+	bool found = *concurrent_chain_find(b, hash, value, cs->type_size) != NULL;
+	concurrent_unlock(b);
+	return found;
+}
+
+size_t set_concurrent_size(set_concurrent* cs) {
+	size_t size = 0;
+
+	for (int i = 0; i < SET_COUNT_STRIPES; i++) {
+		size += SET_ATOMIC_LOAD(&cs->counts[i].count);
+	}
+	return size;
+}
+
+void set_concurrent_foreach(set_concurrent* cs, set_visitor fn, void* ctx) {
+	set_concurrent_table* t = SET_ATOMIC_LOAD(&cs->table);
+
+	for (size_t i = 0; i <= t->mask; i++) {
+		for (set_concurrent_node* n = t->buckets[i].head; n != NULL; n = n->next) {
+			fn(n + 1, ctx);
+		}
+	}
+}
+
+// read-mostly sets: one writer publishes whole sets, and readers look at the
+// newest one without locking it or counting themselves in. instead, each
+// reader has a slot of its own where it writes the epoch it started reading
+// in, and clears it when it's done. publishing retires the old set with the
+// epoch it was replaced in, and a retired set is freed once no reader slot
+// holds that epoch or an older one, as every reader that started later can
+// only have seen a newer set
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SET_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define SET_ATOMIC_FENCE() ((void)0)
+#endif
+
+// a reader slot sits between paddings, so that readers never write to a cache
+// line another thread uses
+struct set_rcu_reader {
+	char before[SET_CACHE_LINE];
+	size_t epoch;	// 0 while not reading
+	uint32_t used;
+	struct set_rcu_reader* next;
+	char after[SET_CACHE_LINE];
+};
+
+typedef struct set_rcu_retired {
+	set st;
+	size_t epoch;
+	struct set_rcu_retired* next;
+} set_rcu_retired;
+
+struct set_rcu {
+	set current;
+	size_t epoch;
+	set_rcu_reader* readers;
+	set_rcu_retired* retired;	// only touched by the writer
+	set_type_t type_size;
+};
+
+set_rcu* _set_create_rcu(set st, set_type_t type_size) {
+	set_rcu* rcu = (set_rcu*)calloc(1, sizeof(set_rcu));
+
+	// readers never write to the set, so it's merged now, in a block only
+	// the rcu holds
+	_set_flush(&st, type_size);
+	rcu->current = st;
+	rcu->epoch = 1;
+	rcu->type_size = type_size;
+	return rcu;
+}
+
+set_rcu_reader* set_rcu_register(set_rcu* rcu) {
+	set_rcu_reader* r;
+
+	for (r = SET_ATOMIC_LOAD(&rcu->readers); r != NULL; r = r->next) {
+		uint32_t unused = 0;
+		if (SET_ATOMIC_LOAD(&r->used) == 0 && SET_ATOMIC_CAS(&r->used, &unused, 1)) {
+			return r;
+		}
+	}
+
+	r = (set_rcu_reader*)calloc(1, sizeof(set_rcu_reader));
+	r->used = 1;
+	r->next = SET_ATOMIC_LOAD(&rcu->readers);
+	while (!SET_ATOMIC_CAS(&rcu->readers, &r->next, r)) {
+	}
+	return r;
+}
+
+void set_rcu_unregister(set_rcu_reader* r) {
+	SET_ATOMIC_STORE(&r->epoch, 0);
+	SET_ATOMIC_STORE(&r->used, 0);
+}
+
+set set_rcu_read_begin(set_rcu* rcu, set_rcu_reader* r) {
+	// the fence orders the slot's epoch before the read of the set, against
+	// the writer's fence between swapping the set and scanning the slots:
+	// either the writer sees this reader, or this reader sees the new set
+	SET_ATOMIC_STORE(&r->epoch, SET_ATOMIC_LOAD(&rcu->epoch));
+	SET_ATOMIC_FENCE();
+	return SET_ATOMIC_LOAD(&rcu->current);
+}
+
+void set_rcu_read_end(set_rcu_reader* r) {
+	SET_ATOMIC_STORE(&r->epoch, 0);
+}
+
+bool set_rcu_reclaim(set_rcu* rcu) {
+	size_t oldest = (size_t)-1;
+
+	SET_ATOMIC_FENCE();
+	for (set_rcu_reader* r = SET_ATOMIC_LOAD(&rcu->readers); r != NULL; r = r->next) {
+		size_t epoch = SET_ATOMIC_LOAD(&r->epoch);
+		if (epoch != 0 && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	set_rcu_retired** link = &rcu->retired;
+	while (*link != NULL) {
+		set_rcu_retired* old = *link;
+		if (old->epoch < oldest) {
+			*link = old->next;
+			set_free(old->st);
+			free(old);
+		} else {
+			link = &old->next;
+		}
+	}
+	return rcu->retired == NULL;
+}
+
+void set_rcu_publish(set_rcu* rcu, set st) {
+	set_rcu_retired* old = (set_rcu_retired*)malloc(sizeof(set_rcu_retired));
+
+	_set_flush(&st, rcu->type_size);
+	old->st = rcu->current;
+	old->epoch = rcu->epoch;
+	old->next = rcu->retired;
+	rcu->retired = old;
+	SET_ATOMIC_STORE(&rcu->current, st);
+	SET_ATOMIC_STORE(&rcu->epoch, rcu->epoch + 1);
+	set_rcu_reclaim(rcu);
+}
+
+void set_rcu_free(set_rcu* rcu) {
+	while (rcu->retired != NULL) {
+		set_rcu_retired* old = rcu->retired;
+		rcu->retired = old->next;
+		set_free(old->st);
+		free(old);
+	}
+	for (set_rcu_reader* r = rcu->readers; r != NULL;) {
+		set_rcu_reader* next = r->next;
+		free(r);
+		r = next;
+	}
+	set_free(rcu->current);
+	free(rcu);
+}
+
+// sharded sets: 2^bits ordinary sets, each behind a spinlock of its own, with
+// the top bits of an element's hash picking its shard. the sets index their
+// elements by the low bits, or by the whole hash in order, so every shard
+// stays as well spread as a single set would be. two sharded sets with the
+// same number of shards put an element in the same shard, which lets bulk
+// operations work on one pair of shards at a time
+
+#define SET_SHARD_MAX_BITS 16
+
+typedef struct {
+	set st;
+	uint32_t lock;
+	char pad[SET_CACHE_LINE - sizeof(set) - sizeof(uint32_t)];
+} set_shard;
+
+struct set_sharded {
+	unsigned bits;
+	set_type_t type_size;
+	set_shard* shards;
+};
+
+static set_shard* sharded_pick(set_sharded* sh, const void* value) {
+	if (sh->bits == 0) {
+		return sh->shards;
+	}
+	return &sh->shards[_default_hash(value, sh->type_size) >> (sizeof(set_hash_t) * 8 - sh->bits)];
+}
+
+set_sharded* set_create_sharded(set_type_t type_size, unsigned bits, set_engine engine) {
+	set_sharded* sh = (set_sharded*)malloc(sizeof(set_sharded));
+
+	if (bits > SET_SHARD_MAX_BITS) {
+		bits = SET_SHARD_MAX_BITS;
+	}
+	sh->bits = bits;
+	sh->type_size = type_size;
+	sh->shards = (set_shard*)calloc((size_t)1 << bits, sizeof(set_shard));
+	for (size_t i = 0; i < (size_t)1 << bits; i++) {
+		sh->shards[i].st = set_create_engine(engine);
+	}
+	return sh;
+}
+
+void set_sharded_free(set_sharded* sh) {
+	for (size_t i = 0; i < (size_t)1 << sh->bits; i++) {
+		set_free(sh->shards[i].st);
+	}
+	free(sh->shards);
+	free(sh);
+}
+
+bool set_sharded_add(set_sharded* sh, const void* value) {
+	set_shard* shard = sharded_pick(sh, value);
+
+	set_spin_lock(&shard->lock);
+	pack answer = _set_contains(&shard->st, value, sh->type_size);
+	if (!answer.code) {
+		memcpy(_set_insert_dst(&shard->st, sh->type_size, answer.index), value, sh->type_size);
+		_hash_add(&shard->st, value, sh->type_size, answer.index);
+	}
+	set_spin_unlock(&shard->lock);
+	return !answer.code;
+}
+
+bool set_sharded_remove(set_sharded* sh, const void* value) {
+	set_shard* shard = sharded_pick(sh, value);
+
+	set_spin_lock(&shard->lock);
+	bool removed = _set_discard(&shard->st, value, sh->type_size);
+	set_spin_unlock(&shard->lock);
+	return removed;
+}
+
+bool set_sharded_contains(set_sharded* sh, const void* value) {
+	set_shard* shard = sharded_pick(sh, value);
+
+	set_spin_lock(&shard->lock);
+	bool found = _set_contains(&shard->st, value, sh->type_size).code;
+	set_spin_unlock(&shard->lock);
+	return found;
+}
+
+size_t set_sharded_size(set_sharded* sh) {
+	size_t size = 0;
+
+	for (size_t i = 0; i < (size_t)1 << sh->bits; i++) {
+		set_spin_lock(&sh->shards[i].lock);
+		size += set_size(sh->shards[i].st);
+		set_spin_unlock(&sh->shards[i].lock);
+	}
+	return size;
+}
+
+void set_sharded_foreach(set_sharded* sh, set_visitor fn, void* ctx) {
+	for (size_t i = 0; i < (size_t)1 << sh->bits; i++) {
+		set_shard* shard = &sh->shards[i];
+		set_spin_lock(&shard->lock);
+		set_size_t size = set_size(shard->st);
+		for (set_size_t j = 0; j < size; j++) {
+			fn((unsigned char*)shard->st + j * sh->type_size, ctx);
+		}
+		set_spin_unlock(&shard->lock);
+	}
+}
+
+void set_sharded_union_update(set_sharded* sh, set_sharded* other) {
+	if (sh->bits != other->bits) {
+		// only one lock is held at a time: each of other's shards is copied
+		// under its lock, which only takes a reference, and added from the copy
+		for (size_t i = 0; i < (size_t)1 << other->bits; i++) {
+			set_spin_lock(&other->shards[i].lock);
+			set copy = _set_copy(other->shards[i].st, other->type_size);
+			set_spin_unlock(&other->shards[i].lock);
+
+			set_size_t size = set_size(copy);
+			for (set_size_t j = 0; j < size; j++) {
+				set_sharded_add(sh, (unsigned char*)copy + j * sh->type_size);
+			}
+			set_free(copy);
+		}
+		return;
+	}
+	// both shards of a pair are locked in the same order, so two threads
+	// merging a and b into each other can't hold one each
+	for (size_t i = 0; i < (size_t)1 << sh->bits; i++) {
+		set_shard* first = sh < other ? &sh->shards[i] : &other->shards[i];
+		set_shard* second = sh < other ? &other->shards[i] : &sh->shards[i];
+		set_spin_lock(&first->lock);
+		if (sh != other) {
+			set_spin_lock(&second->lock);
+			_set_union_update(&sh->shards[i].st, other->shards[i].st, sh->type_size);
+			set_spin_unlock(&second->lock);
+		}
+		set_spin_unlock(&first->lock);
+	}
+}
+
+set set_sharded_to_set(set_sharded* sh, set_engine engine) {
+	set st = set_create_engine(engine);
+
+	for (size_t i = 0; i < (size_t)1 << sh->bits; i++) {
+		set_spin_lock(&sh->shards[i].lock);
+		_set_union_update(&st, sh->shards[i].st, sh->type_size);
+		set_spin_unlock(&sh->shards[i].lock);
+	}
+	return st;
 }
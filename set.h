@@ -38,6 +38,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define typeof(T) std::remove_reference<std::add_lvalue_reference<decltype(T)>::type>::type
 #endif
 
+// a pointer to value converted to type, valid until the end of the full
+// expression. C++ has no compound literals, but a temporary bound to a const
+// reference lives just as long
+#ifdef __cplusplus
+template <typename T>
+static inline const T* _set_value_ptr(const T& value) { return &value; }
+#define SET_VALUE_PTR(type, value) (_set_value_ptr<type>(value))
+#else
+#define SET_VALUE_PTR(type, value) ((type[1]){value})
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -65,6 +76,64 @@ typedef struct {
 } pack;
 #endif
 
+// how a set indexes its elements, chosen when the set is created
+typedef enum {
+	SET_ENGINE_SORTED,	// sorted hash array, binary searched (the default)
+	SET_ENGINE_SWISS,	// open-addressing table probed 16 control bytes at a time
+	SET_ENGINE_ADAPTIVE,	// switches between a swiss table and a bitmap as the set changes
+	SET_ENGINE_PMA,		// hashes kept sorted in a gapped array, cheap to insert into
+} set_engine;
+
+// called with each element of a set and the ctx passed along with it
+typedef bool (*set_predicate)(const void* element, void* ctx);
+
+// allocator hooks. the size of a block is passed back when it is resized or
+// freed, so allocators don't have to keep track of it
+typedef struct {
+	void* (*alloc_fn)(void* ctx, size_t size);
+	void* (*realloc_fn)(void* ctx, void* p, size_t old_size, size_t new_size);
+	void (*free_fn)(void* ctx, void* p, size_t size);
+	void* ctx;
+} set_allocator;
+
+// how a set's capacity changes. when a set is full its capacity is multiplied
+// by factor, but grows by at least one element and at most max_step (0 means
+// no limit), and never to less than min_capacity. sets that take the address
+// of the set when removing elements shrink to fit once their size falls below
+// shrink_below times their capacity (0 turns this off)
+typedef struct {
+	double factor;
+	set_size_t min_capacity;
+	set_size_t max_step;
+	double shrink_below;
+} set_growth;
+
+// bump arena that releases everything it handed out at once
+typedef struct set_arena_chunk set_arena_chunk;
+typedef struct {
+	set_allocator allocator;	// pass &arena.allocator to a set
+	set_arena_chunk* chunks;
+	size_t chunk_size;
+	void* last;
+} set_arena;
+
+// size-class pool that recycles freed blocks of the same size
+#define SET_POOL_CLASSES 12
+typedef struct {
+	set_allocator allocator;	// pass &pool.allocator to a set
+	void* free_lists[SET_POOL_CLASSES];
+	void* slabs;
+} set_pool;
+
+// allocator for very large sets: blocks of at least threshold bytes are
+// anonymous mappings that grow and shrink with mremap instead of being copied,
+// optionally advised to use transparent huge pages. smaller blocks use malloc
+typedef struct {
+	set_allocator allocator;	// pass &mapped.allocator to a set
+	size_t threshold;
+	bool huge_pages;
+} set_mmap;
+
 // TODO: more rigorous check for typeof support with different compilers
 #if _MSC_VER == 0 || __STDC_VERSION__ >= 202311L || defined __cpp_decltype
 
@@ -80,12 +149,27 @@ typedef struct {
 	    _set_insert_dst((set*)set_addr, sizeof(**set_addr), pos)))
 
 #define set_add(set_addr, value) { \
-        pack answer = set_contains((set*)set_addr, (unsigned char)value); \
+        typeof(**set_addr) _set_value = (value); \
+        pack answer = _set_contains((set*)set_addr, &_set_value, sizeof(_set_value)); \
         if (!answer.code) { \
-	    (*set_insert_dst(set_addr, answer.index) = value); \
-	    (_hash_add((set*)set_addr, value, answer.index)); \
+	    (*set_insert_dst(set_addr, answer.index) = _set_value); \
+	    (_hash_add((set*)set_addr, &_set_value, sizeof(_set_value), answer.index)); \
 	} \
 }
+#define set_contains(set_addr, value)\
+	(_set_contains((set*)set_addr, SET_VALUE_PTR(typeof(**set_addr), value), sizeof(**set_addr)))
+
+// src must point to elements of the set's type
+#define set_add_many(set_addr, src, n)\
+	(_set_add_many((set*)set_addr, sizeof(**set_addr),\
+	    (1 ? (src) : (const typeof(**set_addr)*)0), n))
+
+// set_discard returns whether value was removed, set_discard_many how many
+// of the values were
+#define set_discard(set_addr, value)\
+	(_set_discard((set*)set_addr, SET_VALUE_PTR(typeof(**set_addr), value), sizeof(**set_addr)))
+#define set_discard_many(set_addr, values, n)\
+	(_set_discard_many((set*)set_addr, (1 ? (values) : (const typeof(**set_addr)*)0), n, sizeof(**set_addr)))
 /*#define set_insert(set_addr, pos, value)\
         if (!set_contains((set*)set_addr, (unsigned char)value)) { \
 	    (*set_insert_dst(set_addr, pos) = value); \
@@ -99,12 +183,23 @@ typedef struct {
 	((type*)_set_insert_dst((set*)set_addr, sizeof(type), pos))
 
 #define set_add(set_addr, type, value) { \
-            pack answer = set_contains((set*)set_addr, (unsigned char)value); \
+            type _set_value = (value); \
+            pack answer = _set_contains((set*)set_addr, &_set_value, sizeof(type)); \
             if (!answer.code) { \
-	        (*set_insert_dst(set_addr, type, answer.index) = value); \
-	        (_hash_add((set*)set_addr, value, answer.index)); \
+	        (*set_insert_dst(set_addr, type, answer.index) = _set_value); \
+	        (_hash_add((set*)set_addr, &_set_value, sizeof(type), answer.index)); \
 	    } \
 }
+#define set_contains(set_addr, type, value)\
+	(_set_contains((set*)set_addr, SET_VALUE_PTR(type, value), sizeof(type)))
+
+#define set_add_many(set_addr, type, src, n)\
+	(_set_add_many((set*)set_addr, sizeof(type), (const type*)(src), n))
+
+#define set_discard(set_addr, type, value)\
+	(_set_discard((set*)set_addr, SET_VALUE_PTR(type, value), sizeof(type)))
+#define set_discard_many(set_addr, type, values, n)\
+	(_set_discard_many((set*)set_addr, (const type*)(values), n, sizeof(type)))
 /*#define set_insert(set_addr, type, pos, value)\
         if (!set_contains((set*)set_addr, (unsigned char)value)) { \
 	    (*set_insert_dst(set_addr, type, pos) = value); \
@@ -112,43 +207,388 @@ typedef struct {
 
 #endif
 
-// st is a set (aka type*)
+// st is a set (aka type*). these never need more room, but a set that still
+// shares its block with a copy gets a block of its own first, so they take
+// the address of st themselves
 #define set_erase(st, pos, len)\
-	(_set_erase((set)st, sizeof(*st), pos, len))
+	(_set_erase((set*)&(st), sizeof(*st), pos, len))
 #define set_remove(st, pos)\
-	(_set_remove((set)st, sizeof(*st), pos))
+	(_set_remove((set*)&(st), sizeof(*st), pos))
+#define set_pop(st)\
+	(_set_pop((set*)&(st), sizeof(*st)))
+
+// remove the elements pred returns true (or, for set_retain_if, false) for in
+// one pass that keeps the rest in order. return how many were removed
+#define set_remove_if(st, pred, ctx)\
+	(_set_remove_if((set*)&(st), sizeof(*st), pred, ctx, false))
+#define set_retain_if(st, pred, ctx)\
+	(_set_remove_if((set*)&(st), sizeof(*st), pred, ctx, true))
+// the same for elements in (or outside) [lo, hi], for sets of signed
+// integers. other element types are left alone
+#define set_remove_range(st, lo, hi)\
+	(_set_remove_range((set*)&(st), sizeof(*st), lo, hi, false))
+#define set_retain_range(st, lo, hi)\
+	(_set_remove_range((set*)&(st), sizeof(*st), lo, hi, true))
 
 #define set_reserve(set_addr, capacity)\
 	(_set_reserve((set*)set_addr, sizeof(**set_addr), capacity))
+// gives back the capacity (and swiss or pma table space) the set doesn't use
+#define set_shrink_to_fit(set_addr)\
+	(_set_shrink_to_fit((set*)set_addr, sizeof(**set_addr)))
 
+// O(1): the copy shares the set's block until either of them is changed
 #define set_copy(st)\
 	(_set_copy((set)st, sizeof(*st)))
 
+// looks up n keys at once. bitmap gets bit i set if keys[i] is in the set
+// and needs room for (n + 63) / 64 words; returns the number of hits
+#define set_contains_many(st, keys, n, bitmap)\
+	(_set_contains_many((set)st, sizeof(*st), (1 ? (keys) : (st)), n, bitmap, NULL))
+// like set_contains_many, but writes the positions in keys of the hits to hits
+#define set_contains_many_indices(st, keys, n, hits)\
+	(_set_contains_many((set)st, sizeof(*st), (1 ? (keys) : (st)), n, NULL, hits))
+
+// lays out the hashes of a sorted set for faster lookups. the layout is
+// dropped as soon as the set changes, so this is meant for sets that are
+// built once and then only searched. other engines are left as they are
+#define set_freeze(st)\
+	(_set_freeze((set*)&(st), sizeof(*st)))
+
+// keeps a directory of the hashes of a sorted set by their top bits, which
+// takes about 2 bytes per element and cuts most lookups to a probe or two.
+// other engines ignore this
+#define set_use_directory(st, enabled)\
+	(_set_use_directory((set*)&(st), sizeof(*st), enabled))
+
+// lets a sorted set append new elements unsorted and merge them in batches,
+// when enough of them have piled up or on set_flush. other engines ignore this
+#define set_use_buffer(st, enabled)\
+	(_set_use_buffer((set*)&(st), sizeof(*st), enabled))
+#define set_flush(st)\
+	(_set_flush((set*)&(st), sizeof(*st)))
+
+// writes the set to path as an image that set_open_mmap can map straight
+// back in, with its elements in hash order. returns false if writing failed
+#define set_save(st, path)\
+	(_set_save((set)st, sizeof(*st), path))
+// maps a file written by set_save as a sorted set of type, without reading
+// or copying its elements. returns NULL if the file can't be mapped, wasn't
+// written by a build with the same layout or holds elements of another size.
+// the set can be changed like any other, it's copied to the heap once it has
+// to grow, and the file itself is never written to. only the file's header
+// is checked: damaged elements or hashes aren't noticed and give wrong
+// answers. use set_verify_file first for files that may be damaged
+#define set_open_mmap(path, type)\
+	((type*)_set_open_mmap(path, sizeof(type)))
+
+// set algebra, a and b must hold the same type
+#define set_union(a, b)\
+	(_set_union((set)a, (set)b, sizeof(*a)))
+#define set_intersection(a, b)\
+	(_set_intersection((set)a, (set)b, sizeof(*a)))
+#define set_difference(a, b)\
+	(_set_difference((set)a, (set)b, sizeof(*a)))
+#define set_symmetric_difference(a, b)\
+	(_set_symmetric_difference((set)a, (set)b, sizeof(*a)))
+
+#define set_union_update(set_addr, other)\
+	(_set_union_update((set*)set_addr, (set)other, sizeof(**set_addr)))
+#define set_intersection_update(set_addr, other)\
+	(_set_intersection_update((set*)set_addr, (set)other, sizeof(**set_addr)))
+#define set_difference_update(set_addr, other)\
+	(_set_difference_update((set*)set_addr, (set)other, sizeof(**set_addr)))
+#define set_symmetric_difference_update(set_addr, other)\
+	(_set_symmetric_difference_update((set*)set_addr, (set)other, sizeof(**set_addr)))
+
 set set_create(void);
 
+set set_create_engine(set_engine engine);
+
+// the allocator has to outlive the set, NULL means malloc
+set set_create_with_allocator(const set_allocator* allocator);
+
+set set_create_engine_with_allocator(set_engine engine, const set_allocator* allocator);
+
+void set_arena_init(set_arena* arena, size_t chunk_size);
+
+// frees all but the newest chunk and starts handing it out again
+void set_arena_reset(set_arena* arena);
+
+void set_arena_release(set_arena* arena);
+
+void set_pool_init(set_pool* pool);
+
+void set_pool_release(set_pool* pool);
+
+// a threshold of 0 picks 1 MiB. without mremap (anywhere but Linux) every
+// block comes from malloc
+void set_mmap_init(set_mmap* m, size_t threshold, bool huge_pages);
+
 void set_free(set st);
 
 void* _set_add_dst(set* set_addr, set_type_t type_size);
 
 void* _set_insert_dst(set* set_addr, set_type_t type_size, set_size_t pos);
 
-void _set_erase(set set_addr, set_type_t type_size, set_size_t pos, set_size_t len);
+void _set_add_many(set* set_addr, set_type_t type_size, const void* src, set_size_t n);
+
+void _set_erase(set* set_addr, set_type_t type_size, set_size_t pos, set_size_t len);
+
+void _set_remove(set* set_addr, set_type_t type_size, set_size_t pos);
+
+void _hash_add(set* set_addr, const void* value, set_type_t type_size, set_size_t pos);
+
+void _set_pop(set* set_addr, set_type_t type_size);
+
+bool _set_discard(set* set_addr, const void* value, set_type_t type_size);
 
-void _set_remove(set set_addr, set_type_t type_size, set_size_t pos);
+set_size_t _set_discard_many(set* set_addr, const void* values, set_size_t n, set_type_t type_size);
 
-void _hash_add(set* set_addr, unsigned char value, set_size_t pos);
+set_size_t _set_remove_if(set* set_addr, set_type_t type_size, set_predicate pred, void* ctx, bool keep);
 
-void set_pop(set st);
+set_size_t _set_remove_range(set* set_addr, set_type_t type_size, int64_t lo, int64_t hi, bool keep);
 
 void _set_reserve(set* set_addr, set_type_t type_size, set_size_t capacity);
 
+void _set_shrink_to_fit(set* set_addr, set_type_t type_size);
+
+// the policy has to outlive the set, NULL restores the default (doubling from
+// 8 elements, no auto-shrink). sets made by set algebra inherit it from a
+void set_use_growth(set st, const set_growth* growth);
+
+bool _set_save(set st, set_type_t type_size, const char* path);
+
+set _set_open_mmap(const char* path, set_type_t type_size);
+
+// reads a whole set file and checks it against its checksum. set_open_mmap
+// only checks the header, so that opening a file stays cheap
+bool set_verify_file(const char* path);
+
 set _set_copy(set st, set_type_t type_size);
 
+set_size_t _set_contains_many(set st, set_type_t type_size, const void* keys, set_size_t n, uint64_t* bitmap, set_size_t* hits);
+
+set _set_union(set a, set b, set_type_t type_size);
+
+set _set_intersection(set a, set b, set_type_t type_size);
+
+set _set_difference(set a, set b, set_type_t type_size);
+
+set _set_symmetric_difference(set a, set b, set_type_t type_size);
+
+void _set_union_update(set* set_addr, set other, set_type_t type_size);
+
+void _set_intersection_update(set* set_addr, set other, set_type_t type_size);
+
+void _set_difference_update(set* set_addr, set other, set_type_t type_size);
+
+void _set_symmetric_difference_update(set* set_addr, set other, set_type_t type_size);
+
+void _set_freeze(set* set_addr, set_type_t type_size);
+
+void _set_use_directory(set* set_addr, set_type_t type_size, bool enabled);
+
+void _set_use_buffer(set* set_addr, set_type_t type_size, bool enabled);
+
+void _set_flush(set* set_addr, set_type_t type_size);
+
 set_size_t set_size(set st);
 
 set_size_t set_capacity(set st);
 
-pack set_contains(set* set_addr, unsigned char value);
+pack _set_contains(set* set_addr, const void* value, set_type_t type_size);
+
+// bitmap sets hold integers in [0, universe) as one bit each. like other
+// sets they point past their header, here to their 64 bit words
+typedef uint64_t* set_bitmap;
+
+set_bitmap set_create_bitmap(size_t universe);
+
+void set_bitmap_free(set_bitmap bm);
+
+set_bitmap set_bitmap_copy(set_bitmap bm);
+
+size_t set_bitmap_universe(set_bitmap bm);
+
+// returns false, without adding anything, if key is outside the universe
+bool set_bitmap_add(set_bitmap bm, size_t key);
+
+bool set_bitmap_contains(set_bitmap bm, size_t key);
+
+void set_bitmap_remove(set_bitmap bm, size_t key);
+
+size_t set_bitmap_size(set_bitmap bm);
+
+// a union covers both universes, intersections and differences keep a's
+set_bitmap set_bitmap_union(set_bitmap a, set_bitmap b);
+
+set_bitmap set_bitmap_intersection(set_bitmap a, set_bitmap b);
+
+set_bitmap set_bitmap_difference(set_bitmap a, set_bitmap b);
+
+// the union may have to grow the bitmap, so these take its address
+void set_bitmap_union_update(set_bitmap* bm_addr, set_bitmap other);
+
+void set_bitmap_intersection_update(set_bitmap* bm_addr, set_bitmap other);
+
+void set_bitmap_difference_update(set_bitmap* bm_addr, set_bitmap other);
+
+// compressed set of 32 bit integers (roaring bitmap). keys are grouped by
+// their high 16 bits into sorted arrays, bitmaps or runs, whichever is smaller
+typedef struct set_roaring set_roaring;
+
+set_roaring* set_create_roaring(void);
+
+void set_roaring_free(set_roaring* r);
+
+// both return whether the set changed
+bool set_roaring_add(set_roaring* r, uint32_t key);
+
+bool set_roaring_remove(set_roaring* r, uint32_t key);
+
+bool set_roaring_contains(const set_roaring* r, uint32_t key);
+
+size_t set_roaring_size(const set_roaring* r);
+
+// bytes allocated for the set
+size_t set_roaring_memory(const set_roaring* r);
+
+// run-length encodes the containers where that saves space
+void set_roaring_optimize(set_roaring* r);
+
+set_roaring* set_roaring_union(const set_roaring* a, const set_roaring* b);
+
+set_roaring* set_roaring_intersection(const set_roaring* a, const set_roaring* b);
+
+// persistent set (hash array mapped trie). every version is immutable: adding
+// or removing an element makes a new version that shares all but the
+// O(log32 n) nodes on the element's path with the old one. versions hold
+// elements of the size they were created with, and each one is freed on its
+// own, the nodes they share live on as long as any version uses them
+typedef struct set_hamt set_hamt;
+
+// called with each element visited
+typedef void (*set_visitor)(const void* element, void* ctx);
+
+// called with each element that is in only one of two versions, in_a tells
+// which one
+typedef void (*set_diff_visitor)(const void* element, bool in_a, void* ctx);
+
+set_hamt* set_create_hamt(set_type_t type_size);
+
+void set_hamt_free(set_hamt* v);
+
+// both return a new version, even if value was already there (or wasn't)
+set_hamt* set_hamt_add(const set_hamt* v, const void* value);
+
+set_hamt* set_hamt_remove(const set_hamt* v, const void* value);
+
+bool set_hamt_contains(const set_hamt* v, const void* value);
+
+size_t set_hamt_size(const set_hamt* v);
+
+void set_hamt_foreach(const set_hamt* v, set_visitor fn, void* ctx);
+
+// reports the elements that differ between a and b without visiting the
+// parts the two versions share, so diffing versions a few changes apart is
+// cheap however big they are
+void set_hamt_diff(const set_hamt* a, const set_hamt* b, set_diff_visitor fn, void* ctx);
+
+// concurrent set: many threads can add, remove and look for elements at once,
+// each operation locking only the bucket of the element it's given. it grows
+// by itself, with the threads using it sharing the work of moving the
+// elements over. capacity is a hint for the elements it will hold
+typedef struct set_concurrent set_concurrent;
+
+set_concurrent* set_create_concurrent(set_type_t type_size, size_t capacity);
+
+// only once no other thread uses the set
+void set_concurrent_free(set_concurrent* cs);
+
+// returns true if value was added, and false if it was already there
+bool set_concurrent_add(set_concurrent* cs, const void* value);
+
+// returns true if value was there
+bool set_concurrent_remove(set_concurrent* cs, const void* value);
+
+bool set_concurrent_contains(set_concurrent* cs, const void* value);
+
+// exact while no other thread changes the set
+size_t set_concurrent_size(set_concurrent* cs);
+
+// only while no other thread changes the set
+void set_concurrent_foreach(set_concurrent* cs, set_visitor fn, void* ctx);
+
+// read-mostly set: a writer publishes whole sets, one after another, and any
+// number of readers look things up in the newest one. starting and ending a
+// read take a few instructions and never wait, and the sets readers are done
+// with are freed as the writer publishes. only one thread may publish
+typedef struct set_rcu set_rcu;
+
+// each reading thread registers once and passes its handle to every read
+typedef struct set_rcu_reader set_rcu_reader;
+
+// takes over st, which becomes the first published set
+#define set_create_rcu(st)\
+	(_set_create_rcu((set)st, sizeof(*st)))
+
+set_rcu* _set_create_rcu(set st, set_type_t type_size);
+
+// frees every set the rcu holds, once no thread reads it anymore
+void set_rcu_free(set_rcu* rcu);
+
+set_rcu_reader* set_rcu_register(set_rcu* rcu);
+
+void set_rcu_unregister(set_rcu_reader* r);
+
+// returns the newest set, which stays valid until set_rcu_read_end. it must
+// only be read: set_contains and the like are fine, anything that changes it
+// isn't
+set set_rcu_read_begin(set_rcu* rcu, set_rcu_reader* r);
+
+void set_rcu_read_end(set_rcu_reader* r);
+
+// takes over st, a set of the same type, and makes it the one new reads see.
+// the sets no reader can still be looking at are freed
+void set_rcu_publish(set_rcu* rcu, set st);
+
+// frees the replaced sets no reader is looking at anymore, and returns true
+// if that was all of them
+bool set_rcu_reclaim(set_rcu* rcu);
+
+// sharded set: 2^bits (up to 2^16) ordinary sets of the given engine, each
+// with a lock of its own, and the top bits of an element's hash choosing
+// which one holds it. threads working on different shards don't wait for
+// each other. every function may be called from any thread
+typedef struct set_sharded set_sharded;
+
+set_sharded* set_create_sharded(set_type_t type_size, unsigned bits, set_engine engine);
+
+// only once no other thread uses the set
+void set_sharded_free(set_sharded* sh);
+
+// returns true if value was added, and false if it was already there
+bool set_sharded_add(set_sharded* sh, const void* value);
+
+// returns true if value was there
+bool set_sharded_remove(set_sharded* sh, const void* value);
+
+bool set_sharded_contains(set_sharded* sh, const void* value);
+
+// the shards are counted one after another, so the total is only a snapshot
+// of each shard while other threads change the set
+size_t set_sharded_size(set_sharded* sh);
+
+// visits the shards one after another, locking each while it's visited. fn
+// must not change the set
+void set_sharded_foreach(set_sharded* sh, set_visitor fn, void* ctx);
+
+// adds the elements of other to sh, shard by shard when both have as many
+// shards
+void set_sharded_union_update(set_sharded* sh, set_sharded* other);
+
+// an ordinary set with every element of sh
+set set_sharded_to_set(set_sharded* sh, set_engine engine);
 
 // closing bracket for extern "C"
 #ifdef __cplusplus
@@ -1,14 +1,1849 @@
 #include <stdio.h>
 #include "set.h"
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define TEST_THREADED
+#endif
+
+// build with e.g. `cc -pthread test.c set.c -o test` and run `./test`. it
+// prints every failed check and exits with 1 if there were any
+
+static int failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		++failures; \
+	} \
+} while (0)
+
+// checks an int set against model, where model[v] tells whether v in
+// [0, range) should be in it: same size, every value found or not as it
+// should be, and every element found at its own position
+static void check_ints(int** st_addr, const bool* model, int range) {
+	set_size_t expected = 0;
+
+	for (int v = 0; v < range; v++) {
+		pack answer = set_contains(st_addr, v);
+		CHECK(answer.code == model[v]);
+		if (answer.code) {
+			CHECK((*st_addr)[answer.index] == v);
+		}
+		expected += model[v];
+	}
+	CHECK(set_size(*st_addr) == expected);
+	for (set_size_t i = 0; i < set_size(*st_addr); i++) {
+		pack answer = set_contains(st_addr, (*st_addr)[i]);
+		CHECK(answer.code && answer.index == i);
+	}
+}
+
+static void test_basics(void) {
+	int* st = set_create();
+	set_add(&st, 5);
+	set_add(&st, 5);
+	set_add(&st, 6);
+	set_add(&st, 256);
+
+	CHECK(set_size(st) == 3);
+	CHECK(set_contains(&st, 5).code);
+	CHECK(set_contains(&st, 256).code);
+	CHECK(!set_contains(&st, 0).code);
+	set_free(st);
+}
+
+static void test_swiss(void) {
+	static bool model[3000];
+	int* st = set_create_engine(SET_ENGINE_SWISS);
+
+	memset(model, 0, sizeof(model));
+	check_ints(&st, model, 3000);
+	for (int v = 0; v < 2000; v++) {
+		set_add(&st, v);
+		set_add(&st, v);
+		model[v] = true;
+	}
+	check_ints(&st, model, 3000);
+
+	// erasing keeps the order of the rest, and leaves tombstones in the table
+	for (int k = 0; k < 500; k++) {
+		set_size_t pos = (set_size_t)(k * 7919) % set_size(st);
+		set_size_t len = k % 3 == 0 && pos + 3 <= set_size(st) ? 3 : 1;
+		for (set_size_t i = pos; i < pos + len; i++) {
+			model[st[i]] = false;
+		}
+		int after = pos + len < set_size(st) ? st[pos + len] : -1;
+		if (len == 1 && k % 2 == 0) {
+			set_remove(st, pos);
+		} else {
+			set_erase(st, pos, len);
+		}
+		if (after >= 0) {
+			CHECK(st[pos] == after);
+		}
+	}
+	model[st[set_size(st) - 1]] = false;
+	set_pop(st);
+	check_ints(&st, model, 3000);
+
+	// adding again reuses the tombstones and eventually rebuilds the table
+	for (int v = 0; v < 3000; v++) {
+		set_add(&st, v);
+		model[v] = true;
+	}
+	check_ints(&st, model, 3000);
+	set_erase(st, 0, set_size(st));
+	memset(model, 0, sizeof(model));
+	check_ints(&st, model, 3000);
+	set_free(st);
+}
+
+typedef struct {
+	unsigned char bytes[12];
+} key12;
+
+static void test_full_width(void) {
+	// values that only differ in their top bytes are still different
+	uint64_t* wide = set_create();
+	for (uint64_t i = 0; i < 256; i++) {
+		set_add(&wide, i << 56);
+		set_add(&wide, i << 56 | 1);
+	}
+	CHECK(set_size(wide) == 512);
+	for (uint64_t i = 0; i < 256; i++) {
+		CHECK(set_contains(&wide, i << 56).code);
+		CHECK(set_contains(&wide, i << 56 | 1).code);
+		CHECK(!set_contains(&wide, i << 48 | 2).code);
+	}
+	set_free(wide);
+
+	uint8_t* bytes = set_create();
+	for (int i = 0; i < 256; i++) {
+		set_add(&bytes, (uint8_t)i);
+	}
+	CHECK(set_size(bytes) == 256);
+	set_free(bytes);
+
+	// elements of sizes without a dedicated hash are compared whole, too
+	key12* keys = set_create();
+	key12 k;
+	memset(&k, 0, sizeof(k));
+	for (int i = 0; i < 100; i++) {
+		k.bytes[11] = (unsigned char)i;
+		set_add(&keys, k);
+	}
+	CHECK(set_size(keys) == 100);
+	k.bytes[11] = 50;
+	CHECK(set_contains(&keys, k).code);
+	k.bytes[0] = 1;
+	CHECK(!set_contains(&keys, k).code);
+	set_free(keys);
+}
+
+static void test_add_many(void) {
+	static bool model[4000];
+	static int values[6000];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+
+	for (int e = 0; e < 4; e++) {
+		int* st = set_create_engine(engines[e]);
+		memset(model, 0, sizeof(model));
+
+		set_add_many(&st, values, 0);
+		check_ints(&st, model, 4000);
+
+		// a batch with duplicates inside it and of elements already there
+		set_add(&st, 7);
+		model[7] = true;
+		for (int i = 0; i < 6000; i++) {
+			values[i] = (i * 37) % 3000;
+			model[values[i]] = true;
+		}
+		set_add_many(&st, values, 6000);
+		check_ints(&st, model, 4000);
+
+		// small batches into the same set
+		for (int i = 0; i < 1000; i += 10) {
+			for (int j = 0; j < 10; j++) {
+				values[j] = 3000 + i + j;
+				model[3000 + i + j] = true;
+			}
+			set_add_many(&st, values, 10);
+		}
+		check_ints(&st, model, 4000);
+		set_free(st);
+	}
+}
+
+// a holds the multiples of 2 below 600 and b those of 3, on the given engines
+static void make_pair(int** a, int** b, set_engine ea, set_engine eb) {
+	*a = set_create_engine(ea);
+	*b = set_create_engine(eb);
+	for (int v = 0; v < 600; v++) {
+		if (v % 2 == 0) {
+			set_add(a, v);
+		}
+		if (v % 3 == 0) {
+			set_add(b, v);
+		}
+	}
+}
+
+static void test_algebra(void) {
+	static bool model[600];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS};
+
+	// sorted with sorted merges, the other pairs look elements up
+	for (int e = 0; e < 4; e++) {
+		set_engine ea = engines[e / 2], eb = engines[e % 2];
+		int *a, *b;
+		make_pair(&a, &b, ea, eb);
+
+		int* out[4] = {set_union(a, b), set_intersection(a, b), set_difference(a, b),
+		               set_symmetric_difference(a, b)};
+		for (int op = 0; op < 4; op++) {
+			for (int v = 0; v < 600; v++) {
+				bool in_a = v % 2 == 0, in_b = v % 3 == 0;
+				model[v] = op == 0 ? in_a || in_b : op == 1 ? in_a && in_b : op == 2 ? in_a && !in_b : in_a != in_b;
+			}
+			check_ints(&out[op], model, 600);
+
+			int* updated = set_copy(a);
+			if (op == 0) {
+				set_union_update(&updated, b);
+			} else if (op == 1) {
+				set_intersection_update(&updated, b);
+			} else if (op == 2) {
+				set_difference_update(&updated, b);
+			} else {
+				set_symmetric_difference_update(&updated, b);
+			}
+			check_ints(&updated, model, 600);
+			set_free(updated);
+			set_free(out[op]);
+		}
+
+		// the inputs are left as they were
+		for (int v = 0; v < 600; v++) {
+			model[v] = v % 2 == 0;
+		}
+		check_ints(&a, model, 600);
+		set_free(a);
+		set_free(b);
+	}
+
+	// empty sets and a set with itself
+	int* a = set_create();
+	int* empty = set_create();
+	for (int v = 0; v < 100; v++) {
+		set_add(&a, v);
+	}
+	int* u = set_union(a, empty);
+	int* i = set_intersection(a, empty);
+	int* d = set_difference(a, a);
+	CHECK(set_size(u) == 100 && set_size(i) == 0 && set_size(d) == 0);
+	set_union_update(&a, a);
+	CHECK(set_size(a) == 100);
+	set_intersection_update(&a, empty);
+	CHECK(set_size(a) == 0);
+	set_free(u);
+	set_free(i);
+	set_free(d);
+	set_free(a);
+	set_free(empty);
+}
+
+static void test_contains_many(void) {
+	static int keys[1000];
+	static set_size_t hits[1000];
+	uint64_t bitmap[(1000 + 63) / 64];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+
+	for (int e = 0; e < 4; e++) {
+		int* st = set_create_engine(engines[e]);
+		CHECK(set_contains_many(st, keys, 0, bitmap) == 0);
+		for (int v = 0; v < 2000; v += 2) {
+			set_add(&st, v);
+		}
+
+		// 999 keys, so the last word of the bitmap is partly used
+		for (int i = 0; i < 999; i++) {
+			keys[i] = i * 3;
+		}
+		set_size_t expected = 0;
+		for (int i = 0; i < 999; i++) {
+			expected += keys[i] < 2000 && keys[i] % 2 == 0;
+		}
+		CHECK(set_contains_many(st, keys, 999, bitmap) == expected);
+		for (int i = 0; i < 999; i++) {
+			bool hit = bitmap[i / 64] >> (i % 64) & 1;
+			CHECK(hit == (keys[i] < 2000 && keys[i] % 2 == 0));
+		}
+		CHECK(bitmap[999 / 64] >> (999 % 64) == 0);
+
+		CHECK(set_contains_many_indices(st, keys, 999, hits) == expected);
+		for (set_size_t h = 0, i = 0; i < 999; i++) {
+			if (keys[i] < 2000 && keys[i] % 2 == 0) {
+				CHECK(hits[h++] == i);
+			}
+		}
+		set_free(st);
+	}
+}
+
+typedef struct {
+	unsigned char bytes[3];
+} key3;
+
+static void test_single_block(void) {
+	// the hashes follow the elements, aligned whatever the element size
+	key3* odd = set_create();
+	key3 k = {{0, 0, 0}};
+	for (int i = 0; i < 1000; i++) {
+		k.bytes[0] = (unsigned char)i;
+		k.bytes[2] = (unsigned char)(i >> 8);
+		set_add(&odd, k);
+	}
+	CHECK(set_size(odd) == 1000);
+	for (int i = 0; i < 1000; i++) {
+		k.bytes[0] = (unsigned char)i;
+		k.bytes[2] = (unsigned char)(i >> 8);
+		CHECK(set_contains(&odd, k).code);
+	}
+	set_free(odd);
+
+	// growing slides the hashes up behind the elements and shrinking slides
+	// them back down, on every engine that keeps them
+	static bool model[3000];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_PMA};
+	for (int e = 0; e < 3; e++) {
+		int* st = set_create_engine(engines[e]);
+		memset(model, 0, sizeof(model));
+		for (int v = 0; v < 3000; v += 3) {
+			set_add(&st, v);
+			model[v] = true;
+		}
+		check_ints(&st, model, 3000);
+		set_erase(st, 0, set_size(st) - 100);
+		memset(model, 0, sizeof(model));
+		for (set_size_t i = 0; i < set_size(st); i++) {
+			model[st[i]] = true;
+		}
+		set_shrink_to_fit(&st);
+		CHECK(set_capacity(st) == 100);
+		check_ints(&st, model, 3000);
+		set_add(&st, 1);
+		model[1] = true;
+		check_ints(&st, model, 3000);
+		set_free(st);
+	}
+}
+
+// an allocator that checks every block comes back with the size it was
+// handed out with, and counts the blocks still out
+typedef struct {
+	void* blocks[64];
+	size_t sizes[64];
+	int live;
+	int bad;
+} tracker;
+
+static void tracker_forget(tracker* t, void* p, size_t size) {
+	for (int i = 0; i < t->live; i++) {
+		if (t->blocks[i] == p) {
+			t->bad += t->sizes[i] != size;
+			t->blocks[i] = t->blocks[--t->live];
+			t->sizes[i] = t->sizes[t->live];
+			return;
+		}
+	}
+	t->bad++;
+}
+
+static void* tracker_alloc(void* ctx, size_t size) {
+	tracker* t = (tracker*)ctx;
+	void* p = malloc(size);
+	if (t->live < 64) {
+		t->blocks[t->live] = p;
+		t->sizes[t->live++] = size;
+	} else {
+		t->bad++;
+	}
+	return p;
+}
+
+static void* tracker_realloc(void* ctx, void* p, size_t old_size, size_t new_size) {
+	tracker_forget((tracker*)ctx, p, old_size);
+	void* q = tracker_alloc(ctx, new_size);
+	memcpy(q, p, old_size < new_size ? old_size : new_size);
+	free(p);
+	return q;
+}
+
+static void tracker_free(void* ctx, void* p, size_t size) {
+	tracker_forget((tracker*)ctx, p, size);
+	free(p);
+}
+
+static void test_allocators(void) {
+	static bool model[2000];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+	tracker t;
+	set_allocator tracked = {tracker_alloc, tracker_realloc, tracker_free, &t};
+
+	for (int e = 0; e < 4; e++) {
+		memset(&t, 0, sizeof(t));
+		memset(model, 0, sizeof(model));
+		int* st = set_create_engine_with_allocator(engines[e], &tracked);
+		for (int v = 0; v < 2000; v += 7) {
+			set_add(&st, v);
+			model[v] = true;
+		}
+		// the copy gets its own block from the same allocator once it changes
+		int* copy = set_copy(st);
+		set_add(&copy, 1);
+		CHECK(!set_contains(&st, 1).code);
+		set_free(copy);
+		set_erase(st, 0, 100);
+		memset(model, 0, sizeof(model));
+		for (set_size_t i = 0; i < set_size(st); i++) {
+			model[st[i]] = true;
+		}
+		set_shrink_to_fit(&st);
+		check_ints(&st, model, 2000);
+		CHECK(t.live > 0);
+		set_free(st);
+		CHECK(t.live == 0 && t.bad == 0);
+	}
+
+	// arena sets don't have to be freed one by one
+	set_arena arena;
+	set_arena_init(&arena, 4096);
+	for (int round = 0; round < 3; round++) {
+		int* a = set_create_with_allocator(&arena.allocator);
+		int* b = set_create_engine_with_allocator(SET_ENGINE_SWISS, &arena.allocator);
+		for (int v = 0; v < 1000; v++) {
+			set_add(&a, v);
+			set_add(&b, v * 2);
+		}
+		CHECK(set_size(a) == 1000 && set_size(b) == 1000);
+		CHECK(set_contains(&a, 999).code && set_contains(&b, 1998).code && !set_contains(&b, 1).code);
+		int* both = set_intersection(a, b);
+		CHECK(set_size(both) == 500);
+		set_arena_reset(&arena);
+	}
+	set_arena_release(&arena);
+
+	// pool blocks are recycled between sets of the same size
+	set_pool pool;
+	set_pool_init(&pool);
+	for (int round = 0; round < 3; round++) {
+		int* sets[8];
+		for (int s = 0; s < 8; s++) {
+			sets[s] = set_create_with_allocator(&pool.allocator);
+			for (int v = 0; v < 100 * (s + 1); v++) {
+				set_add(&sets[s], v * (s + 1));
+			}
+		}
+		for (int s = 0; s < 8; s++) {
+			CHECK(set_size(sets[s]) == (set_size_t)(100 * (s + 1)));
+			CHECK(set_contains(&sets[s], 99 * (s + 1)).code);
+			set_free(sets[s]);
+		}
+	}
+	set_pool_release(&pool);
+}
+
+static void test_small(void) {
+	static bool model[100];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+
+	for (int e = 0; e < 4; e++) {
+		int* st = set_create_engine(engines[e]);
+		memset(model, 0, sizeof(model));
+		check_ints(&st, model, 100);
+		set_add(&st, 42);
+		model[42] = true;
+		check_ints(&st, model, 100);
+		set_pop(st);
+		model[42] = false;
+		check_ints(&st, model, 100);
+
+		// 16 elements still fit without hashes, the 17th promotes the set
+		for (int v = 0; v < 17; v++) {
+			set_add(&st, v * 5);
+			model[v * 5] = true;
+			check_ints(&st, model, 100);
+		}
+		set_erase(st, 1, 15);
+		memset(model, 0, sizeof(model));
+		model[st[0]] = model[st[1]] = true;
+		check_ints(&st, model, 100);
+		for (int v = 0; v < 20; v++) {
+			set_add(&st, v);
+			model[v] = true;
+		}
+		check_ints(&st, model, 100);
+		set_free(st);
+	}
+
+	// two small sets whose union doesn't fit in one
+	int* a = set_create();
+	int* b = set_create();
+	for (int v = 0; v < 10; v++) {
+		set_add(&a, v);
+		set_add(&b, v + 8);
+	}
+	int* u = set_union(a, b);
+	memset(model, 0, sizeof(model));
+	for (int v = 0; v < 18; v++) {
+		model[v] = true;
+	}
+	check_ints(&u, model, 100);
+	set_union_update(&a, b);
+	check_ints(&a, model, 100);
+	set_free(u);
+	set_free(a);
+	set_free(b);
+
+	// wide elements are compared whole in small sets too
+	key12* keys = set_create();
+	key12 k;
+	memset(&k, 0, sizeof(k));
+	for (int i = 0; i < 16; i++) {
+		k.bytes[i % 12] = (unsigned char)(i + 1);
+		set_add(&keys, k);
+	}
+	CHECK(set_size(keys) == 16);
+	CHECK(set_contains(&keys, k).code);
+	k.bytes[11] ^= 1;
+	CHECK(!set_contains(&keys, k).code);
+	set_free(keys);
+}
+
+static void test_adaptive(void) {
+	static bool model[5000];
+	int* st = set_create_engine(SET_ENGINE_ADAPTIVE);
+
+	// a dense run of values, added out of order
+	memset(model, 0, sizeof(model));
+	for (int i = 0; i < 1000; i++) {
+		int v = 1000 + (i * 389) % 1000;
+		set_add(&st, v);
+		model[v] = true;
+	}
+	check_ints(&st, model, 5000);
+
+	// a few values inside the range keep it dense, far away ones make it
+	// switch to hashing without losing anything
+	for (int v = 0; v < 5000; v += 97) {
+		set_add(&st, v);
+		model[v] = true;
+	}
+	check_ints(&st, model, 5000);
+	for (int v = 0; v < 300; v++) {
+		set_add(&st, 1000000 + v * 10007);
+	}
+	for (int v = 0; v < 300; v++) {
+		CHECK(set_contains(&st, 1000000 + v * 10007).code);
+		CHECK(!set_contains(&st, 1000001 + v * 10007).code);
+	}
+	set_erase(st, set_size(st) - 300, 300);
+	check_ints(&st, model, 5000);
+
+	// shrinking it back down and adding again makes it small again
+	set_erase(st, 0, set_size(st) - 5);
+	memset(model, 0, sizeof(model));
+	for (set_size_t i = 0; i < set_size(st); i++) {
+		model[st[i]] = true;
+	}
+	set_add(&st, 4999);
+	model[4999] = true;
+	check_ints(&st, model, 5000);
+	set_free(st);
+
+	// negative and 64-bit values in a dense run
+	int64_t* wide = set_create_engine(SET_ENGINE_ADAPTIVE);
+	for (int64_t v = -500; v < 500; v++) {
+		set_add(&wide, v + ((int64_t)1 << 40));
+		set_add(&wide, v);
+	}
+	CHECK(set_size(wide) == 2000);
+	for (int64_t v = -600; v < 600; v++) {
+		bool in = v >= -500 && v < 500;
+		CHECK(set_contains(&wide, v).code == in);
+		CHECK(set_contains(&wide, v + ((int64_t)1 << 40)).code == in);
+	}
+	set_free(wide);
+
+	// elements that aren't integers never get a dense index
+	key12* keys = set_create_engine(SET_ENGINE_ADAPTIVE);
+	key12 k;
+	memset(&k, 0, sizeof(k));
+	for (int i = 0; i < 300; i++) {
+		k.bytes[0] = (unsigned char)i;
+		k.bytes[1] = (unsigned char)(i >> 8);
+		set_add(&keys, k);
+	}
+	CHECK(set_size(keys) == 300);
+	k.bytes[0] = 7;
+	k.bytes[1] = 1;
+	CHECK(set_contains(&keys, k).code);
+	set_free(keys);
+}
+
+static void test_bitmap(void) {
+	// a universe that doesn't end on a word boundary
+	set_bitmap a = set_create_bitmap(1000);
+	CHECK(set_bitmap_universe(a) == 1000 && set_bitmap_size(a) == 0);
+	CHECK(!set_bitmap_contains(a, 0) && !set_bitmap_contains(a, 5000));
+	CHECK(set_bitmap_add(a, 0) && set_bitmap_add(a, 999) && set_bitmap_add(a, 999));
+	CHECK(!set_bitmap_add(a, 1000) && !set_bitmap_contains(a, 1000));
+	CHECK(set_bitmap_size(a) == 2);
+	set_bitmap_remove(a, 0);
+	set_bitmap_remove(a, 5000);
+	CHECK(set_bitmap_size(a) == 1 && set_bitmap_contains(a, 999));
+	set_bitmap_remove(a, 999);
+
+	for (size_t k = 0; k < 1000; k += 2) {
+		set_bitmap_add(a, k);
+	}
+	set_bitmap b = set_create_bitmap(3000);
+	for (size_t k = 0; k < 3000; k += 3) {
+		set_bitmap_add(b, k);
+	}
+
+	// the union covers b's larger universe, the others keep a's
+	set_bitmap u = set_bitmap_union(a, b);
+	set_bitmap i = set_bitmap_intersection(a, b);
+	set_bitmap d = set_bitmap_difference(a, b);
+	CHECK(set_bitmap_universe(u) == 3000 && set_bitmap_universe(i) == 1000 && set_bitmap_universe(d) == 1000);
+	size_t nu = 0, ni = 0, nd = 0;
+	for (size_t k = 0; k < 3000; k++) {
+		bool in_a = k < 1000 && k % 2 == 0, in_b = k % 3 == 0;
+		CHECK(set_bitmap_contains(u, k) == (in_a || in_b));
+		CHECK(set_bitmap_contains(i, k) == (in_a && in_b));
+		CHECK(set_bitmap_contains(d, k) == (in_a && !in_b));
+		nu += in_a || in_b;
+		ni += in_a && in_b;
+		nd += in_a && !in_b;
+	}
+	CHECK(set_bitmap_size(u) == nu && set_bitmap_size(i) == ni && set_bitmap_size(d) == nd);
+
+	// the updates give the same sets, growing a copy of a where needed
+	set_bitmap c = set_bitmap_copy(a);
+	set_bitmap_union_update(&c, b);
+	CHECK(set_bitmap_universe(c) == 3000 && set_bitmap_size(c) == nu && set_bitmap_contains(c, 2997));
+	set_bitmap_free(c);
+	c = set_bitmap_copy(a);
+	set_bitmap_intersection_update(&c, b);
+	CHECK(set_bitmap_size(c) == ni && set_bitmap_contains(c, 996) && !set_bitmap_contains(c, 998));
+	set_bitmap_free(c);
+	c = set_bitmap_copy(a);
+	set_bitmap_difference_update(&c, b);
+	CHECK(set_bitmap_size(c) == nd && set_bitmap_contains(c, 998) && !set_bitmap_contains(c, 996));
+	set_bitmap_free(c);
+	CHECK(set_bitmap_size(a) == 500);
+
+	// an empty universe
+	set_bitmap empty = set_create_bitmap(0);
+	CHECK(!set_bitmap_add(empty, 0) && set_bitmap_size(empty) == 0);
+	set_bitmap_union_update(&empty, a);
+	CHECK(set_bitmap_size(empty) == 500);
+
+	set_bitmap_free(empty);
+	set_bitmap_free(u);
+	set_bitmap_free(i);
+	set_bitmap_free(d);
+	set_bitmap_free(a);
+	set_bitmap_free(b);
+}
+
+// which keys the roaring test puts in its first set: a bitmap's worth in
+// group 0, a few in group 1, a long run in group 2 and the top key
+static bool roaring_in_a(uint32_t key) {
+	uint32_t group = key >> 16, low = key & 0xffff;
+	return (group == 0 && low % 3 == 0) || (group == 1 && low % 1000 == 0) ||
+	       (group == 2 && low >= 100 && low < 60100) || key == UINT32_MAX;
+}
+
+// and the second one: other keys in the same groups, plus group 5
+static bool roaring_in_b(uint32_t key) {
+	uint32_t group = key >> 16, low = key & 0xffff;
+	return (group == 0 && low % 2 == 0) || (group == 2 && low % 500 == 0) || group == 5;
+}
+
+static void test_roaring(void) {
+	set_roaring* a = set_create_roaring();
+	set_roaring* b = set_create_roaring();
+	CHECK(set_roaring_size(a) == 0 && !set_roaring_contains(a, 0));
+	CHECK(!set_roaring_remove(a, 0));
+
+	size_t na = 0, nb = 0;
+	for (uint32_t key = 0; key < 6 << 16; key++) {
+		if (roaring_in_a(key)) {
+			CHECK(set_roaring_add(a, key));
+			na++;
+		}
+		if (roaring_in_b(key)) {
+			set_roaring_add(b, key);
+			nb++;
+		}
+	}
+	CHECK(set_roaring_add(a, UINT32_MAX) && !set_roaring_add(a, UINT32_MAX));
+	na++;
+	CHECK(set_roaring_size(a) == na && set_roaring_size(b) == nb);
+
+	// run-length encoding the long run saves space and changes no answers
+	size_t before = set_roaring_memory(a);
+	set_roaring_optimize(a);
+	CHECK(set_roaring_memory(a) < before);
+	set_roaring* u = set_roaring_union(a, b);
+	set_roaring* i = set_roaring_intersection(a, b);
+	size_t nu = 0, ni = 0;
+	for (uint32_t key = 0; key < 7 << 16; key++) {
+		bool in_a = roaring_in_a(key), in_b = roaring_in_b(key);
+		CHECK(set_roaring_contains(a, key) == in_a);
+		CHECK(set_roaring_contains(u, key) == (in_a || in_b));
+		CHECK(set_roaring_contains(i, key) == (in_a && in_b));
+		nu += in_a || in_b;
+		ni += in_a && in_b;
+	}
+	CHECK(set_roaring_contains(u, UINT32_MAX) && !set_roaring_contains(i, UINT32_MAX));
+	CHECK(set_roaring_size(u) == nu + 1 && set_roaring_size(i) == ni);
+
+	// removing from a bitmap until it's small enough for an array, and from
+	// the middle of a run
+	for (uint32_t key = 3000; key < 1 << 16; key += 3) {
+		CHECK(set_roaring_remove(a, key));
+		na--;
+	}
+	CHECK(set_roaring_remove(a, 2 << 16 | 5000) && !set_roaring_remove(a, 2 << 16 | 5000));
+	na--;
+	for (uint32_t key = 0; key < 3 << 16; key++) {
+		bool in = roaring_in_a(key) && !(key < 1 << 16 && key >= 3000) && key != (2 << 16 | 5000);
+		CHECK(set_roaring_contains(a, key) == in);
+	}
+	CHECK(set_roaring_size(a) == na);
+
+	set_roaring_free(u);
+	set_roaring_free(i);
+	set_roaring_free(a);
+	set_roaring_free(b);
+}
+
+static void test_freeze(void) {
+	static bool model[13000];
+	static int keys[6000];
+	uint64_t bitmap[6000 / 64 + 1];
+
+	// sizes around the small limit and ones that don't fill the last level
+	int sizes[] = {0, 1, 16, 17, 1000, 4095};
+	for (int s = 0; s < 6; s++) {
+		int* st = set_create();
+		memset(model, 0, sizeof(model));
+		for (int i = 0; i < sizes[s]; i++) {
+			set_add(&st, i * 3);
+			model[i * 3] = true;
+		}
+		set_freeze(st);
+		check_ints(&st, model, 13000);
+		for (int k = 0; k < 6000; k++) {
+			keys[k] = k;
+		}
+		set_size_t expected = (set_size_t)sizes[s] < 2000 ? (set_size_t)sizes[s] : 2000;
+		CHECK(set_contains_many(st, keys, 6000, bitmap) == expected);
+
+		// changing a frozen set thaws it
+		set_add(&st, 1);
+		model[1] = true;
+		check_ints(&st, model, 13000);
+		set_freeze(st);
+		set_remove(st, 0);
+		memset(model, 0, sizeof(model));
+		for (set_size_t i = 0; i < set_size(st); i++) {
+			model[st[i]] = true;
+		}
+		check_ints(&st, model, 13000);
+		set_freeze(st);
+		set_freeze(st);
+		check_ints(&st, model, 13000);
+		set_free(st);
+	}
+
+	// freezing a copy leaves the original as it was, and the frozen copy
+	// still works in set algebra
+	int* a = set_create();
+	for (int v = 0; v < 500; v++) {
+		set_add(&a, v * 2);
+	}
+	int* frozen = set_copy(a);
+	set_freeze(frozen);
+	CHECK(frozen != a);
+	int* both = set_intersection(frozen, a);
+	CHECK(set_size(both) == 500 && set_contains(&both, 998).code && !set_contains(&frozen, 999).code);
+	set_free(both);
+	set_free(frozen);
+	CHECK(set_size(a) == 500 && set_contains(&a, 0).code);
+	set_free(a);
+
+	// other engines are left as they are
+	int* swiss = set_create_engine(SET_ENGINE_SWISS);
+	for (int v = 0; v < 100; v++) {
+		set_add(&swiss, v);
+	}
+	set_freeze(swiss);
+	CHECK(set_size(swiss) == 100 && set_contains(&swiss, 99).code);
+	set_free(swiss);
+}
+
+static void test_directory(void) {
+	static bool model[20000];
+	int* st = set_create();
+
+	// turned on while empty, the directory follows the set through the small
+	// limit, growth, removals and a rebuild of every bucket
+	memset(model, 0, sizeof(model));
+	set_use_directory(st, true);
+	check_ints(&st, model, 20000);
+	for (int v = 0; v < 20000; v += 2) {
+		set_add(&st, v);
+		model[v] = true;
+		if (v == 16 * 2 || v == 17 * 2) {
+			check_ints(&st, model, 20000);
+		}
+	}
+	check_ints(&st, model, 20000);
+	for (int k = 0; k < 2000; k++) {
+		set_size_t pos = (set_size_t)(k * 7919) % set_size(st);
+		model[st[pos]] = false;
+		set_remove(st, pos);
+	}
+	check_ints(&st, model, 20000);
+	int values[1000];
+	for (int i = 0; i < 1000; i++) {
+		values[i] = i * 20 + 1;
+		model[i * 20 + 1] = true;
+	}
+	set_add_many(&st, values, 1000);
+	check_ints(&st, model, 20000);
+
+	// turning it off in a copy leaves the original's directory alone
+	int* copy = set_copy(st);
+	set_use_directory(copy, false);
+	check_ints(&copy, model, 20000);
+	set_add(&copy, 3);
+	CHECK(!set_contains(&st, 3).code);
+	check_ints(&st, model, 20000);
+	set_free(copy);
+
+	// along with the write buffer
+	set_use_buffer(st, true);
+	for (int v = 5; v < 20000; v += 10) {
+		set_add(&st, v);
+		model[v] = true;
+	}
+	check_ints(&st, model, 20000);
+	set_flush(st);
+	check_ints(&st, model, 20000);
+	set_use_directory(st, false);
+	check_ints(&st, model, 20000);
+	set_free(st);
+}
+
+static void test_pma(void) {
+	static bool model[50000];
+	int* st = set_create_engine(SET_ENGINE_PMA);
+
+	// elements stay in insertion order while their hashes are spread out and
+	// packed together again as the array fills up
+	memset(model, 0, sizeof(model));
+	for (int i = 0; i < 20000; i++) {
+		int v = (int)((i * 7919L) % 50000);
+		set_add(&st, v);
+		model[v] = true;
+		CHECK(st[i] == v);
+	}
+	check_ints(&st, model, 50000);
+
+	// removing by position keeps the order of the rest
+	for (set_size_t i = 5000; i < 15000; i++) {
+		model[st[i]] = false;
+	}
+	set_erase(st, 5000, 10000);
+	CHECK(st[5000] == (int)((15000 * 7919L) % 50000));
+	for (int k = 0; k < 2000; k++) {
+		set_size_t pos = (set_size_t)(k * 104729L % set_size(st));
+		int next = pos + 1 < set_size(st) ? st[pos + 1] : -1;
+		model[st[pos]] = false;
+		set_remove(st, pos);
+		if (next >= 0) {
+			CHECK(st[pos] == next);
+		}
+	}
+	check_ints(&st, model, 50000);
+	set_shrink_to_fit(&st);
+	check_ints(&st, model, 50000);
+
+	// while discarding by value fills the hole with the last element
+	for (int v = 0; v < 50000; v += 5) {
+		pack found = set_contains(&st, v);
+		int last = st[set_size(st) - 1];
+		CHECK(set_discard(&st, v) == found.code);
+		if (found.code && found.index < set_size(st)) {
+			CHECK(st[found.index] == last);
+		}
+		model[v] = false;
+		set_add(&st, v + 1);
+		model[v + 1] = true;
+	}
+	check_ints(&st, model, 50000);
+	set_free(st);
+}
+
+static void test_buffer(void) {
+	static bool model[10000];
+	int* st = set_create();
+	set_use_buffer(st, true);
+
+	// buffered elements are found, at their positions, and not added twice
+	memset(model, 0, sizeof(model));
+	for (int v = 0; v < 10000; v += 3) {
+		set_add(&st, v);
+		set_add(&st, v);
+		model[v] = true;
+		if (v % 999 == 0) {
+			check_ints(&st, model, 10000);
+		}
+	}
+	check_ints(&st, model, 10000);
+
+	// removing from the buffer and from the sorted part
+	set_pop(st);
+	model[9999] = false;
+	set_erase(st, set_size(st) - 3, 2);
+	set_remove(st, 0);
+	memset(model, 0, sizeof(model));
+	for (set_size_t i = 0; i < set_size(st); i++) {
+		model[st[i]] = true;
+	}
+	check_ints(&st, model, 10000);
+	set_add(&st, 1);
+	set_add(&st, 2);
+	model[1] = model[2] = true;
+	CHECK(set_discard(&st, 1) && !set_discard(&st, 1));
+	model[1] = false;
+	check_ints(&st, model, 10000);
+
+	// a copy with unmerged elements, and set algebra reading one, leave it
+	// as it was
+	set_add(&st, 4);
+	model[4] = true;
+	int* copy = set_copy(st);
+	int* other = set_create();
+	set_add(&other, 4);
+	set_add(&other, 5);
+	int* u = set_union(st, other);
+	CHECK(set_size(u) == set_size(st) + 1);
+	set_union_update(&other, st);
+	CHECK(set_size(other) == set_size(u));
+	set_flush(copy);
+	check_ints(&copy, model, 10000);
+	check_ints(&st, model, 10000);
+	set_free(u);
+	set_free(other);
+	set_free(copy);
+
+	set_flush(st);
+	set_flush(st);
+	check_ints(&st, model, 10000);
+	set_add(&st, 7);
+	model[7] = true;
+	set_use_buffer(st, false);
+	check_ints(&st, model, 10000);
+	set_free(st);
+}
+
+static void test_discard(void) {
+	static bool model[3000];
+	static int values[3000];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+
+	for (int e = 0; e < 4; e++) {
+		int* st = set_create_engine(engines[e]);
+		memset(model, 0, sizeof(model));
+		CHECK(!set_discard(&st, 0));
+		CHECK(set_discard_many(&st, values, 0) == 0);
+		set_add(&st, 0);
+		CHECK(set_discard(&st, 0) && set_size(st) == 0);
+
+		for (int v = 0; v < 2000; v++) {
+			set_add(&st, v);
+			model[v] = true;
+		}
+		for (int v = 0; v < 3000; v += 7) {
+			CHECK(set_discard(&st, v) == model[v]);
+			model[v] = false;
+		}
+		check_ints(&st, model, 3000);
+
+		// a batch with absent values and duplicates
+		set_size_t expected = 0;
+		for (int i = 0; i < 3000; i++) {
+			values[i] = (i * 11) % 3000;
+		}
+		for (int i = 0; i < 1500; i++) {
+			expected += model[values[i]];
+			model[values[i]] = false;
+		}
+		memcpy(&values[1500], values, 1500 * sizeof(int));
+		CHECK(set_discard_many(&st, values, 3000) == expected);
+		check_ints(&st, model, 3000);
+
+		// down to nothing
+		for (int v = 0; v < 3000; v++) {
+			values[v] = v;
+		}
+		expected = set_size(st);
+		CHECK(set_discard_many(&st, values, 3000) == expected);
+		CHECK(set_discard_many(&st, values, 3000) == 0);
+		memset(model, 0, sizeof(model));
+		check_ints(&st, model, 3000);
+		set_free(st);
+	}
+
+	// discarding from a shared copy only changes the copy, and discarding
+	// something absent changes neither
+	memset(model, 0, sizeof(model));
+	int* a = set_create();
+	for (int v = 0; v < 100; v++) {
+		set_add(&a, v);
+		model[v] = true;
+	}
+	int* b = set_copy(a);
+	CHECK(!set_discard(&b, 500));
+	values[0] = 500;
+	values[1] = 600;
+	CHECK(set_discard_many(&b, values, 2) == 0);
+	CHECK(set_size(a) == 100 && set_size(b) == 100);
+	check_ints(&a, model, 3000);
+	check_ints(&b, model, 3000);
+	CHECK(set_discard(&b, 50));
+	check_ints(&a, model, 3000);
+	model[50] = false;
+	check_ints(&b, model, 3000);
+	set_free(a);
+	set_free(b);
+}
+
+static bool is_multiple(const void* element, void* ctx) {
+	return *(const int*)element % *(int*)ctx == 0;
+}
+
+static void test_remove_if(void) {
+	static bool model[3000];
+	static int order[3000];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+
+	for (int e = 0; e < 4; e++) {
+		int* st = set_create_engine(engines[e]);
+		int three = 3, two = 2;
+		CHECK(set_remove_if(st, is_multiple, &three) == 0);
+		CHECK(set_remove_range(st, 0, 10) == 0);
+
+		memset(model, 0, sizeof(model));
+		for (int i = 0; i < 2000; i++) {
+			int v = (i * 1237) % 3000 - 1000;
+			set_add(&st, v);
+			model[v + 1000] = true;
+		}
+
+		// the rest keep their order
+		set_size_t n = 0;
+		for (set_size_t i = 0; i < set_size(st); i++) {
+			if (st[i] % 3 != 0) {
+				order[n++] = st[i];
+			} else {
+				model[st[i] + 1000] = false;
+			}
+		}
+		set_size_t before = set_size(st);
+		CHECK(set_remove_if(st, is_multiple, &three) == before - n);
+		CHECK(set_size(st) == n && memcmp(st, order, n * sizeof(int)) == 0);
+		for (int v = -1000; v < 2000; v++) {
+			model[v + 1000] = model[v + 1000] && v % 2 == 0;
+		}
+		set_retain_if(st, is_multiple, &two);
+		for (int v = -1000; v < 2000; v++) {
+			CHECK(set_contains(&st, v).code == model[v + 1000]);
+		}
+
+		// ranges are inclusive and can cross zero, an empty one removes
+		// nothing and one covering every int everything
+		CHECK(set_remove_range(st, 5, 4) == 0);
+		set_size_t in_range = 0;
+		for (int v = -10; v <= 10; v++) {
+			in_range += model[v + 1000];
+			model[v + 1000] = false;
+		}
+		CHECK(set_remove_range(st, -10, 10) == in_range);
+		in_range = 0;
+		for (int v = -500; v <= 500; v++) {
+			in_range += model[v + 1000];
+		}
+		before = set_size(st);
+		CHECK(set_retain_range(st, -500, 500) == before - in_range);
+		for (int v = -1000; v < 2000; v++) {
+			model[v + 1000] = model[v + 1000] && v >= -500 && v <= 500;
+			CHECK(set_contains(&st, v).code == model[v + 1000]);
+		}
+		CHECK(set_size(st) == in_range);
+		CHECK(set_remove_range(st, INT64_MIN, INT64_MAX) == in_range && set_size(st) == 0);
+		set_free(st);
+	}
+
+	// bounds past the range of the element type
+	int8_t* bytes = set_create();
+	for (int v = -128; v < 128; v++) {
+		set_add(&bytes, (int8_t)v);
+	}
+	CHECK(set_remove_range(bytes, 1000, 2000) == 0);
+	CHECK(set_remove_range(bytes, 100, 1000) == 28);
+	CHECK(set_retain_range(bytes, -1000, -100) == 199);
+	CHECK(set_size(bytes) == 29 && set_contains(&bytes, (int8_t)-128).code);
+	set_free(bytes);
+
+	// removing nothing from a shared copy leaves both alone
+	int* a = set_create();
+	for (int v = 0; v < 100; v++) {
+		set_add(&a, v);
+	}
+	int* b = set_copy(a);
+	int big = 1000;
+	CHECK(set_remove_range(b, 200, 300) == 0 && set_retain_range(b, 0, 99) == 0);
+	CHECK(set_remove_if(b, is_multiple, &big) == 1);
+	CHECK(set_size(a) == 100 && set_size(b) == 99 && set_contains(&a, 0).code && !set_contains(&b, 0).code);
+	set_free(a);
+	set_free(b);
+}
+
+static void test_growth(void) {
+	static bool model[5000];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_PMA};
+
+	// a reserved set doesn't move while it fills up, hashes and all
+	for (int e = 0; e < 3; e++) {
+		int* st = set_create_engine(engines[e]);
+		memset(model, 0, sizeof(model));
+		set_reserve(&st, 5000);
+		CHECK(set_capacity(st) == 5000);
+		int* before = st;
+		for (int v = 0; v < 5000; v++) {
+			set_add(&st, v);
+			model[v] = true;
+		}
+		CHECK(st == before && set_capacity(st) == 5000);
+		check_ints(&st, model, 5000);
+		set_reserve(&st, 10);
+		CHECK(st == before);
+		set_free(st);
+	}
+
+	// a growth policy caps each step and starts at min_capacity, and shrinks
+	// sets that fall below a quarter full
+	set_growth steps = {2.0, 32, 100, 0.25};
+	int* st = set_create();
+	set_use_growth(st, &steps);
+	memset(model, 0, sizeof(model));
+	set_add(&st, 0);
+	model[0] = true;
+	CHECK(set_capacity(st) >= 32);
+	set_size_t last = set_capacity(st);
+	for (int v = 1; v < 1000; v++) {
+		set_add(&st, v);
+		model[v] = true;
+		CHECK(set_capacity(st) - last <= 100);
+		last = set_capacity(st);
+	}
+	check_ints(&st, model, 5000);
+	for (int v = 0; v < 900; v++) {
+		set_discard(&st, v);
+		model[v] = false;
+	}
+	CHECK(set_capacity(st) < 400 && set_capacity(st) >= 100);
+	check_ints(&st, model, 5000);
+
+	// the policy goes along with copies, and shrink_to_fit works anyway
+	int* copy = set_copy(st);
+	set_discard(&copy, 999);
+	CHECK(set_size(copy) == 99 && set_size(st) == 100);
+	set_shrink_to_fit(&copy);
+	CHECK(set_capacity(copy) == 99);
+	set_free(copy);
+	set_free(st);
+
+	// the default policy never shrinks on its own
+	st = set_create();
+	for (int v = 0; v < 1000; v++) {
+		set_add(&st, v);
+	}
+	last = set_capacity(st);
+	for (int v = 0; v < 999; v++) {
+		set_discard(&st, v);
+	}
+	CHECK(set_capacity(st) == last && set_size(st) == 1);
+	set_shrink_to_fit(&st);
+	CHECK(set_capacity(st) == 1 && set_contains(&st, 999).code);
+	set_free(st);
+}
+
+static void test_mmap_allocator(void) {
+	static bool model[40000];
+	set_mmap mapped;
+
+	// small blocks come from malloc, then grow into a mapping, get remapped
+	// and shrink back under the threshold
+	for (int huge = 0; huge < 2; huge++) {
+		set_mmap_init(&mapped, 16384, huge);
+		set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS};
+		for (int e = 0; e < 2; e++) {
+			int* st = set_create_engine_with_allocator(engines[e], &mapped.allocator);
+			memset(model, 0, sizeof(model));
+			for (int v = 0; v < 40000; v += 2) {
+				set_add(&st, v);
+				model[v] = true;
+			}
+			check_ints(&st, model, 40000);
+			set_erase(st, 10, set_size(st) - 20);
+			memset(model, 0, sizeof(model));
+			for (set_size_t i = 0; i < set_size(st); i++) {
+				model[st[i]] = true;
+			}
+			set_shrink_to_fit(&st);
+			check_ints(&st, model, 40000);
+			int* copy = set_copy(st);
+			set_add(&copy, 1);
+			set_reserve(&copy, 100000);
+			CHECK(set_size(copy) == 21 && set_contains(&copy, 1).code && !set_contains(&st, 1).code);
+			set_free(copy);
+			set_free(st);
+		}
+	}
+}
+
+// overwrites the bytes of path at offset with the n bytes at data
+static void patch_file(const char* path, long offset, const void* data, size_t n) {
+	FILE* f = fopen(path, "r+b");
+	CHECK(f != NULL);
+	if (f != NULL) {
+		fseek(f, offset, SEEK_SET);
+		fwrite(data, 1, n, f);
+		fclose(f);
+	}
+}
+
+// the first bytes of a set file, laid out as set.c writes them
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t hash_size;
+	uint32_t header_size;
+	uint64_t type_size;
+	uint64_t size;
+	uint64_t file_size;
+	uint64_t checksum;
+	uint64_t header_checksum;
+} file_header;
+
+// rewrites the size and element size in the header of the file at path, with
+// a header checksum that matches them, the way set.c computes it
+static void patch_file_sizes(const char* path, uint64_t size, uint64_t type_size) {
+	file_header fh;
+	FILE* f = fopen(path, "rb");
+	CHECK(f != NULL && fread(&fh, 1, sizeof(fh), f) == sizeof(fh));
+	if (f != NULL) {
+		fclose(f);
+	}
+
+	fh.size = size;
+	fh.type_size = type_size;
+	fh.header_checksum = 0;
+	uint64_t sum = 0, word;
+	for (size_t i = 0; i < sizeof(fh); i += 8) {
+		memcpy(&word, (unsigned char*)&fh + i, 8);
+		sum = ((sum << 23 | sum >> 41) ^ word) * 0x9e3779b97f4a7c15ULL;
+	}
+	fh.header_checksum = sum;
+	patch_file(path, 0, &fh, sizeof(fh));
+}
+
+static void test_files(void) {
+	static bool model[3000];
+	const char* path = "test_set.tmp";
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+	int sizes[] = {0, 1, 16, 2000};
+
+	// every engine and size maps back as a sorted set with the same elements
+	for (int e = 0; e < 4; e++) {
+		for (int s = 0; s < 4; s++) {
+			int* st = set_create_engine(engines[e]);
+			memset(model, 0, sizeof(model));
+			for (int i = 0; i < sizes[s]; i++) {
+				set_add(&st, i * 3 % 2999);
+				model[i * 3 % 2999] = true;
+			}
+			CHECK(set_save(st, path) && set_verify_file(path));
+			int* mapped = set_open_mmap(path, int);
+			CHECK(mapped != NULL);
+			if (mapped != NULL) {
+				check_ints(&mapped, model, 3000);
+				set_free(mapped);
+			}
+			set_free(st);
+		}
+	}
+
+	// a set with unmerged elements is saved merged, and a shared copy of it
+	// is left as it was
+	int* st = set_create();
+	set_use_buffer(st, true);
+	memset(model, 0, sizeof(model));
+	for (int v = 0; v < 3000; v += 2) {
+		set_add(&st, v);
+		model[v] = true;
+	}
+	int* copy = set_copy(st);
+	CHECK(set_save(copy, path));
+	check_ints(&st, model, 3000);
+	set_free(copy);
+
+	// changing a mapped set moves it to the heap and never touches the file
+	int* mapped = set_open_mmap(path, int);
+	CHECK(mapped != NULL);
+	for (int v = 1; v < 3000; v += 2) {
+		set_add(&mapped, v);
+	}
+	set_discard(&mapped, 0);
+	CHECK(set_size(mapped) == 2999 && set_contains(&mapped, 1).code);
+	set_free(mapped);
+	mapped = set_open_mmap(path, int);
+	check_ints(&mapped, model, 3000);
+	set_free(mapped);
+
+	// files that can't be opened as a set of ints
+	CHECK(set_open_mmap(path, int64_t) == NULL);
+	CHECK(set_open_mmap("no/such/file", int) == NULL && !set_verify_file("no/such/file"));
+	FILE* f = fopen(path, "wb");
+	fputs("not a set", f);
+	fclose(f);
+	CHECK(set_open_mmap(path, int) == NULL && !set_verify_file(path));
+
+	// a damaged file header is refused
+	CHECK(set_save(st, path));
+	uint32_t version = 99;
+	patch_file(path, 8, &version, sizeof(version));
+	CHECK(set_open_mmap(path, int) == NULL && !set_verify_file(path));
+
+	// sizes whose block size wraps around to the file's length are refused,
+	// even with a header checksum that matches them
+	CHECK(set_save(st, path));
+	patch_file_sizes(path, 1500, 4);
+	CHECK(set_verify_file(path));
+	patch_file_sizes(path, 1500 + ((uint64_t)1 << 62), 4);
+	CHECK(set_open_mmap(path, int) == NULL && !set_verify_file(path));
+	patch_file_sizes(path, 1500, 4 + ((uint64_t)1 << 62));
+	CHECK(!set_verify_file(path));
+	patch_file_sizes(path, UINT64_MAX, UINT64_MAX);
+	CHECK(set_open_mmap(path, int) == NULL && !set_verify_file(path));
+
+	// junk in the block's header is ignored, since it's rebuilt on open
+	unsigned char junk[64];
+	memset(junk, 0xa5, sizeof(junk));
+	CHECK(set_save(st, path));
+	patch_file(path, 4096, junk, sizeof(junk));
+	mapped = set_open_mmap(path, int);
+	CHECK(mapped != NULL);
+	if (mapped != NULL) {
+		check_ints(&mapped, model, 3000);
+		set_add(&mapped, 1);
+		CHECK(set_contains(&mapped, 1).code);
+		set_free(mapped);
+	}
+
+	// damaged elements can only be found by checking the whole file
+	CHECK(set_save(st, path));
+	patch_file(path, 4096 + 256, junk, 4);
+	CHECK(!set_verify_file(path));
+	mapped = set_open_mmap(path, int);
+	CHECK(mapped != NULL && set_size(mapped) == 1500);
+	set_free(mapped);
+
+	remove(path);
+	set_free(st);
+}
+
+static void test_copies(void) {
+	static bool model[1000];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS, SET_ENGINE_ADAPTIVE, SET_ENGINE_PMA};
+	int three = 3;
+
+	for (int e = 0; e < 4; e++) {
+		int* base = set_create_engine(engines[e]);
+		memset(model, 0, sizeof(model));
+		for (int v = 0; v < 1000; v += 2) {
+			set_add(&base, v);
+			model[v] = true;
+		}
+
+		// every change to a copy leaves the set it was copied from alone
+		for (int op = 0; op < 15; op++) {
+			int* copy = set_copy(base);
+			int other[2] = {1, 2};
+			CHECK(copy == base);
+			switch (op) {
+			case 0: set_add(&copy, 1); break;
+			case 1: set_add_many(&copy, other, 2); break;
+			case 2: set_discard(&copy, 2); break;
+			case 3: set_discard_many(&copy, other, 2); break;
+			case 4: set_erase(copy, 0, 3); break;
+			case 5: set_remove(copy, 1); break;
+			case 6: set_pop(copy); break;
+			case 7: set_remove_if(copy, is_multiple, &three); break;
+			case 8: set_retain_range(copy, 10, 20); break;
+			case 9: set_freeze(copy); set_add(&copy, 1); break;
+			case 10: set_use_buffer(copy, true); set_add(&copy, 1); set_flush(copy); break;
+			case 11: set_use_directory(copy, true); set_add(&copy, 1); break;
+			case 12: set_reserve(&copy, 5000); break;
+			case 13: set_shrink_to_fit(&copy); break;
+			default: set_intersection_update(&copy, copy); set_difference_update(&copy, base); break;
+			}
+			check_ints(&base, model, 1000);
+			set_free(copy);
+		}
+
+		// and changing the original leaves its copy alone
+		int* copy = set_copy(base);
+		set_erase(base, 0, set_size(base));
+		CHECK(set_size(base) == 0);
+		check_ints(&copy, model, 1000);
+		set_free(copy);
+
+		// changes that change nothing keep sharing the block
+		for (int v = 0; v < 1000; v += 2) {
+			set_add(&base, v);
+		}
+		copy = set_copy(base);
+		int absent[3] = {1, 3, 1001};
+		CHECK(!set_discard(&copy, 1));
+		CHECK(set_discard_many(&copy, absent, 3) == 0);
+		CHECK(set_retain_range(copy, 0, 999) == 0);
+		CHECK(set_remove_range(copy, 2000, 3000) == 0);
+		set_add(&copy, 0);
+		CHECK(copy == base);
+		check_ints(&copy, model, 1000);
+		set_free(copy);
+		set_free(base);
+	}
+
+	// copies of copies, freed in any order
+	int* a = set_create();
+	set_add(&a, 1);
+	int* b = set_copy(a);
+	int* c = set_copy(b);
+	set_free(a);
+	set_add(&b, 2);
+	CHECK(set_size(b) == 2 && set_size(c) == 1);
+	set_free(c);
+	CHECK(set_contains(&b, 1).code);
+	set_free(b);
+}
+
+typedef struct {
+	size_t count;
+	int64_t sum;
+	int only_a;
+	int only_b;
+} hamt_tally;
+
+static void tally_element(const void* element, void* ctx) {
+	hamt_tally* t = (hamt_tally*)ctx;
+	t->count++;
+	t->sum += *(const int*)element;
+}
+
+static void tally_diff(const void* element, bool in_a, void* ctx) {
+	hamt_tally* t = (hamt_tally*)ctx;
+	if (in_a) {
+		t->only_a++;
+	} else {
+		t->only_b++;
+	}
+	t->sum += *(const int*)element;
+}
+
+static void test_hamt(void) {
+	set_hamt* versions[5];
+	hamt_tally t;
+
+	// the empty version
+	versions[0] = set_create_hamt(sizeof(int));
+	int v = 7;
+	memset(&t, 0, sizeof(t));
+	set_hamt_foreach(versions[0], tally_element, &t);
+	CHECK(set_hamt_size(versions[0]) == 0 && t.count == 0 && !set_hamt_contains(versions[0], &v));
+
+	// enough elements for paths several levels deep, each version built from
+	// the one before it and left as it was
+	for (int i = 1; i < 4; i++) {
+		versions[i] = set_hamt_add(versions[i - 1], &v);
+		for (v = (i - 1) * 10000; v < i * 10000; v++) {
+			set_hamt* added = set_hamt_add(versions[i], &v);
+			set_hamt_free(versions[i]);
+			versions[i] = added;
+		}
+		v = 7;
+	}
+	for (int i = 0; i < 4; i++) {
+		size_t expected = (size_t)i * 10000;
+		CHECK(set_hamt_size(versions[i]) == expected);
+		for (v = 0; v < 40000; v += 7) {
+			CHECK(set_hamt_contains(versions[i], &v) == (v < i * 10000));
+		}
+		memset(&t, 0, sizeof(t));
+		set_hamt_foreach(versions[i], tally_element, &t);
+		CHECK(t.count == expected && t.sum == (int64_t)expected * ((int64_t)expected - 1) / 2);
+	}
+
+	// removing an absent element and one that is there
+	v = -1;
+	versions[4] = set_hamt_remove(versions[3], &v);
+	CHECK(set_hamt_size(versions[4]) == 30000);
+	set_hamt_free(versions[4]);
+	v = 12345;
+	versions[4] = set_hamt_remove(versions[3], &v);
+	CHECK(set_hamt_size(versions[4]) == 29999 && !set_hamt_contains(versions[4], &v));
+	CHECK(set_hamt_contains(versions[3], &v));
+
+	// a diff only reports what changed between two versions
+	memset(&t, 0, sizeof(t));
+	set_hamt_diff(versions[3], versions[4], tally_diff, &t);
+	CHECK(t.only_a == 1 && t.only_b == 0 && t.sum == 12345);
+	memset(&t, 0, sizeof(t));
+	set_hamt_diff(versions[1], versions[2], tally_diff, &t);
+	CHECK(t.only_a == 0 && t.only_b == 10000);
+	memset(&t, 0, sizeof(t));
+	set_hamt_diff(versions[2], versions[2], tally_diff, &t);
+	CHECK(t.only_a == 0 && t.only_b == 0);
+	memset(&t, 0, sizeof(t));
+	set_hamt_diff(versions[0], versions[1], tally_diff, &t);
+	CHECK(t.only_b == 10000);
+
+	// versions are freed on their own, in any order
+	set_hamt_free(versions[2]);
+	set_hamt_free(versions[0]);
+	v = 25000;
+	CHECK(set_hamt_contains(versions[3], &v) && !set_hamt_contains(versions[1], &v));
+	set_hamt_free(versions[3]);
+	set_hamt_free(versions[1]);
+	CHECK(set_hamt_size(versions[4]) == 29999);
+	set_hamt_free(versions[4]);
+
+	// wider elements
+	set_hamt* keys = set_create_hamt(sizeof(key12));
+	key12 k;
+	memset(&k, 0, sizeof(k));
+	for (int i = 0; i < 1000; i++) {
+		k.bytes[11] = (unsigned char)i;
+		k.bytes[0] = (unsigned char)(i >> 8);
+		set_hamt* added = set_hamt_add(keys, &k);
+		set_hamt_free(keys);
+		keys = added;
+	}
+	CHECK(set_hamt_size(keys) == 1000 && set_hamt_contains(keys, &k));
+	k.bytes[5] = 1;
+	CHECK(!set_hamt_contains(keys, &k));
+	set_hamt_free(keys);
+}
+
+#ifdef TEST_THREADED
+#define TEST_THREADS 8
+#define TEST_PER_THREAD 20000
+
+// what each thread of the concurrent tests works on, and what it found
+typedef struct {
+	void* target;
+	int id;
+	int added;
+	int removed;
+	int missing;
+} worker;
+
+static void count_element(const void* element, void* ctx) {
+	(void)element;
+	++*(size_t*)ctx;
+}
+
+// adds its own range and one shared by all threads, checking it can see
+// everything it added, then removes the odd values of its own range
+static void* concurrent_worker(void* arg) {
+	worker* w = (worker*)arg;
+	set_concurrent* cs = (set_concurrent*)w->target;
+
+	for (int i = 0; i < TEST_PER_THREAD; i++) {
+		int v = w->id * TEST_PER_THREAD + i;
+		int shared = -1 - i % 1000;
+		w->added += set_concurrent_add(cs, &v);
+		w->added += set_concurrent_add(cs, &shared);
+		w->missing += !set_concurrent_contains(cs, &v) + !set_concurrent_contains(cs, &shared);
+	}
+	for (int i = 1; i < TEST_PER_THREAD; i += 2) {
+		int v = w->id * TEST_PER_THREAD + i;
+		w->removed += set_concurrent_remove(cs, &v);
+		w->missing += set_concurrent_contains(cs, &v);
+	}
+	return NULL;
+}
+
+static void test_concurrent(void) {
+	pthread_t threads[TEST_THREADS];
+	worker workers[TEST_THREADS];
+
+	// a small capacity, so the threads grow it together
+	set_concurrent* cs = set_create_concurrent(sizeof(int), 16);
+	memset(workers, 0, sizeof(workers));
+	for (int i = 0; i < TEST_THREADS; i++) {
+		workers[i].target = cs;
+		workers[i].id = i;
+		pthread_create(&threads[i], NULL, concurrent_worker, &workers[i]);
+	}
+	int added = 0, removed = 0, missing = 0;
+	for (int i = 0; i < TEST_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		added += workers[i].added;
+		removed += workers[i].removed;
+		missing += workers[i].missing;
+	}
+
+	// every value was added exactly once, even the shared ones
+	CHECK(added == TEST_THREADS * TEST_PER_THREAD + 1000);
+	CHECK(removed == TEST_THREADS * TEST_PER_THREAD / 2 && missing == 0);
+	size_t expected = TEST_THREADS * TEST_PER_THREAD / 2 + 1000, visited = 0;
+	CHECK(set_concurrent_size(cs) == expected);
+	set_concurrent_foreach(cs, count_element, &visited);
+	CHECK(visited == expected);
+	for (int v = -1000; v < TEST_THREADS * TEST_PER_THREAD; v++) {
+		CHECK(set_concurrent_contains(cs, &v) == (v < 0 || v % 2 == 0));
+	}
+	int absent = -1001;
+	CHECK(!set_concurrent_remove(cs, &absent));
+	set_concurrent_free(cs);
+}
+
+// reads the newest set over and over: it always holds 0 to some multiple of
+// 10 minus one, and never fewer elements than the one read before it
+static void* rcu_worker(void* arg) {
+	worker* w = (worker*)arg;
+	set_rcu* rcu = (set_rcu*)w->target;
+	set_rcu_reader* handle = set_rcu_register(rcu);
+	set_size_t last = 0;
+
+	for (int i = 0; i < TEST_PER_THREAD; i++) {
+		int* st = set_rcu_read_begin(rcu, handle);
+		set_size_t size = set_size(st);
+		int top = (int)size;
+		w->missing += size % 10 != 0 || size < last || set_contains(&st, top).code;
+		if (size > 0) {
+			top = (int)size - 1;
+			w->missing += !set_contains(&st, top).code;
+		}
+		last = size;
+		set_rcu_read_end(handle);
+	}
+	set_rcu_unregister(handle);
+	return NULL;
+}
+
+static void test_rcu(void) {
+	pthread_t threads[TEST_THREADS];
+	worker workers[TEST_THREADS];
+	int* st = set_create_engine(SET_ENGINE_SWISS);
+	set_rcu* rcu = set_create_rcu(set_copy(st));
+
+	memset(workers, 0, sizeof(workers));
+	for (int i = 0; i < TEST_THREADS; i++) {
+		workers[i].target = rcu;
+		pthread_create(&threads[i], NULL, rcu_worker, &workers[i]);
+	}
+	// each version is a copy of the writer's set, which only stops sharing
+	// its block with the published one when the next elements are added
+	for (int k = 0; k < 500; k++) {
+		for (int v = k * 10; v < k * 10 + 10; v++) {
+			set_add(&st, v);
+		}
+		set_rcu_publish(rcu, set_copy(st));
+	}
+	int missing = 0;
+	for (int i = 0; i < TEST_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		missing += workers[i].missing;
+	}
+	CHECK(missing == 0);
+
+	// once nobody reads, everything replaced can go, and the newest set is
+	// the writer's
+	CHECK(set_rcu_reclaim(rcu));
+	set_rcu_reader* handle = set_rcu_register(rcu);
+	int* newest = set_rcu_read_begin(rcu, handle);
+	CHECK(set_size(newest) == 5000 && newest == st);
+	set_rcu_read_end(handle);
+	set_rcu_unregister(handle);
+	set_rcu_free(rcu);
+	CHECK(set_size(st) == 5000 && set_contains(&st, 4999).code);
+	set_free(st);
+}
+
+// the sharded set's version of concurrent_worker
+static void* sharded_worker(void* arg) {
+	worker* w = (worker*)arg;
+	set_sharded* sh = (set_sharded*)w->target;
+
+	for (int i = 0; i < TEST_PER_THREAD; i++) {
+		int v = w->id * TEST_PER_THREAD + i;
+		int shared = -1 - i % 1000;
+		w->added += set_sharded_add(sh, &v);
+		w->added += set_sharded_add(sh, &shared);
+		w->missing += !set_sharded_contains(sh, &v) + !set_sharded_contains(sh, &shared);
+	}
+	for (int i = 1; i < TEST_PER_THREAD; i += 2) {
+		int v = w->id * TEST_PER_THREAD + i;
+		w->removed += set_sharded_remove(sh, &v);
+		w->missing += set_sharded_contains(sh, &v);
+	}
+	return NULL;
+}
+
+// two sharded sets, each thread merging one into the other
+typedef struct {
+	set_sharded* into;
+	set_sharded* from;
+} union_job;
+
+static void* union_worker(void* arg) {
+	union_job* job = (union_job*)arg;
+	for (int i = 0; i < 1000; i++) {
+		set_sharded_union_update(job->into, job->from);
+	}
+	return NULL;
+}
+
+static void test_sharded(void) {
+	pthread_t threads[TEST_THREADS];
+	worker workers[TEST_THREADS];
+	set_engine engines[] = {SET_ENGINE_SORTED, SET_ENGINE_SWISS};
+
+	for (int e = 0; e < 2; e++) {
+		set_sharded* sh = set_create_sharded(sizeof(int), 4, engines[e]);
+		memset(workers, 0, sizeof(workers));
+		for (int i = 0; i < TEST_THREADS; i++) {
+			workers[i].target = sh;
+			workers[i].id = i;
+			pthread_create(&threads[i], NULL, sharded_worker, &workers[i]);
+		}
+		int added = 0, removed = 0, missing = 0;
+		for (int i = 0; i < TEST_THREADS; i++) {
+			pthread_join(threads[i], NULL);
+			added += workers[i].added;
+			removed += workers[i].removed;
+			missing += workers[i].missing;
+		}
+		CHECK(added == TEST_THREADS * TEST_PER_THREAD + 1000);
+		CHECK(removed == TEST_THREADS * TEST_PER_THREAD / 2 && missing == 0);
+
+		size_t expected = TEST_THREADS * TEST_PER_THREAD / 2 + 1000, visited = 0;
+		CHECK(set_sharded_size(sh) == expected);
+		set_sharded_foreach(sh, count_element, &visited);
+		CHECK(visited == expected);
+		int* all = (int*)set_sharded_to_set(sh, SET_ENGINE_SORTED);
+		CHECK(set_size(all) == expected);
+		for (int v = -1000; v < TEST_THREADS * TEST_PER_THREAD; v++) {
+			CHECK(set_contains(&all, v).code == (v < 0 || v % 2 == 0));
+		}
+		set_free(all);
+		set_sharded_free(sh);
+	}
+
+	// two sets merged into each other at once, with as many shards and with
+	// different numbers of them, must not wait on each other forever. few
+	// shards make it likely the threads want the same ones
+	for (unsigned bits = 0; bits < 2; bits++) {
+		set_sharded* a = set_create_sharded(sizeof(int), 1, SET_ENGINE_SWISS);
+		set_sharded* b = set_create_sharded(sizeof(int), bits, SET_ENGINE_SORTED);
+		for (int v = 0; v < 500; v++) {
+			set_sharded_add(v % 2 ? a : b, &v);
+		}
+		union_job jobs[2] = {{a, b}, {b, a}};
+		for (int i = 0; i < 2; i++) {
+			pthread_create(&threads[i], NULL, union_worker, &jobs[i]);
+		}
+		for (int i = 0; i < 2; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		CHECK(set_sharded_size(a) == 500 && set_sharded_size(b) == 500);
+		set_sharded_free(a);
+		set_sharded_free(b);
+	}
+
+	// a single shard
+	set_sharded* one = set_create_sharded(sizeof(int), 0, SET_ENGINE_SORTED);
+	int v = 5;
+	CHECK(set_sharded_size(one) == 0 && !set_sharded_remove(one, &v));
+	CHECK(set_sharded_add(one, &v) && !set_sharded_add(one, &v) && set_sharded_contains(one, &v));
+	int* all = (int*)set_sharded_to_set(one, SET_ENGINE_SWISS);
+	CHECK(set_size(all) == 1 && all[0] == 5);
+	set_free(all);
+	set_sharded_free(one);
+}
+#endif
 
 int main() {
-	int* aaa = set_create();
-	set_add(&aaa, 5);
-	set_add(&aaa, 5);
-	set_add(&aaa, 6);
-	
-	printf("%d %d\n", aaa[0], aaa[1]);
+	test_basics();
+	test_swiss();
+	test_full_width();
+	test_add_many();
+	test_algebra();
+	test_contains_many();
+	test_single_block();
+	test_allocators();
+	test_small();
+	test_adaptive();
+	test_bitmap();
+	test_roaring();
+	test_freeze();
+	test_directory();
+	test_pma();
+	test_buffer();
+	test_discard();
+	test_remove_if();
+	test_growth();
+	test_mmap_allocator();
+	test_files();
+	test_copies();
+	test_hamt();
+#ifdef TEST_THREADED
+	test_concurrent();
+	test_rcu();
+	test_sharded();
+#endif
 
+	if (failures != 0) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all tests passed\n");
 	return 0;
 }